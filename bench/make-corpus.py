@@ -0,0 +1,139 @@
+#!/usr/bin/env python3
+# Generate DWML documents in NDFDgen time-series format for weather_bench.
+# usage: make-corpus.py npoints days epoch utc_offset seed > file.xml
+import sys, random, datetime
+
+def iso(t, off):
+    lt = t + datetime.timedelta(hours=off)
+    sign = '-' if off < 0 else '+'
+    return lt.strftime('%Y-%m-%dT%H:%M:%S') + '%s%02d:00' % (sign, abs(off))
+
+def layout(key, starts, ends, off):
+    s = ['\t\t<time-layout time-coordinate="local" summarization="none">',
+         '\t\t\t<layout-key>%s</layout-key>' % key]
+    for i, st in enumerate(starts):
+        s.append('\t\t\t<start-valid-time>%s</start-valid-time>' % iso(st, off))
+        if ends:
+            s.append('\t\t\t<end-valid-time>%s</end-valid-time>' % iso(ends[i], off))
+    s.append('\t\t</time-layout>')
+    return '\n'.join(s)
+
+WX = [None, None, None,
+      [('chance', 'light', 'rain showers', 'none', None)],
+      [('slight chance', 'none', 'thunderstorms', 'none', None)],
+      [('likely', 'moderate', 'rain', 'none', None), ('chance', 'none', 'thunderstorms', 'none', 'and')],
+      [('patchy', 'none', 'frost', 'none', None)],
+      [('chance', 'light', 'snow', 'none', None)]]
+
+def doc(npoints, days, base, off, seed):
+    r = random.Random(seed)
+    base = base.replace(minute=0, second=0)
+    # hourly elements: 3h step for 3 days, then 6h
+    hourly = []
+    t = base
+    end = base + datetime.timedelta(days=days)
+    while t < end:
+        hourly.append(t)
+        t += datetime.timedelta(hours=3 if t - base < datetime.timedelta(days=3) else 6)
+    day0 = (base + datetime.timedelta(hours=off)).replace(hour=0) - datetime.timedelta(hours=off)
+    maxs = [day0 + datetime.timedelta(days=d, hours=8) for d in range(days)]
+    maxe = [s + datetime.timedelta(hours=12) for s in maxs]
+    mins = [day0 + datetime.timedelta(days=d, hours=20) for d in range(days)]
+    mine = [s + datetime.timedelta(hours=13) for s in mins]
+    snow = hourly[:12]
+    snowe = [s + datetime.timedelta(hours=6) for s in snow]
+    hz = [base + datetime.timedelta(hours=4)]
+    hze = [base + datetime.timedelta(hours=40)]
+    k_max = 'k-p24h-n%d-1' % days
+    k_min = 'k-p24h-n%d-2' % days
+    k_hr = 'k-p3h-n%d-3' % len(hourly)
+    k_snow = 'k-p6h-n%d-4' % len(snow)
+    k_hz = 'k-p36h-n1-5'
+    out = ['<?xml version="1.0"?>',
+           '<dwml version="1.0" xmlns:xsd="http://www.w3.org/2001/XMLSchema" xmlns:xsi="http://www.w3.org/2001/XMLSchema-instance" xsi:noNamespaceSchemaLocation="http://graphical.weather.gov/xml/DWMLgen/schema/DWML.xsd">',
+           '\t<head>',
+           '\t\t<product srsName="WGS 1984" concise-name="time-series" operational-mode="official">',
+           '\t\t\t<title>NOAA\'s National Weather Service Forecast Data</title>',
+           '\t\t\t<field>meteorological</field>',
+           '\t\t\t<category>forecast</category>',
+           '\t\t\t<creation-date refresh-frequency="PT1H">%s</creation-date>' % base.strftime('%Y-%m-%dT%H:%M:%SZ'),
+           '\t\t</product>',
+           '\t\t<source>',
+           '\t\t\t<more-information>http://www.nws.noaa.gov/forecasts/xml/</more-information>',
+           '\t\t\t<production-center>Meteorological Development Laboratory<sub-center>Product Generation Branch</sub-center></production-center>',
+           '\t\t\t<disclaimer>http://www.nws.noaa.gov/disclaimer.html</disclaimer>',
+           '\t\t\t<credit>http://www.weather.gov/</credit>',
+           '\t\t\t<credit-logo>http://www.weather.gov/images/xml_logo.gif</credit-logo>',
+           '\t\t\t<feedback>http://www.weather.gov/feedback.php</feedback>',
+           '\t\t</source>',
+           '\t</head>',
+           '\t<data>']
+    for p in range(npoints):
+        lat = 40.71 + r.uniform(-1, 1)
+        lon = -74.01 + r.uniform(-1, 1)
+        out.append('\t\t<location>')
+        out.append('\t\t\t<location-key>point%d</location-key>' % (p + 1))
+        out.append('\t\t\t<point latitude="%.2f" longitude="%.2f"/>' % (lat, lon))
+        out.append('\t\t</location>')
+    for p in range(npoints):
+        out.append('\t\t<moreWeatherInformation applicable-location="point%d">http://forecast.weather.gov/MapClick.php?textField1=40.71&amp;textField2=-74.01</moreWeatherInformation>' % (p + 1))
+    out.append(layout(k_max, maxs, maxe, off))
+    out.append(layout(k_min, mins, mine, off))
+    out.append(layout(k_hr, hourly, None, off))
+    out.append(layout(k_snow, snow, snowe, off))
+    out.append(layout(k_hz, hz, hze, off))
+    for p in range(npoints):
+        out.append('\t\t<parameters applicable-location="point%d">' % (p + 1))
+        def block(tag, typ, units, key, name, vals):
+            a = '\t\t\t<%s type="%s" units="%s" time-layout="%s">' % (tag, typ, units, key)
+            if typ is None:
+                a = '\t\t\t<%s units="%s" time-layout="%s">' % (tag, units, key)
+            out.append(a)
+            out.append('\t\t\t\t<name>%s</name>' % name)
+            for v in vals:
+                out.append('\t\t\t\t<value>%d</value>' % v)
+            out.append('\t\t\t</%s>' % tag)
+        t0 = r.randint(-5, 25)
+        block('temperature', 'maximum', 'Celsius', k_max, 'Daily Maximum Temperature', [t0 + r.randint(3, 9) for _ in maxs])
+        block('temperature', 'minimum', 'Celsius', k_min, 'Daily Minimum Temperature', [t0 - r.randint(0, 6) for _ in mins])
+        hourly_t = [t0 + r.randint(-4, 6) for _ in hourly]
+        block('temperature', 'hourly', 'Celsius', k_hr, 'Temperature', hourly_t)
+        block('temperature', 'apparent', 'Celsius', k_hr, 'Apparent Temperature', [v - r.randint(0, 3) for v in hourly_t])
+        block('precipitation', 'snow', 'centimeters', k_snow, 'Snow Amount', [r.choice([0, 0, 0, 1, 2]) for _ in snow])
+        block('wind-speed', 'sustained', 'meters/second', k_hr, 'Wind Speed', [r.randint(0, 9) for _ in hourly])
+        block('direction', 'wind', 'degrees true', k_hr, 'Wind Direction', [r.randrange(0, 360, 10) for _ in hourly])
+        block('cloud-amount', 'total', 'percent', k_hr, 'Cloud Cover Amount', [r.randint(0, 100) for _ in hourly])
+        block('humidity', 'relative', 'percent', k_hr, 'Relative Humidity', [r.randint(20, 100) for _ in hourly])
+        out.append('\t\t\t<weather time-layout="%s">' % k_hr)
+        out.append('\t\t\t\t<name>Weather Type, Coverage, and Intensity</name>')
+        for _ in hourly:
+            wx = r.choice(WX)
+            if wx is None:
+                out.append('\t\t\t\t<weather-conditions/>')
+                continue
+            out.append('\t\t\t\t<weather-conditions>')
+            for cov, inten, typ, qual, add in wx:
+                a = ' additive="%s"' % add if add else ''
+                out.append('\t\t\t\t\t<value coverage="%s" intensity="%s"%s weather-type="%s" qualifier="%s"/>' % (cov, inten, a, typ, qual))
+            out.append('\t\t\t\t</weather-conditions>')
+        out.append('\t\t\t</weather>')
+        out.append('\t\t\t<hazards time-layout="%s">' % k_hz)
+        out.append('\t\t\t\t<name>Watches, Warnings, and Advisories</name>')
+        if p % 2 == 0:
+            out.append('\t\t\t\t<hazard-conditions>')
+            out.append('\t\t\t\t\t<hazard hazardCode="WS.W" phenomena="Winter Storm" significance="Warning" hazardType="long duration">')
+            out.append('\t\t\t\t\t\t<hazardTextURL>http://forecast.weather.gov/wwamap/wwatxtget.php?cwa=usa&amp;wwa=Winter%20Storm%20Warning</hazardTextURL>')
+            out.append('\t\t\t\t\t</hazard>')
+            out.append('\t\t\t\t</hazard-conditions>')
+        else:
+            out.append('\t\t\t\t<hazard-conditions/>')
+        out.append('\t\t\t</hazards>')
+        out.append('\t\t</parameters>')
+    out.append('\t</data>')
+    out.append('</dwml>')
+    return '\n'.join(out) + '\n'
+
+if __name__ == '__main__':
+    npoints, days, epoch, off, seed = map(int, sys.argv[1:6])
+    base = datetime.datetime.utcfromtimestamp(epoch)
+    sys.stdout.write(doc(npoints, days, base, off, seed))
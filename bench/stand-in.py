@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+# Local NDFD and SMTP stand-ins for exercising the weather pipeline.
+# usage: stand-in.py [-p http_port] [-s smtp_port] [-d fetch_delay] [-m send_delay]
+#   weather --url=http://127.0.0.1:8080/ndfdXMLclient.php? --smtp=smtp-local.txt ...
+# Forecasts are generated by make-corpus.py with one point per requested zip
+# or lat,lon pair; mail is accepted and dropped. Both print request counts.
+import sys, time, getopt, datetime, threading, importlib.util, socketserver, os
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import urlparse, parse_qs
+
+spec = importlib.util.spec_from_file_location('corpus', os.path.join(os.path.dirname(__file__), 'make-corpus.py'))
+corpus = importlib.util.module_from_spec(spec)
+spec.loader.exec_module(corpus)
+
+fetch_delay = 0.0
+send_delay = 0.0
+counts = {'fetch': 0, 'mail': 0}
+lock = threading.Lock()
+
+def count(what):
+    with lock:
+        counts[what] += 1
+        sys.stderr.write('%s %d\n' % (what, counts[what]))
+
+class Ndfd(BaseHTTPRequestHandler):
+    def do_GET(self):
+        q = parse_qs(urlparse(self.path).query)
+        points = q.get('zipCodeList', q.get('listLatLon', ['']))[0].split()
+        base = datetime.datetime.utcnow()
+        body = corpus.doc(max(len(points), 1), 7, base, -4, hash(self.path)).encode()
+        time.sleep(fetch_delay)
+        self.send_response(200)
+        self.send_header('Content-Type', 'text/xml')
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+        count('fetch')
+
+    def log_message(self, fmt, *args):
+        pass
+
+class Smtp(socketserver.StreamRequestHandler):
+    def reply(self, line):
+        self.wfile.write((line + '\r\n').encode())
+
+    def handle(self):
+        self.reply('220 localhost stand-in')
+        challenges = 0
+        for line in self.rfile:
+            cmd = line.decode(errors='replace').strip()
+            verb = cmd.split(' ')[0].upper()
+            if challenges > 0:
+                challenges -= 1
+                self.reply('334 ' if challenges > 0 else '235 ok')
+            elif verb in ('EHLO', 'HELO'):
+                self.reply('250-localhost')
+                self.reply('250 AUTH PLAIN LOGIN')
+            elif verb == 'AUTH':
+                args = cmd.split(' ')
+                if len(args) > 2:
+                    self.reply('235 ok')
+                else:
+                    challenges = 2 if args[1].upper() == 'LOGIN' else 1
+                    self.reply('334 ')
+            elif verb == 'DATA':
+                self.reply('354 end with .')
+                for data in self.rfile:
+                    if data in (b'.\r\n', b'.\n'):
+                        break
+                time.sleep(send_delay)
+                self.reply('250 queued')
+                count('mail')
+            elif verb == 'QUIT':
+                self.reply('221 bye')
+                return
+            else:
+                self.reply('250 ok')
+
+class SmtpServer(socketserver.ThreadingMixIn, socketserver.TCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+
+if __name__ == '__main__':
+    http_port, smtp_port = 8080, 2525
+    opts, _ = getopt.getopt(sys.argv[1:], 'p:s:d:m:')
+    for o, v in opts:
+        if o == '-p': http_port = int(v)
+        if o == '-s': smtp_port = int(v)
+        if o == '-d': fetch_delay = float(v)
+        if o == '-m': send_delay = float(v)
+    smtp = SmtpServer(('127.0.0.1', smtp_port), Smtp)
+    threading.Thread(target=smtp.serve_forever, daemon=True).start()
+    ThreadingHTTPServer(('127.0.0.1', http_port), Ndfd).serve_forever()
@@ -0,0 +1,749 @@
+/**
+ * Serge Voilokov, 2015.
+ * Parser and formatter benchmarks over recorded DWML corpus.
+ */
+
+#include "dwml.h"
+#include "history.h"
+#include "shmcache.h"
+#include "common/struct.h"
+#include <err.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <zlib.h>
+#include <libxml/parser.h>
+
+/* all corpus documents are generated at this time */
+#define BASE_TIME 1440144000
+
+#ifndef BENCH_CORPUS_DIR
+#define BENCH_CORPUS_DIR "bench/corpus"
+#endif
+
+static const char *corpus_names[] = {
+	"single-zip",
+	"multi-zip",
+	"long-horizon",
+	NULL
+};
+
+/* bad/ documents with the status parser must give them, batch runs skip them */
+static const struct {
+	const char *name;
+	enum dwml_status status;
+} malformed[] = {
+	{ "empty",          DWML_ERR_XML },
+	{ "not-xml",        DWML_ERR_XML },
+	{ "truncated",      DWML_ERR_XML },
+	{ "wrong-root",     DWML_ERR_FORMAT },
+	{ "no-data",        DWML_ERR_FORMAT },
+	{ "no-layouts",     DWML_ERR_FORMAT },
+	{ "bad-layout-key", DWML_ERR_FORMAT },
+	{ "bad-time",       DWML_ERR_FORMAT },
+	{ "extra-times",    DWML_ERR_FORMAT },
+	{ "odd-attributes", DWML_OK },      /* unknown and missing bits are ignored */
+	{ NULL,             DWML_OK }
+};
+
+static double min_seconds = 0.5;   /* run each benchmark at least this long */
+static char tmp_dir[] = "/tmp/weather_bench.XXXXXX";  /* history and cache files */
+
+/* keep whole document, long-horizon has 14 days */
+static const struct dwml_opts opts = {
+	.base_time = BASE_TIME,
+	.horizon = 0
+};
+
+/* digest run decodes only the blocks it reads */
+static const struct dwml_opts digest_opts = {
+	.base_time = BASE_TIME,
+	.horizon = 0,
+	.fields = DWML_FIELDS_DIGEST
+};
+
+/* ===== allocation counting ===================== */
+
+static uint64_t allocs;
+
+#ifdef __GLIBC__
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+void *
+malloc(size_t size)
+{
+	allocs++;
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+	allocs++;
+	return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	allocs++;
+	return __libc_realloc(ptr, size);
+}
+#define HAVE_ALLOC_COUNT 1
+#else
+#define HAVE_ALLOC_COUNT 0
+#endif
+
+/* ===== runner ===================== */
+
+struct doc
+{
+	const char *name;
+	char *data;
+	size_t size;
+	struct dwml *dwml;   /* parsed once for formatter benchmarks */
+	int zip;             /* history file of this document */
+	char plain[PATH_MAX];  /* document written as cache file */
+	char gz[PATH_MAX];     /* and as compressed cache file */
+	long history_count;  /* forecasts appended to history */
+};
+
+struct result
+{
+	uint64_t iterations;
+	double ns_per_op;
+	double allocs_per_op;
+};
+
+typedef void (*bench_fn)(struct doc *doc);
+
+static uint64_t
+now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct result
+run(bench_fn fn, struct doc *doc)
+{
+	struct result r;
+	uint64_t i, n = 1, start, elapsed, a;
+
+	/* warm up caches and find iteration count that takes min_seconds */
+	for (;;) {
+		a = allocs;
+		start = now_ns();
+		for (i = 0; i < n; i++)
+			fn(doc);
+		elapsed = now_ns() - start;
+		a = allocs - a;
+
+		if (elapsed >= min_seconds * 1e9)
+			break;
+
+		n = elapsed == 0 ? n * 100 : n * 2;
+	}
+
+	r.iterations = n;
+	r.ns_per_op = (double)elapsed / n;
+	r.allocs_per_op = HAVE_ALLOC_COUNT ? (double)a / n : -1;
+
+	return r;
+}
+
+static void
+report(const char *bench, const struct doc *doc, struct result r)
+{
+	printf("%-20s %-14s %10llu %14.0f %12.1f %10.2f\n", bench, doc->name,
+	       (unsigned long long)r.iterations, r.ns_per_op, r.allocs_per_op,
+	       doc->size / r.ns_per_op * 1e9 / (1 << 20));
+}
+
+/* ===== benchmarks ===================== */
+
+static void
+bench_parse(struct doc *doc)
+{
+	dwml_free(dwml_parse_memory(doc->data, doc->size, &opts, NULL));
+}
+
+static void
+bench_parse_fields(struct doc *doc)
+{
+	dwml_free(dwml_parse_memory(doc->data, doc->size, &digest_opts, NULL));
+}
+
+static void
+bench_parse_file(struct doc *doc)
+{
+	dwml_free(dwml_parse_file(doc->plain, &opts, NULL));
+}
+
+static void
+bench_parse_file_gz(struct doc *doc)
+{
+	dwml_free(dwml_parse_file(doc->gz, &opts, NULL));
+}
+
+static void
+bench_format_text(struct doc *doc)
+{
+	struct buf buf;
+
+	buf_init(&buf);
+	dwml_format_text(&buf, doc->dwml, LEGEND_BOTTOM);
+	free(buf.s);
+}
+
+static void
+bench_format_html(struct doc *doc)
+{
+	struct buf buf;
+
+	buf_init(&buf);
+	dwml_format_html(&buf, doc->dwml);
+	free(buf.s);
+}
+
+static void
+bench_format_json(struct doc *doc)
+{
+	struct buf buf;
+
+	buf_init(&buf);
+	dwml_format_json(&buf, doc->dwml);
+	free(buf.s);
+}
+
+static void
+bench_format_csv(struct doc *doc)
+{
+	struct buf buf;
+
+	buf_init(&buf);
+	dwml_format_csv(&buf, doc->dwml);
+	free(buf.s);
+}
+
+static void
+bench_format_bin(struct doc *doc)
+{
+	struct buf buf;
+
+	buf_init(&buf);
+	dwml_format_bin(&buf, doc->dwml);
+	free(buf.s);
+}
+
+/* convert copy of rows, as weather does for each imperial report */
+static void
+bench_units(struct doc *doc)
+{
+	struct dwml view = *doc->dwml;
+
+	view.rows = malloc(view.n_rows * sizeof(struct row) + 1);
+	memcpy(view.rows, doc->dwml->rows, view.n_rows * sizeof(struct row));
+	if (dwml_set_units(&view, UNITS_IMPERIAL) != 0)
+		err(1, "cannot convert units");
+	free(view.rows);
+}
+
+static void
+bench_digest(struct doc *doc)
+{
+	struct day_summary *days;
+
+	if (dwml_daily_summary(doc->dwml, &days) < 0)
+		errx(1, "cannot allocate daily summary");
+	free(days);
+}
+
+/* hourly issuance where one temperature changes, as between real updates */
+static void
+bench_history_append(struct doc *doc)
+{
+	struct row *r = &doc->dwml->rows[doc->history_count % doc->dwml->n_rows];
+
+	doc->dwml->creation_date += 3600;
+	r->temp_hourly.celcius += doc->history_count % 2 ? -1 : 1;
+
+	if (history_append(tmp_dir, doc->zip, doc->dwml) < 0)
+		errx(1, "cannot append history");
+	doc->history_count++;
+}
+
+/* decoded rows, so every forecast is looked at */
+static void
+count_rows(const struct history_forecast *f, void *arg)
+{
+	*(long *)arg += f->n_rows;
+}
+
+/* last day of issuances */
+static void
+bench_history_query(struct doc *doc)
+{
+	long n = 0;
+	time_t to = doc->dwml->creation_date;
+
+	if (history_query(tmp_dir, doc->zip, to - 24 * 3600, to, count_rows, &n) < 0)
+		errx(1, "cannot query history");
+}
+
+static struct {
+	const char *name;
+	bench_fn fn;
+} benchmarks[] = {
+	{ "parse",          bench_parse },
+	{ "parse_fields",   bench_parse_fields },
+	{ "parse_file",     bench_parse_file },
+	{ "parse_file_gz",  bench_parse_file_gz },
+	{ "format_text",    bench_format_text },
+	{ "format_html",    bench_format_html },
+	{ "format_json",    bench_format_json },
+	{ "format_csv",     bench_format_csv },
+	{ "format_bin",     bench_format_bin },
+	{ "units",          bench_units },
+	{ "digest",         bench_digest },
+	{ "history_append", bench_history_append },
+	{ "history_query",  bench_history_query },
+	{ NULL,             NULL }
+};
+
+/* print stored bytes per forecast and remove history files */
+static void
+history_report(struct doc *docs, size_t n_docs)
+{
+	char path[PATH_MAX];
+	const char *ext[] = { "wxh", "wxi" };
+	struct stat st;
+	size_t i, j;
+	long bytes;
+
+	for (i = 0; i < n_docs; i++) {
+		bytes = 0;
+		for (j = 0; j < 2; j++) {
+			snprintf(path, PATH_MAX, "%s/zip-%05d.%s", tmp_dir, docs[i].zip, ext[j]);
+			if (stat(path, &st) == 0)
+				bytes += st.st_size;
+			unlink(path);
+		}
+		if (docs[i].history_count > 0)
+			printf("history %-14s %ld forecasts, %.1f bytes/forecast, %zu bytes xml\n", docs[i].name,
+			       docs[i].history_count, (double)bytes / docs[i].history_count, docs[i].size);
+	}
+
+}
+
+/* read syscalls and bytes of this process so far, -1 without /proc */
+static int
+read_counters(long long *syscr, long long *rchar)
+{
+	char line[64];
+	FILE *f = fopen("/proc/self/io", "r");
+
+	if (f == NULL)
+		return -1;
+
+	*syscr = *rchar = -1;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		sscanf(line, "syscr: %lld", syscr);
+		sscanf(line, "rchar: %lld", rchar);
+	}
+
+	fclose(f);
+
+	return *syscr < 0 ? -1 : 0;
+}
+
+/* read syscalls per parse of plain (mapped) and gzip (streamed) cache file */
+static void
+io_report(struct doc *docs, size_t n_docs)
+{
+	const int n = 100;
+	long long syscr[3], rchar[3];
+	const char *path;
+	size_t i, j;
+	int k;
+
+	for (i = 0; i < n_docs; i++) {
+		for (j = 0; j < 2; j++) {
+			path = j == 0 ? docs[i].plain : docs[i].gz;
+			/* first pair measures reading the counters themselves */
+			if (read_counters(&syscr[0], &rchar[0]) != 0)
+				return;
+			read_counters(&syscr[1], &rchar[1]);
+			for (k = 0; k < n; k++)
+				dwml_free(dwml_parse_file(path, &opts, NULL));
+			read_counters(&syscr[2], &rchar[2]);
+			printf("io      %-14s %-5s %6.1f reads/doc %10.0f bytes read/doc\n", docs[i].name,
+			       j == 0 ? "plain" : "gzip",
+			       (double)(syscr[2] - 2 * syscr[1] + syscr[0]) / n,
+			       (double)(rchar[2] - 2 * rchar[1] + rchar[0]) / n);
+		}
+	}
+}
+
+/* print disk bytes saved by compressed cache and remove cache files */
+static void
+cache_report(struct doc *docs, size_t n_docs)
+{
+	struct stat st;
+	size_t i;
+
+	for (i = 0; i < n_docs; i++) {
+		if (stat(docs[i].gz, &st) == 0)
+			printf("cache   %-14s %zu bytes xml, %lld bytes gzip, %.1f%% saved\n", docs[i].name,
+			       docs[i].size, (long long)st.st_size, 100.0 - 100.0 * st.st_size / docs[i].size);
+		unlink(docs[i].plain);
+		unlink(docs[i].gz);
+	}
+}
+
+/*
+ * Parse each malformed document, print status, time to reject and message.
+ * Returns number of documents not given their expected status.
+ */
+static int
+malformed_report(const char *dir)
+{
+	char path[PATH_MAX];
+	struct dwml_error error;
+	struct dwml *dwml;
+	uint64_t start, elapsed, n;
+	size_t i;
+	int wrong = 0;
+
+	for (i = 0; malformed[i].name != NULL; i++) {
+		snprintf(path, PATH_MAX, "%s/bad/%s.xml", dir, malformed[i].name);
+
+		start = now_ns();
+		n = 0;
+		do {
+			dwml = dwml_parse_file(path, &opts, &error);
+			dwml_free(dwml);
+			n++;
+			elapsed = now_ns() - start;
+		} while (elapsed < min_seconds * 1e9 / 10);
+
+		if (dwml != NULL)
+			error.status = DWML_OK;
+		if (error.status != malformed[i].status)
+			wrong++;
+
+		printf("bad     %-14s %-6s %10.0f ns %s%s\n", malformed[i].name, dwml_status_name(error.status),
+		       (double)elapsed / n, error.status != malformed[i].status ? "UNEXPECTED " : "",
+		       dwml != NULL ? "" : error.message);
+	}
+
+	return wrong;
+}
+
+/* write document as weather writes its cache, plain and compressed */
+static void
+write_cache_files(struct doc *doc)
+{
+	FILE *f;
+	gzFile gz;
+
+	snprintf(doc->plain, PATH_MAX, "%s/%s.xml", tmp_dir, doc->name);
+	snprintf(doc->gz, PATH_MAX, "%s/%s.xml.gz", tmp_dir, doc->name);
+
+	f = fopen(doc->plain, "w");
+	if (f == NULL || fwrite(doc->data, 1, doc->size, f) != doc->size || fclose(f) != 0)
+		err(1, "cannot write %s", doc->plain);
+
+	gz = gzopen(doc->gz, "wb6");
+	if (gz == NULL || gzwrite(gz, doc->data, doc->size) != (int)doc->size || gzclose(gz) != Z_OK)
+		errx(1, "cannot write %s", doc->gz);
+}
+
+static void
+load_doc(struct doc *doc, const char *dir, const char *name)
+{
+	char path[PATH_MAX];
+	FILE *f;
+	long size;
+
+	snprintf(path, PATH_MAX, "%s/%s.xml", dir, name);
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		err(1, "cannot open %s", path);
+
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	rewind(f);
+
+	doc->name = name;
+	doc->history_count = 0;
+	doc->size = size;
+	doc->data = malloc(size);
+	if (fread(doc->data, 1, size, f) != (size_t)size)
+		err(1, "cannot read %s", path);
+
+	fclose(f);
+
+	doc->dwml = dwml_parse_memory(doc->data, doc->size, &opts, NULL);
+	if (doc->dwml == NULL)
+		errx(1, "cannot parse %s", path);
+}
+
+/* ===== shared memory hammer ===================== */
+
+#define HAMMER_ZIPS 64
+
+struct hammer_counts
+{
+	uint64_t gets;
+	uint64_t misses;        /* not written yet or writer kept slot busy */
+	uint64_t torn;          /* copies mixing two writes, must stay 0 */
+	uint64_t ns;
+};
+
+/* length and bytes depend on zip, generation and position, so any mix of writes shows */
+static size_t
+payload_len(int zip, int64_t gen, int part)
+{
+	return 1000 + (size_t)(zip * 7919 + gen * 104729 + part) % (SHMCACHE_DATA_SIZE / 2 - 1000);
+}
+
+static char
+payload_byte(int zip, int64_t gen, int part, size_t i)
+{
+	return (char)(zip * 31 + gen * 17 + part * 101 + i);
+}
+
+static void
+fill_payload(char *p, int zip, int64_t gen, int part)
+{
+	size_t i, n = payload_len(zip, gen, part);
+
+	for (i = 0; i < n; i++)
+		p[i] = payload_byte(zip, gen, part, i);
+}
+
+static bool
+check_payload(const struct shmcache_entry *e)
+{
+	int64_t gen = e->creation_date;
+	const char *p = e->data;
+	size_t i;
+
+	if (e->html_len != payload_len(e->zip, gen, 0) || e->bin_len != payload_len(e->zip, gen, 1))
+		return false;
+
+	for (i = 0; i < e->html_len; i++)
+		if (p[i] != payload_byte(e->zip, gen, 0, i))
+			return false;
+
+	for (i = 0, p += e->html_len; i < e->bin_len; i++)
+		if (p[i] != payload_byte(e->zip, gen, 1, i))
+			return false;
+
+	return true;
+}
+
+static void
+hammer_read(const char *name, uint64_t deadline, unsigned seed, struct hammer_counts *counts)
+{
+	static struct shmcache_entry e;
+	struct shmcache c;
+	uint64_t start;
+	int zip;
+
+	if (shmcache_open(&c, name, false, 0) != 0)
+		err(1, "cannot open shared memory %s", name);
+
+	while ((start = now_ns()) < deadline) {
+		zip = 1 + rand_r(&seed) % HAMMER_ZIPS;
+		if (shmcache_get(&c, zip, &e) != 0)
+			counts->misses++;
+		else if (e.zip != zip || !check_payload(&e))
+			counts->torn++;
+		counts->gets++;
+		counts->ns += now_ns() - start;
+	}
+
+	shmcache_close(&c);
+}
+
+/*
+ * Reader processes copy random zips out of a segment that one writer
+ * keeps rewriting with checkable payloads. Returns number of torn reads.
+ */
+static uint64_t
+hammer(int n_readers)
+{
+	char name[64];
+	char *html, *bin;
+	struct shmcache c;
+	struct hammer_counts *counts, total = { 0 };
+	uint64_t deadline, puts = 0, failed = 0, start;
+	int64_t gen = 0;
+	int i, zip, status;
+
+	snprintf(name, sizeof(name), "/weather_bench.%d", getpid());
+	/* fewer slots than twice the zips, so probe chains are exercised too */
+	if (shmcache_open(&c, name, true, HAMMER_ZIPS + HAMMER_ZIPS / 4) != 0)
+		err(1, "cannot create shared memory %s", name);
+
+	counts = mmap(NULL, n_readers * sizeof(struct hammer_counts), PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	html = malloc(SHMCACHE_DATA_SIZE);
+	bin = malloc(SHMCACHE_DATA_SIZE);
+	if (counts == MAP_FAILED || html == NULL || bin == NULL)
+		err(1, "cannot allocate hammer buffers");
+	memset(counts, 0, n_readers * sizeof(struct hammer_counts));
+
+	start = now_ns();
+	deadline = start + min_seconds * 1e9;
+
+	for (i = 0; i < n_readers; i++) {
+		switch (fork()) {
+		case -1:
+			err(1, "cannot fork reader");
+		case 0:
+			hammer_read(name, deadline, i + 1, &counts[i]);
+			_exit(0);
+		}
+	}
+
+	while (now_ns() < deadline) {
+		gen++;
+		zip = 1 + gen % HAMMER_ZIPS;
+		fill_payload(html, zip, gen, 0);
+		fill_payload(bin, zip, gen, 1);
+		if (shmcache_put(&c, zip, gen, html, payload_len(zip, gen, 0), bin, payload_len(zip, gen, 1)) != 0)
+			failed++;
+		puts++;
+	}
+
+	for (i = 0; i < n_readers; i++)
+		if (wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			errx(1, "reader failed");
+
+	printf("shm     writer %10llu puts %8.0f puts/s %llu failed\n", (unsigned long long)puts,
+	       puts / ((now_ns() - start) / 1e9), (unsigned long long)failed);
+
+	for (i = 0; i < n_readers; i++) {
+		printf("shm     reader %-3d %7llu gets %8.0f ns/get %5.1f%% misses %llu torn\n", i,
+		       (unsigned long long)counts[i].gets,
+		       counts[i].gets > 0 ? (double)counts[i].ns / counts[i].gets : 0,
+		       counts[i].gets > 0 ? 100.0 * counts[i].misses / counts[i].gets : 0,
+		       (unsigned long long)counts[i].torn);
+		total.gets += counts[i].gets;
+		total.torn += counts[i].torn;
+	}
+
+	printf("shm     %d readers, %llu gets, %llu torn\n", n_readers, (unsigned long long)total.gets,
+	       (unsigned long long)total.torn);
+
+	shmcache_close(&c);
+	shm_unlink(name);
+	munmap(counts, n_readers * sizeof(struct hammer_counts));
+	free(html);
+	free(bin);
+
+	return total.torn;
+}
+
+static void
+usage()
+{
+	printf("usage: weather_bench [-t seconds] [-b benchmark] [corpus_dir]\n"
+	       "       weather_bench -x readers [-t seconds]\n"
+	       "options:\n"
+	       "    -t seconds     minimal run time of each benchmark, default 0.5\n"
+	       "    -b benchmark   run only benchmarks with this prefix\n"
+	       "    -x readers     instead of benchmarks, hammer shared memory forecast cache\n"
+	       "                   with reader processes and a writer for -t seconds,\n"
+	       "                   fails if any reader copies a torn slot\n"
+	       "output columns: benchmark, document, iterations, ns/doc, allocs/doc, MB/s of source xml\n"
+	       "history benchmarks also print stored bytes per forecast,\n"
+	       "io lines count read syscalls per parsed file, plain files are mapped,\n"
+	       "cache lines compare plain and gzip cache file sizes,\n"
+	       "bad lines show how corpus_dir/bad documents are rejected\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *dir = BENCH_CORPUS_DIR;
+	const char *only = NULL;
+	struct doc docs[10];
+	size_t i, j, n_docs = 0;
+	int ch, wrong, readers = 0;
+
+	while ((ch = getopt(argc, argv, "ht:b:x:")) != -1) {
+		switch (ch) {
+			case 't':
+				min_seconds = atof(optarg);
+				break;
+			case 'b':
+				only = optarg;
+				break;
+			case 'x':
+				readers = atoi(optarg);
+				break;
+			default:
+				usage();
+				return 1;
+		}
+	}
+
+	if (optind < argc)
+		dir = argv[optind];
+
+	if (readers > 0)
+		return hammer(readers) > 0;
+
+	xmlInitParser();
+
+	if (mkdtemp(tmp_dir) == NULL)
+		err(1, "cannot create %s", tmp_dir);
+
+	for (i = 0; corpus_names[i] != NULL; i++) {
+		load_doc(&docs[n_docs], dir, corpus_names[i]);
+		write_cache_files(&docs[n_docs]);
+		docs[n_docs].zip = n_docs + 1;
+		n_docs++;
+	}
+
+	printf("%-20s %-14s %10s %14s %12s %10s\n", "benchmark", "document", "iterations", "ns/doc", "allocs/doc", "MB/s");
+
+	for (i = 0; benchmarks[i].name != NULL; i++) {
+		if (only != NULL && strncmp(benchmarks[i].name, only, strlen(only)) != 0)
+			continue;
+		for (j = 0; j < n_docs; j++)
+			report(benchmarks[i].name, &docs[j], run(benchmarks[i].fn, &docs[j]));
+	}
+
+	history_report(docs, n_docs);
+	io_report(docs, n_docs);
+	cache_report(docs, n_docs);
+	wrong = malformed_report(dir);
+	rmdir(tmp_dir);
+
+	for (j = 0; j < n_docs; j++) {
+		dwml_free(docs[j].dwml);
+		free(docs[j].data);
+	}
+
+	xmlCleanupParser();
+
+	return wrong > 0;
+}
@@ -0,0 +1,543 @@
+/**
+ * Serge Voilokov, 2015.
+ * Size bounded forecast cache directory with index file.
+ *
+ * dir/index is an open addressing hash table of fixed size slots, mapped
+ * shared by every process and serialized with flock. When the table fills
+ * up it is rebuilt into a new file renamed over the old one; a process
+ * that finds its descriptor no longer matches the path reopens the index.
+ */
+
+#include "cache.h"
+#include "tz.h"
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define INITIAL_CAPACITY 1024
+
+/* ===== table ======================= */
+
+static uint64_t
+hash(const char *key, int64_t hour)
+{
+	uint64_t h = 14695981039346656037ULL;
+	size_t i;
+
+	for (; *key != 0; key++)
+		h = (h ^ (unsigned char)*key) * 1099511628211ULL;
+
+	for (i = 0; i < sizeof(hour); i++, hour >>= 8)
+		h = (h ^ (hour & 0xff)) * 1099511628211ULL;
+
+	return h;
+}
+
+/* slot holding (key, hour); with insert, free slot for it if there is none */
+static struct cache_entry *
+probe(struct cache_header *h, struct cache_entry *e, const char *key, int64_t hour, bool insert)
+{
+	size_t i, n, deleted = SIZE_MAX;
+
+	i = hash(key, hour) % h->capacity;
+	for (n = 0; n < h->capacity; n++, i = (i + 1) % h->capacity) {
+		if (e[i].state == SLOT_EMPTY)
+			break;
+		if (e[i].state == SLOT_DELETED) {
+			if (deleted == SIZE_MAX)
+				deleted = i;
+			continue;
+		}
+		if (e[i].hour == hour && strncmp(e[i].key, key, sizeof(e[i].key)) == 0)
+			return &e[i];
+	}
+
+	if (!insert)
+		return NULL;
+
+	if (deleted != SIZE_MAX)
+		return &e[deleted];
+
+	return n < h->capacity ? &e[i] : NULL;
+}
+
+static void
+entry_path(const struct cache *c, const struct cache_entry *e, char *path)
+{
+	snprintf(path, PATH_MAX, "%s/%s", c->dir, e->name);
+}
+
+static void
+delete_entry(struct cache *c, struct cache_entry *e)
+{
+	char path[PATH_MAX];
+
+	entry_path(c, e, path);
+	unlink(path);
+
+	c->header->count--;
+	c->header->bytes -= e->size;
+	e->state = SLOT_DELETED;
+}
+
+/* ===== index file ================== */
+
+static void
+unmap_index(struct cache *c)
+{
+	if (c->map != NULL)
+		munmap(c->map, c->map_size);
+	if (c->fd != -1)
+		close(c->fd);
+
+	c->map = NULL;
+	c->fd = -1;
+}
+
+static int
+map_index(struct cache *c, int fd)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct cache_header))
+		return -1;
+
+	c->map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (c->map == MAP_FAILED) {
+		c->map = NULL;
+		return -1;
+	}
+
+	c->fd = fd;
+	c->map_size = st.st_size;
+	c->header = c->map;
+	c->entries = (struct cache_entry *)(c->header + 1);
+
+	if (memcmp(c->header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 ||
+	    c->header->version != CACHE_VERSION ||
+	    c->map_size != sizeof(struct cache_header) + c->header->capacity * sizeof(struct cache_entry)) {
+		unmap_index(c);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+index_path(const struct cache *c, char *path)
+{
+	snprintf(path, PATH_MAX, "%s/%s", c->dir, CACHE_INDEX);
+}
+
+/* lock index, reopen it if it was rebuilt by another process */
+static void
+lock_index(struct cache *c)
+{
+	char path[PATH_MAX];
+	struct stat a, b;
+	int fd;
+
+	index_path(c, path);
+	pthread_mutex_lock(&c->mutex);
+
+	for (;;) {
+		if (flock(c->fd, LOCK_EX) != 0)
+			err(1, "cannot lock %s", path);
+
+		if (stat(path, &a) == 0 && fstat(c->fd, &b) == 0 && a.st_ino == b.st_ino && a.st_dev == b.st_dev)
+			return;
+
+		unmap_index(c);
+		fd = open(path, O_RDWR);
+		if (fd == -1 || map_index(c, fd) != 0)
+			errx(1, "cannot open cache index %s", path);
+	}
+}
+
+static void
+unlock_index(struct cache *c)
+{
+	flock(c->fd, LOCK_UN);
+	pthread_mutex_unlock(&c->mutex);
+}
+
+/* "zip-10010-20150821-12.xml.gz" to key and hour */
+static bool
+parse_name(const char *name, char *key, int64_t *hour)
+{
+	const char *ext = strstr(name, ".xml");
+	int y, m, d, h;
+
+	if (ext == NULL || ext - name < 13 || ext - name - 12 >= 32 || strstr(name, ".tmp") != NULL)
+		return false;
+
+	if (sscanf(ext - 12, "-%4d%2d%2d-%2d", &y, &m, &d, &h) != 4)
+		return false;
+
+	memcpy(key, name, ext - name - 12);
+	key[ext - name - 12] = 0;
+	*hour = tz_timegm(y, m, d, h, 0, 0) / 3600;
+
+	return true;
+}
+
+/* files cached before index existed */
+static void
+import_files(struct cache *c)
+{
+	char path[PATH_MAX], key[32];
+	struct cache_entry *e;
+	struct dirent *de;
+	struct stat st;
+	int64_t hour;
+	DIR *dir;
+
+	dir = opendir(c->dir);
+	if (dir == NULL)
+		return;
+
+	while ((de = readdir(dir)) != NULL) {
+		if (strlen(de->d_name) >= sizeof(e->name) || !parse_name(de->d_name, key, &hour))
+			continue;
+
+		if (snprintf(path, PATH_MAX, "%s/%s", c->dir, de->d_name) >= PATH_MAX ||
+		    stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+
+		e = probe(c->header, c->entries, key, hour, true);
+		if (e == NULL || e->state == SLOT_LIVE || (c->header->used + 1) * 10 > c->header->capacity * 7)
+			continue;
+
+		memset(e, 0, sizeof(*e));
+		strcpy(e->key, key);
+		strcpy(e->name, de->d_name);
+		e->hour = hour;
+		e->last_use = 0;    /* evicted first */
+		e->size = st.st_size;
+		e->state = SLOT_LIVE;
+		c->header->used++;
+		c->header->count++;
+		c->header->bytes += e->size;
+	}
+
+	closedir(dir);
+}
+
+/*
+ * Write new index with live entries of current one, or imported files
+ * if there is none, and rename it over the old one. Called with index
+ * locked; new index is locked before it becomes visible.
+ */
+static void
+rebuild_index(struct cache *c, uint32_t capacity)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	struct cache old = *c;
+	struct cache_entry *e;
+	size_t i, size;
+	int fd;
+
+	index_path(c, path);
+	snprintf(tmp, PATH_MAX, "%s/%s.%d.tmp", c->dir, CACHE_INDEX, getpid());
+
+	size = sizeof(struct cache_header) + capacity * sizeof(struct cache_entry);
+
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1 || ftruncate(fd, size) != 0)
+		err(1, "cannot create %s", tmp);
+	if (flock(fd, LOCK_EX) != 0)
+		err(1, "cannot lock %s", tmp);
+
+	c->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (c->map == MAP_FAILED)
+		err(1, "cannot map %s", tmp);
+
+	c->fd = fd;
+	c->map_size = size;
+	c->header = c->map;
+	c->entries = (struct cache_entry *)(c->header + 1);
+	memcpy(c->header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	c->header->version = CACHE_VERSION;
+	c->header->capacity = capacity;
+
+	if (old.map != NULL) {
+		c->header->clock = old.header->clock;
+		for (i = 0; i < old.header->capacity; i++) {
+			if (old.entries[i].state != SLOT_LIVE)
+				continue;
+			e = probe(c->header, c->entries, old.entries[i].key, old.entries[i].hour, true);
+			*e = old.entries[i];
+			c->header->used++;
+			c->header->count++;
+			c->header->bytes += e->size;
+		}
+	} else {
+		import_files(c);
+	}
+
+	if (rename(tmp, path) != 0)
+		err(1, "cannot rename %s to %s", tmp, path);
+
+	/* waiters on old index wake up, see new inode and reopen */
+	unmap_index(&old);
+}
+
+/* room for files already in dir */
+static uint32_t
+initial_capacity(const char *path)
+{
+	uint32_t capacity = INITIAL_CAPACITY;
+	size_t n = 0;
+	DIR *dir;
+
+	dir = opendir(path);
+	if (dir != NULL) {
+		while (readdir(dir) != NULL)
+			n++;
+		closedir(dir);
+	}
+
+	while (n * 10 > capacity * 6)
+		capacity *= 2;
+
+	return capacity;
+}
+
+int
+cache_open(struct cache *c, const char *dir, uint64_t budget)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	memset(c, 0, sizeof(*c));
+
+	/* entry, lock and tmp paths then always fit in PATH_MAX */
+	if (strlen(dir) >= sizeof(c->dir)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(c->dir, dir);
+	c->budget = budget;
+	c->fd = -1;
+	pthread_mutex_init(&c->mutex, NULL);
+
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+		return -1;
+
+	index_path(c, path);
+
+	fd = open(path, O_RDWR);
+	if (fd != -1 && map_index(c, fd) == 0)
+		return 0;
+
+	if (fd != -1)
+		close(fd);
+
+	/* first run or unreadable index: build it from files on disk */
+	pthread_mutex_lock(&c->mutex);
+	rebuild_index(c, initial_capacity(dir));
+	unlock_index(c);
+
+	return 0;
+}
+
+void
+cache_close(struct cache *c)
+{
+	unmap_index(c);
+	pthread_mutex_destroy(&c->mutex);
+}
+
+/* ===== entries ===================== */
+
+static void
+entry_name(const char *key, time_t t, char *name)
+{
+	char timestr[20];
+	struct tm tm;
+
+	gmtime_r(&t, &tm);
+	strftime(timestr, sizeof(timestr), "%Y%m%d-%H", &tm);
+	snprintf(name, 64, "%s-%s.xml.gz", key, timestr);
+}
+
+bool
+cache_lookup(struct cache *c, const char *key, time_t t, char *path)
+{
+	struct cache_entry *e;
+
+	lock_index(c);
+
+	e = probe(c->header, c->entries, key, t / 3600, false);
+	if (e != NULL) {
+		e->last_use = ++c->header->clock;
+		entry_path(c, e, path);
+	}
+
+	unlock_index(c);
+
+	return e != NULL;
+}
+
+void
+cache_remove(struct cache *c, const char *key, time_t t)
+{
+	struct cache_entry *e;
+
+	lock_index(c);
+
+	e = probe(c->header, c->entries, key, t / 3600, false);
+	if (e != NULL)
+		delete_entry(c, e);
+
+	unlock_index(c);
+}
+
+void
+cache_tmp_path(struct cache *c, const char *key, time_t t, char *path)
+{
+	char name[64];
+
+	entry_name(key, t, name);
+	snprintf(path, PATH_MAX, "%s/%s.%d.tmp", c->dir, name, getpid());
+}
+
+/* zip-10010-20150821-12.lock, not an entry for import */
+static void
+lock_path(struct cache *c, const char *key, time_t t, char *path)
+{
+	char timestr[20];
+	struct tm tm;
+
+	gmtime_r(&t, &tm);
+	strftime(timestr, sizeof(timestr), "%Y%m%d-%H", &tm);
+	if (snprintf(path, PATH_MAX, "%s/%s-%s.lock", c->dir, key, timestr) >= PATH_MAX)
+		errx(1, "cache key %s is too long", key);
+}
+
+int
+cache_lock_entry(struct cache *c, const char *key, time_t t)
+{
+	char path[PATH_MAX];
+	struct stat a, b;
+	int fd;
+
+	lock_path(c, key, t, path);
+
+	/* holder unlinks lock file before unlocking, retry if we locked a removed one */
+	for (;;) {
+		fd = open(path, O_RDWR | O_CREAT, 0644);
+		if (fd == -1)
+			err(1, "cannot create %s", path);
+
+		if (flock(fd, LOCK_EX) != 0)
+			err(1, "cannot lock %s", path);
+
+		if (stat(path, &a) == 0 && fstat(fd, &b) == 0 && a.st_ino == b.st_ino && a.st_dev == b.st_dev)
+			return fd;
+
+		close(fd);
+	}
+}
+
+void
+cache_unlock_entry(struct cache *c, const char *key, time_t t, int fd)
+{
+	char path[PATH_MAX];
+
+	lock_path(c, key, t, path);
+	unlink(path);
+	close(fd);
+}
+
+/* drop entries past max age, then least recently used ones until under budget */
+static void
+evict(struct cache *c, const struct cache_entry *keep)
+{
+	struct cache_entry *e, *oldest;
+	int64_t min_hour = (time(NULL) - CACHE_MAX_AGE) / 3600;
+	size_t i;
+
+	for (i = 0; i < c->header->capacity; i++) {
+		e = &c->entries[i];
+		if (e->state == SLOT_LIVE && e != keep && e->hour < min_hour)
+			delete_entry(c, e);
+	}
+
+	while (c->header->bytes > c->budget) {
+		oldest = NULL;
+		for (i = 0; i < c->header->capacity; i++) {
+			e = &c->entries[i];
+			if (e->state == SLOT_LIVE && e != keep && (oldest == NULL || e->last_use < oldest->last_use))
+				oldest = e;
+		}
+		if (oldest == NULL)
+			break;
+		delete_entry(c, oldest);
+	}
+}
+
+void
+cache_commit(struct cache *c, const char *key, time_t t, const char *tmp, char *path)
+{
+	struct cache_entry *e;
+	struct stat st;
+	char name[64], tmp_path[PATH_MAX];
+	uint32_t capacity;
+
+	if (strlen(key) >= sizeof(e->key))
+		errx(1, "cache key %s is too long", key);
+
+	entry_name(key, t, name);
+	snprintf(path, PATH_MAX, "%s/%s", c->dir, name);
+
+	lock_index(c);
+
+	if (rename(tmp, path) != 0)
+		err(1, "cannot rename %s to %s", tmp, path);
+
+	if (stat(path, &st) != 0)
+		err(1, "cannot stat %s", path);
+
+	/* keep load under 70%, same size when deleted slots are the reason */
+	if ((c->header->used + 1) * 10 > c->header->capacity * 7) {
+		capacity = c->header->count * 10 < c->header->capacity * 3 ?
+			   c->header->capacity : c->header->capacity * 2;
+		rebuild_index(c, capacity);
+	}
+
+	e = probe(c->header, c->entries, key, t / 3600, true);
+	if (e->state == SLOT_LIVE) {
+		/* imported entry may have legacy file name */
+		if (strcmp(e->name, name) != 0) {
+			entry_path(c, e, tmp_path);
+			unlink(tmp_path);
+		}
+		c->header->bytes -= e->size;
+	} else {
+		if (e->state == SLOT_EMPTY)
+			c->header->used++;
+		c->header->count++;
+	}
+
+	memset(e, 0, sizeof(*e));
+	strcpy(e->key, key);
+	strcpy(e->name, name);
+	e->hour = t / 3600;
+	e->last_use = ++c->header->clock;
+	e->size = st.st_size;
+	e->state = SLOT_LIVE;
+	c->header->bytes += e->size;
+
+	evict(c, e);
+
+	unlock_index(c);
+}
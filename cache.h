@@ -0,0 +1,89 @@
+/**
+ * Serge Voilokov, 2015.
+ * Size bounded forecast cache directory with index file.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define CACHE_MAGIC "WXCACHE"
+#define CACHE_VERSION 1
+#define CACHE_INDEX "index"
+#define CACHE_DEFAULT_BUDGET (64 << 20)    /* bytes */
+#define CACHE_MAX_AGE (7 * 24 * 3600)      /* entries older than this are evicted */
+#define CACHE_NAME_MAX 128                 /* room left in PATH_MAX for names in dir */
+
+struct cache_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t capacity;      /* slots in open addressing table */
+	uint64_t used;          /* slots in use, including deleted */
+	uint64_t count;         /* live entries */
+	uint64_t bytes;         /* total size of live entries */
+	uint64_t clock;         /* incremented on every use, orders LRU */
+};
+
+enum cache_slot
+{
+	SLOT_EMPTY,
+	SLOT_LIVE,
+	SLOT_DELETED
+};
+
+/* fixed size slot, probed linearly from hash of (key, hour) */
+struct cache_entry
+{
+	char key[32];           /* request key, e.g. zip-10010 */
+	char name[64];          /* file name in cache dir */
+	int64_t hour;           /* utc hours since epoch of fetch */
+	uint64_t last_use;      /* header clock at last lookup or commit */
+	uint64_t size;
+	uint32_t state;         /* enum cache_slot */
+	uint32_t reserved;
+};
+
+struct cache
+{
+	char dir[PATH_MAX - CACHE_NAME_MAX];
+	uint64_t budget;        /* bytes kept on disk */
+	int fd;                 /* index file, flock serializes processes */
+	pthread_mutex_t mutex;  /* and threads sharing descriptor */
+	void *map;
+	size_t map_size;
+	struct cache_header *header;
+	struct cache_entry *entries;
+};
+
+/* open or create index in dir, importing files already there; -1 if dir is too long */
+int cache_open(struct cache *c, const char *dir, uint64_t budget);
+void cache_close(struct cache *c);
+
+/* single index probe; on hit fills path of cached file and updates LRU time */
+bool cache_lookup(struct cache *c, const char *key, time_t t, char *path);
+
+/* temporary path in cache dir to write entry before commit */
+void cache_tmp_path(struct cache *c, const char *key, time_t t, char *path);
+
+/* rename tmp file into cache, index it and evict old entries over budget */
+void cache_commit(struct cache *c, const char *key, time_t t, const char *tmp, char *path);
+
+/* drop entry and its file, e.g. when the document turned out malformed */
+void cache_remove(struct cache *c, const char *key, time_t t);
+
+/*
+ * Single flight across processes: first caller gets entry lock and fetches,
+ * others block here and find the entry with cache_lookup after the lock
+ * is released. Returns descriptor for cache_unlock_entry.
+ */
+int cache_lock_entry(struct cache *c, const char *key, time_t t);
+void cache_unlock_entry(struct cache *c, const char *key, time_t t, int fd);
+
+#endif /* CACHE_H */
@@ -0,0 +1,322 @@
+/**
+ * Serge Voilokov, 2015.
+ * Change detection between sent and new forecast.
+ *
+ * State file is a header followed by change_row records of rows sent last
+ * time. Equal row hash means unchanged row without comparing fields.
+ */
+
+#include "change.h"
+#include <err.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define STATE_MAGIC "WXCHG1"
+
+struct state_header
+{
+	char magic[8];
+	uint64_t n_rows;
+};
+
+static const struct {
+	const char *name;
+	enum column first;
+	enum column last;
+} threshold_names[] = {
+	{ "temp",     COLUMN_TEMP_HOURLY,  COLUMN_TEMP_MAX },
+	{ "humidity", COLUMN_HUMIDITY,     COLUMN_HUMIDITY },
+	{ "cloud",    COLUMN_CLOUD_AMOUNT, COLUMN_CLOUD_AMOUNT },
+	{ "wind",     COLUMN_WIND_SPEED,   COLUMN_WIND_SPEED },
+	{ "dir",      COLUMN_WIND_DIR,     COLUMN_WIND_DIR },
+	{ "snow",     COLUMN_SNOW_AMOUNT,  COLUMN_SNOW_AMOUNT },
+	{ NULL,       0,                   0 }
+};
+
+void
+change_default_thresholds(struct change_thresholds *th)
+{
+	int c;
+
+	for (c = COLUMN_TEMP_HOURLY; c <= COLUMN_TEMP_MAX; c++)
+		th->column[c] = 2;
+	th->column[COLUMN_HUMIDITY] = 20;
+	th->column[COLUMN_CLOUD_AMOUNT] = 20;
+	th->column[COLUMN_WIND_SPEED] = 3;
+	th->column[COLUMN_WIND_DIR] = 45;
+	th->column[COLUMN_SNOW_AMOUNT] = 1;
+	th->weather = true;
+}
+
+int
+change_parse_thresholds(struct change_thresholds *th, const char *spec)
+{
+	char *s = strdup(spec), *tok, *save = NULL, *eq;
+	int i, c, ret = 0;
+
+	for (tok = strtok_r(s, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+		eq = strchr(tok, '=');
+		if (eq == NULL) {
+			ret = -1;
+			break;
+		}
+		*eq++ = 0;
+
+		if (strcmp(tok, "weather") == 0) {
+			th->weather = atoi(eq) != 0;
+			continue;
+		}
+
+		for (i = 0; threshold_names[i].name != NULL; i++)
+			if (strcmp(tok, threshold_names[i].name) == 0)
+				break;
+
+		if (threshold_names[i].name == NULL) {
+			ret = -1;
+			break;
+		}
+
+		for (c = threshold_names[i].first; c <= (int)threshold_names[i].last; c++)
+			th->column[c] = atoi(eq);
+	}
+
+	free(s);
+
+	return ret;
+}
+
+/* ===== rows ======================== */
+
+static uint32_t
+fnv(uint32_t h, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len-- > 0) {
+		h ^= *p++;
+		h *= 16777619;
+	}
+
+	return h;
+}
+
+static void
+fill_row(struct change_row *cr, struct row *r)
+{
+	int c, *value;
+	bool *has_value;
+
+	memset(cr, 0, sizeof(*cr));
+	cr->time = r->time;
+
+	for (c = 0; c < COLUMN_ENUM_MAX; c++) {
+		value = dwml_column(r, c, &has_value);
+		if (*has_value) {
+			cr->has_value |= 1 << c;
+			cr->value[c] = *value;
+		}
+	}
+
+	if (r->weather != NULL)
+		cr->weather = fnv(2166136261, r->weather, strlen(r->weather)) | 1;
+
+	cr->hash = fnv(2166136261, cr, offsetof(struct change_row, hash));
+	cr->hash = fnv(cr->hash, &cr->weather, sizeof(*cr) - offsetof(struct change_row, weather));
+}
+
+static const struct change_row *
+find_row(const struct change_state *st, time_t t)
+{
+	size_t lo = 0, hi = st->n_rows, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (st->rows[mid].time < t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo < st->n_rows && st->rows[lo].time == t ? &st->rows[lo] : NULL;
+}
+
+static bool
+row_changed(const struct change_row *old, const struct change_row *cur, const struct change_thresholds *th)
+{
+	int c, d;
+	uint32_t bit;
+
+	if (old == NULL)
+		return true;
+
+	if (old->hash == cur->hash)
+		return false;
+
+	for (c = 0; c < COLUMN_ENUM_MAX; c++) {
+		bit = 1 << c;
+		if (th->column[c] <= 0 || (cur->has_value & bit) == 0)
+			continue;
+
+		/* value appeared */
+		if ((old->has_value & bit) == 0)
+			return true;
+
+		d = abs(cur->value[c] - old->value[c]);
+		if (c == COLUMN_WIND_DIR && d > 180)
+			d = 360 - d;
+
+		if (d >= th->column[c])
+			return true;
+	}
+
+	return th->weather && cur->weather != 0 && cur->weather != old->weather;
+}
+
+/* ===== state ======================= */
+
+int
+change_load(struct change_state *st, const char *dir, int zip, const char *schedule)
+{
+	struct state_header h;
+	struct stat sb;
+	FILE *f;
+	int ret = -1;
+
+	snprintf(st->path, PATH_MAX, "%s/zip-%05d-%s.state", dir, zip, schedule);
+	st->n_rows = 0;
+	st->rows = NULL;
+
+	f = fopen(st->path, "r");
+	if (f == NULL) {
+		if (errno == ENOENT)
+			return 0;
+		warn("cannot open %s", st->path);
+		return -1;
+	}
+
+	if (fstat(fileno(f), &sb) != 0 || fread(&h, sizeof(h), 1, f) != 1 ||
+	    memcmp(h.magic, STATE_MAGIC, sizeof(STATE_MAGIC)) != 0) {
+		warnx("%s is not a change state", st->path);
+		goto done;
+	}
+
+	/* count is checked against file size before it sizes an allocation */
+	if (h.n_rows != (sb.st_size - sizeof(h)) / sizeof(struct change_row)) {
+		warnx("%s is corrupted, %llu rows in header", st->path, (unsigned long long)h.n_rows);
+		goto done;
+	}
+
+	st->rows = calloc(h.n_rows + 1, sizeof(struct change_row));
+	if (st->rows == NULL) {
+		warn("cannot allocate change state");
+		goto done;
+	}
+
+	st->n_rows = fread(st->rows, sizeof(struct change_row), h.n_rows, f);
+	if (st->n_rows != h.n_rows) {
+		warn("cannot read %s", st->path);
+		goto done;
+	}
+
+	ret = 0;
+done:
+	fclose(f);
+
+	return ret;
+}
+
+size_t
+change_diff(const struct change_state *st, const struct dwml *dwml,
+	    const struct change_thresholds *th, bool *changed)
+{
+	struct change_row cur;
+	size_t i, n = 0;
+
+	for (i = 0; i < dwml->n_rows; i++) {
+		fill_row(&cur, &dwml->rows[i]);
+		changed[i] = row_changed(find_row(st, cur.time), &cur, th);
+		if (changed[i])
+			n++;
+	}
+
+	return n;
+}
+
+int
+change_save(struct change_state *st, const struct dwml *dwml, const bool *changed)
+{
+	char tmp[PATH_MAX];
+	struct state_header h;
+	struct change_row *rows;
+	const struct change_row *old;
+	size_t i;
+	bool ok;
+	FILE *f;
+
+	rows = calloc(dwml->n_rows + 1, sizeof(struct change_row));
+	if (rows == NULL) {
+		warn("cannot allocate change state");
+		return -1;
+	}
+
+	/* past rows fall out, rows not sent keep what subscriber has seen */
+	for (i = 0; i < dwml->n_rows; i++) {
+		old = find_row(st, dwml->rows[i].time);
+		if (!changed[i] && old != NULL)
+			rows[i] = *old;
+		else
+			fill_row(&rows[i], &dwml->rows[i]);
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, STATE_MAGIC, sizeof(STATE_MAGIC));
+	h.n_rows = dwml->n_rows;
+
+	if (snprintf(tmp, PATH_MAX, "%s.%d.tmp", st->path, getpid()) >= PATH_MAX) {
+		warnx("%s: path is too long", st->path);
+		free(rows);
+		return -1;
+	}
+
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		warn("cannot create %s", tmp);
+		free(rows);
+		return -1;
+	}
+
+	ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+	     fwrite(rows, sizeof(struct change_row), dwml->n_rows, f) == dwml->n_rows;
+	if (fclose(f) != 0 || !ok) {
+		warn("cannot write %s", tmp);
+		unlink(tmp);
+		free(rows);
+		return -1;
+	}
+
+	if (rename(tmp, st->path) != 0) {
+		warn("cannot rename %s to %s", tmp, st->path);
+		unlink(tmp);
+		free(rows);
+		return -1;
+	}
+
+	free(st->rows);
+	st->rows = rows;
+	st->n_rows = dwml->n_rows;
+
+	return 0;
+}
+
+void
+change_free(struct change_state *st)
+{
+	free(st->rows);
+	st->rows = NULL;
+	st->n_rows = 0;
+}
@@ -0,0 +1,62 @@
+/**
+ * Serge Voilokov, 2015.
+ * Change detection between sent and new forecast.
+ */
+
+#ifndef CHANGE_H
+#define CHANGE_H
+
+#include "dwml.h"
+#include <limits.h>
+#include <stdint.h>
+
+enum change_mode
+{
+	CHANGE_OFF,     /* always send full report */
+	CHANGE_SKIP,    /* skip report when nothing changed */
+	CHANGE_ROWS     /* send only changed rows */
+};
+
+/* minimal difference of column value that makes row changed */
+struct change_thresholds
+{
+	int column[COLUMN_ENUM_MAX];
+	bool weather;               /* new weather condition */
+};
+
+/* last sent forecast rows for (zip, schedule) */
+struct change_row
+{
+	int64_t time;
+	uint32_t hash;              /* all fields of row */
+	uint32_t weather;           /* hash of weather text, 0 if none */
+	uint32_t has_value;         /* bit per column */
+	int32_t value[COLUMN_ENUM_MAX];
+};
+
+struct change_state
+{
+	char path[PATH_MAX];
+	size_t n_rows;
+	struct change_row *rows;    /* sorted by time */
+};
+
+/* temperature 2, wind 3 m/s, direction 45, humidity and cloud 20%, snow 1 cm, new weather */
+void change_default_thresholds(struct change_thresholds *th);
+
+/* parse "temp=2,wind=3,dir=45,humidity=20,cloud=20,snow=1,weather=0" */
+int change_parse_thresholds(struct change_thresholds *th, const char *spec);
+
+/* load state from dir/zip-NNNNN-schedule.state, empty if not sent yet; -1 and empty if unreadable */
+int change_load(struct change_state *st, const char *dir, int zip, const char *schedule);
+
+/* mark changed rows of dwml, returns number of changed rows */
+size_t change_diff(const struct change_state *st, const struct dwml *dwml,
+		   const struct change_thresholds *th, bool *changed);
+
+/* remember changed rows as sent, unchanged rows keep previously sent values; -1 on error */
+int change_save(struct change_state *st, const struct dwml *dwml, const bool *changed);
+
+void change_free(struct change_state *st);
+
+#endif /* CHANGE_H */
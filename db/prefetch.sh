@@ -0,0 +1,12 @@
+# Warm weather cache for deliveries due in the next minutes, run from cron
+# ahead of the busy schedule times, e.g. at 5:30 for 6:00 and 7:00.
+# usage: prefetch.sh [minutes] [weather options]
+export PATH=/opt/mysql/bin:$PATH
+
+minutes=${1:-90}
+shift
+
+mysql weather -u dbuser --password=`cat password~.txt` --batch --skip-column-names -e "
+	select zip, unix_timestamp(next_send) from user
+	where next_send between now() and now() + interval $minutes minute
+	order by next_send, zip" | weather --prefetch=- "$@"
@@ -0,0 +1,318 @@
+/**
+ * Serge Voilokov, 2015.
+ * Machine readable outputs: JSON, CSV and fixed schema binary records.
+ *
+ * Values are written digit by digit into the output buffer, without
+ * printf or an intermediate tree, as these run for every row of every zip.
+ */
+
+#include "dwml.h"
+#include "common/struct.h"
+#include <string.h>
+
+_Static_assert(sizeof(struct dwml_bin_header) == 128, "dwml_bin_header layout");
+_Static_assert(sizeof(struct dwml_bin_row) == 128, "dwml_bin_row layout");
+
+static const char *column_names[COLUMN_ENUM_MAX] = {
+	[COLUMN_TEMP_HOURLY] = "temp_hourly",
+	[COLUMN_TEMP_APPARENT] = "temp_apparent",
+	[COLUMN_TEMP_MIN] = "temp_min",
+	[COLUMN_TEMP_MAX] = "temp_max",
+	[COLUMN_HUMIDITY] = "humidity",
+	[COLUMN_CLOUD_AMOUNT] = "cloud_amount",
+	[COLUMN_WIND_SPEED] = "wind_speed",
+	[COLUMN_WIND_DIR] = "wind_dir",
+	[COLUMN_SNOW_AMOUNT] = "snow_amount"
+};
+
+static const char *units_names[] = { "metric", "imperial" };
+
+static void
+add_int(struct buf *buf, int64_t v)
+{
+	char s[24], *p = s + sizeof(s);
+	uint64_t u = v < 0 ? -(uint64_t)v : (uint64_t)v;
+
+	do {
+		*--p = '0' + u % 10;
+		u /= 10;
+	} while (u != 0);
+
+	if (v < 0)
+		*--p = '-';
+
+	buf_append(buf, p, s + sizeof(s) - p);
+}
+
+/* imperial snow is in tenths of inch */
+static void
+add_value(struct buf *buf, const struct dwml *dwml, enum column col, int v)
+{
+	char frac[2] = { '.' };
+
+	if (col != COLUMN_SNOW_AMOUNT || dwml->units != UNITS_IMPERIAL) {
+		add_int(buf, v);
+		return;
+	}
+
+	if (v < 0) {
+		buf_append(buf, "-", 1);
+		v = -v;
+	}
+	add_int(buf, v / 10);
+	frac[1] = '0' + v % 10;
+	buf_append(buf, frac, 2);
+}
+
+static char *
+put_digits(char *p, int v, int width)
+{
+	int i;
+
+	for (i = width - 1; i >= 0; i--, v /= 10)
+		p[i] = '0' + v % 10;
+
+	return p + width;
+}
+
+/* 2015-08-21T08:00:00-04:00, or with Z in utc zone */
+static void
+add_time(struct buf *buf, const struct tz *tz, time_t t, bool utc)
+{
+	char s[32], *p = s;
+	int32_t offset = utc ? 0 : tz_offset(tz, t);
+	struct tm tm;
+
+	tz_localtime(utc ? tz_fixed(0) : tz, t, &tm);
+
+	p = put_digits(p, tm.tm_year + 1900, 4);
+	*p++ = '-';
+	p = put_digits(p, tm.tm_mon + 1, 2);
+	*p++ = '-';
+	p = put_digits(p, tm.tm_mday, 2);
+	*p++ = 'T';
+	p = put_digits(p, tm.tm_hour, 2);
+	*p++ = ':';
+	p = put_digits(p, tm.tm_min, 2);
+	*p++ = ':';
+	p = put_digits(p, tm.tm_sec, 2);
+
+	if (utc) {
+		*p++ = 'Z';
+	} else {
+		*p++ = offset < 0 ? '-' : '+';
+		offset = offset < 0 ? -offset : offset;
+		p = put_digits(p, offset / 3600, 2);
+		*p++ = ':';
+		p = put_digits(p, offset / 60 % 60, 2);
+	}
+
+	buf_append(buf, s, p - s);
+}
+
+/* rows of layouts without any requested value, tables skip them too */
+static bool
+row_has_values(struct row *r)
+{
+	bool *has_value;
+	int col;
+
+	for (col = 0; col < COLUMN_ENUM_MAX; col++) {
+		dwml_column(r, col, &has_value);
+		if (*has_value)
+			return true;
+	}
+
+	return r->weather != NULL;
+}
+
+/* ===== json ======================== */
+
+static void
+add_json_string(struct buf *buf, const char *s)
+{
+	const char *run = s;
+	char esc[7];
+
+	buf_append(buf, "\"", 1);
+
+	for (; *s != 0; s++) {
+		if (*s != '"' && *s != '\\' && (unsigned char)*s >= 0x20)
+			continue;
+		buf_append(buf, run, s - run);
+		esc[0] = '\\';
+		if (*s == '"' || *s == '\\') {
+			esc[1] = *s;
+			buf_append(buf, esc, 2);
+		} else {
+			memcpy(esc + 1, "u00", 3);
+			esc[4] = "0123456789abcdef"[(unsigned char)*s >> 4];
+			esc[5] = "0123456789abcdef"[*s & 0xf];
+			buf_append(buf, esc, 6);
+		}
+		run = s + 1;
+	}
+
+	buf_append(buf, run, s - run);
+	buf_append(buf, "\"", 1);
+}
+
+/* one row per line, missing values are left out */
+void
+dwml_format_json(struct buf *buf, const struct dwml *dwml)
+{
+	struct row *r;
+	bool *has_value;
+	int *value;
+	size_t i;
+	int col;
+	bool first = true;
+
+	buf_append(buf, "{\"creation_date\":\"", 18);
+	add_time(buf, dwml->tz, dwml->creation_date, true);
+	buf_append(buf, "\",\"time_zone\":", 14);
+	add_json_string(buf, dwml->tz->name);
+	buf_append(buf, ",\"units\":\"", 10);
+	buf_appendf(buf, "%s", units_names[dwml->units]);
+	buf_append(buf, "\",\"rows\":[", 10);
+
+	for (i = 0; i < dwml->n_rows; i++) {
+		r = &dwml->rows[i];
+		if (!row_has_values(r))
+			continue;
+
+		buf_append(buf, first ? "\n{\"time\":\"" : ",\n{\"time\":\"", first ? 10 : 11);
+		first = false;
+		add_time(buf, dwml->tz, r->time, false);
+		buf_append(buf, "\"", 1);
+
+		for (col = 0; col < COLUMN_ENUM_MAX; col++) {
+			value = dwml_column(r, col, &has_value);
+			if (!*has_value)
+				continue;
+			buf_append(buf, ",\"", 2);
+			buf_append(buf, column_names[col], strlen(column_names[col]));
+			buf_append(buf, "\":", 2);
+			add_value(buf, dwml, col, *value);
+		}
+
+		if (r->weather != NULL) {
+			buf_append(buf, ",\"weather\":", 11);
+			add_json_string(buf, r->weather);
+		}
+
+		buf_append(buf, "}", 1);
+	}
+
+	buf_append(buf, "\n]}\n", 4);
+}
+
+/* ===== csv ========================= */
+
+/* header line and one line per row, weather is always quoted */
+void
+dwml_format_csv(struct buf *buf, const struct dwml *dwml)
+{
+	struct row *r;
+	bool *has_value;
+	int *value;
+	const char *s, *q;
+	size_t i;
+	int col;
+
+	buf_appendf(buf, "time");
+	for (col = 0; col < COLUMN_ENUM_MAX; col++)
+		buf_appendf(buf, ",%s", column_names[col]);
+	buf_appendf(buf, ",weather\n");
+
+	for (i = 0; i < dwml->n_rows; i++) {
+		r = &dwml->rows[i];
+		if (!row_has_values(r))
+			continue;
+
+		add_time(buf, dwml->tz, r->time, false);
+
+		for (col = 0; col < COLUMN_ENUM_MAX; col++) {
+			buf_append(buf, ",", 1);
+			value = dwml_column(r, col, &has_value);
+			if (*has_value)
+				add_value(buf, dwml, col, *value);
+		}
+
+		buf_append(buf, ",\"", 2);
+		for (s = r->weather; s != NULL; s = q + 1) {
+			q = strchr(s, '"');
+			if (q == NULL) {
+				buf_append(buf, s, strlen(s));
+				break;
+			}
+			buf_append(buf, s, q - s + 1);
+			buf_append(buf, "\"", 1);
+		}
+		buf_append(buf, "\"\n", 2);
+	}
+}
+
+/* ===== binary records ============== */
+
+void
+dwml_format_bin(struct buf *buf, const struct dwml *dwml)
+{
+	struct dwml_bin_header h;
+	struct dwml_bin_row b;
+	struct row *r;
+	bool *has_value;
+	int *value;
+	size_t i;
+	int col;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, DWML_BIN_MAGIC, sizeof(h.magic));
+	h.version = DWML_BIN_VERSION;
+	h.record_size = sizeof(struct dwml_bin_row);
+	h.creation_date = dwml->creation_date;
+	h.base_time = dwml->base_time;
+	h.units = dwml->units;
+	h.fields = dwml->fields;
+	for (i = 0; i < dwml->n_rows; i++)
+		h.n_rows += row_has_values(&dwml->rows[i]);
+	strncpy(h.tz, dwml->tz->name, sizeof(h.tz) - 1);
+	buf_append(buf, (const char *)&h, sizeof(h));
+
+	for (i = 0; i < dwml->n_rows; i++) {
+		r = &dwml->rows[i];
+		if (!row_has_values(r))
+			continue;
+
+		memset(&b, 0, sizeof(b));
+		b.time = r->time;
+		for (col = 0; col < COLUMN_ENUM_MAX; col++) {
+			value = dwml_column(r, col, &has_value);
+			b.value[col] = *value;
+			if (*has_value)
+				b.has_value |= DWML_FIELD(col);
+		}
+		if (r->weather != NULL) {
+			b.has_value |= DWML_FIELD_WEATHER;
+			strncpy(b.weather, r->weather, sizeof(b.weather) - 1);
+		}
+		buf_append(buf, (const char *)&b, sizeof(b));
+	}
+}
+
+int
+dwml_bin_map(const void *data, size_t size, const struct dwml_bin_header **header,
+	     const struct dwml_bin_row **rows)
+{
+	const struct dwml_bin_header *h = data;
+
+	if (size < sizeof(*h) || memcmp(h->magic, DWML_BIN_MAGIC, sizeof(h->magic)) != 0 ||
+	    h->version != DWML_BIN_VERSION || h->record_size != sizeof(struct dwml_bin_row) ||
+	    h->n_rows > (size - sizeof(*h)) / sizeof(struct dwml_bin_row))
+		return -1;
+
+	*header = h;
+	*rows = (const struct dwml_bin_row *)(h + 1);
+
+	return 0;
+}
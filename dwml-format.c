@@ -0,0 +1,375 @@
+/**
+ * Serge Voilokov, 2015.
+ * Forecast formatters.
+ */
+
+#include "dwml.h"
+#include "common/struct.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const char *temp_unit[] = { "celsius", "fahrenheit" };
+static const char *speed_unit[] = { "meters per second", "miles per hour" };
+static const char *snow_unit[] = { "centimeters", "inches" };
+
+/* imperial snow is in tenths of inch */
+static void
+buf_add_snow(struct buf *buf, const char *fmt_metric, const char *fmt_imperial, int value, enum units units)
+{
+	if (units == UNITS_IMPERIAL)
+		buf_appendf(buf, fmt_imperial, value / 10.0);
+	else
+		buf_appendf(buf, fmt_metric, value);
+}
+
+static void
+buf_add_temperature(struct buf *buf, const struct temperature *t)
+{
+	if (t->has_value)
+		buf_appendf(buf, "%4d", t->celcius);
+	else
+		buf_append(buf, "    ", 4);
+}
+
+static bool
+row_is_empty(const struct row *r)
+{
+	bool has_value = false;
+
+	has_value |= r->temp_hourly.has_value;
+	has_value |= r->temp_apparent.has_value;
+	has_value |= r->temp_max.has_value;
+	has_value |= r->temp_min.has_value;
+	has_value |= r->humidity.has_value;
+	has_value |= r->cloud_amount.has_value;
+	has_value |= r->wind_speed.has_value;
+	has_value |= r->wind_dir.has_value;
+	has_value |= r->snow_amount.has_value;
+	has_value |= r->weather != NULL;
+
+	return !has_value;
+}
+
+static void
+format_legend(struct buf *buf, const char *timestr, enum units units)
+{
+	struct tm tm;
+	time_t now = time(NULL);
+
+	buf_appendf(buf, "\nInfo\n");
+	buf_appendf(buf,   "====\n");
+	buf_appendf(buf, "UTC:         %s", asctime(gmtime_r(&now, &tm)));
+	buf_appendf(buf, "report time: %s\n", timestr);
+	buf_appendf(buf, "Legend\n");
+	buf_appendf(buf, "======\n");
+	buf_appendf(buf, "TMP -- hourly temperature, %s\n", temp_unit[units]);
+	buf_appendf(buf, "APR -- hourly apparent temperature, %s\n", temp_unit[units]);
+	buf_appendf(buf, "MIN -- minimal temperature for a day, %s\n", temp_unit[units]);
+	buf_appendf(buf, "MAX -- maximum temperature for a day, %s\n", temp_unit[units]);
+	buf_appendf(buf, "HUM -- humidity, relative\n");
+	buf_appendf(buf, "CLD -- cloud amount, percent\n");
+	buf_appendf(buf, "SPD -- wind speed, %s\n", speed_unit[units]);
+	buf_appendf(buf, "DIR -- wind direction, degrees\n");
+	buf_appendf(buf, "SNW -- snow, %s\n", snow_unit[units]);
+	buf_appendf(buf, "TND -- thunderstorms\n");
+	buf_appendf(buf, "SHW -- rain showers\n");
+}
+
+void
+dwml_format_text(struct buf *buf, const struct dwml *dwml, enum legend_position legend_pos)
+{
+	size_t i, n;
+	char timestr[30];
+	struct tm tm;
+	int prev_day = 0;
+
+	tz_localtime(dwml->tz, dwml->base_time, &tm);
+	n = strftime(timestr, 30, "%Y-%m-%d %H", &tm);
+
+	if (legend_pos == LEGEND_TOP)
+		format_legend(buf, timestr, dwml->units);
+
+	buf_appendf(buf, "========== ==  === === === === === === === === === ===================\n");
+	buf_appendf(buf, "DATE...... HR  AIR.................... WIND... SNW CONDITIONS.........\n");
+	buf_appendf(buf, "               TMP APR MIN MAX HUM CLD SPD DIR    \n");
+	buf_appendf(buf, "========== ==  === === === === === === === === === ===================\n");
+
+	for (i = 0; i < dwml->n_rows; i++) {
+		const struct row *r = &dwml->rows[i];
+		if (row_is_empty(r))
+			continue;
+
+		tz_localtime(dwml->tz, r->time, &tm);
+		if (prev_day != tm.tm_mday) {
+			n = strftime(timestr, 30, "%Y-%m-%d ", &tm);
+			buf_append(buf, timestr, n);
+			prev_day = tm.tm_mday;
+		} else {
+			buf_append(buf, "           ", 11);
+		}
+
+		buf_appendf(buf, "%02d ", tm.tm_hour);
+
+		buf_add_temperature(buf, &r->temp_hourly);
+		buf_add_temperature(buf, &r->temp_apparent);
+		buf_add_temperature(buf, &r->temp_min);
+		buf_add_temperature(buf, &r->temp_max);
+
+		if (r->humidity.has_value)
+			buf_appendf(buf, "%4d", r->humidity.percent);
+		else
+			buf_append(buf, "    ", 4);
+
+		if (r->cloud_amount.has_value)
+			buf_appendf(buf, "%4d", r->cloud_amount.percent);
+		else
+			buf_append(buf, "    ", 4);
+
+		if (r->wind_speed.has_value)
+			buf_appendf(buf, "%4d", r->wind_speed.mps);
+		else
+			buf_append(buf, "    ", 4);
+
+		if (r->wind_dir.has_value)
+			buf_appendf(buf, "%4d", r->wind_dir.degrees);
+		else
+			buf_append(buf, "    ", 4);
+
+		if (r->snow_amount.has_value)
+			buf_add_snow(buf, "%4d", "%4.1f", r->snow_amount.centimeters, dwml->units);
+		else
+			buf_append(buf, "    ", 4);
+
+		if (r->weather != NULL)
+			buf_appendf(buf, " %s", r->weather);
+
+		buf_append(buf, "\n", 1);
+	}
+
+	buf_appendf(buf, "========== ==  === === === === === === === === === ===================\n");
+
+	if (legend_pos == LEGEND_BOTTOM)
+		format_legend(buf, timestr, dwml->units);
+
+}
+
+static const char header[] =
+	"<tr style=\"background-color: lightsteelblue;\">"
+	"<th>HR&nbsp;&nbsp;</th>"
+	"<th colspan=\"4\">AIR</th>"
+	"<th colspan=\"2\">WIND</th>"
+	"<th>SNOW</th>"
+	"<th>CONDITIONS</th>"
+	"</tr>\n"
+	"<tr>"
+	"<th></th>"
+	"<th>TMP</th>"
+	"<th>MNX</th>"
+	"<th>HUM</th>"
+	"<th>CLD</th>"
+	"<th>SPD</th>"
+	"<th>DIR</th>"
+	"</tr>\n";
+
+static const char *pink_border = " style=\"border: solid 1px pink; border-bottom: none\"";
+
+void
+dwml_format_html(struct buf *buf, const struct dwml *dwml)
+{
+	size_t i, n;
+	char timestr[30];
+	struct tm tm;
+	int prev_day = 0;
+	const char *style = "";
+
+	tz_localtime(dwml->tz, dwml->base_time, &tm);
+	n = strftime(timestr, 30, "%Y-%m-%d %H %a", &tm);
+
+	buf_appendf(buf, "<table border=\"0\">\n");
+	buf_appendf(buf, header);
+
+	for (i = 0; i < dwml->n_rows; i++) {
+		const struct row *r = &dwml->rows[i];
+		if (row_is_empty(r))
+			continue;
+
+		tz_localtime(dwml->tz, r->time, &tm);
+		if (prev_day != tm.tm_mday) {
+			buf_appendf(buf, "\n<tr><td colspan=\"12\" style=\"border: lightsteelblue 1px solid;\">");
+			n = strftime(timestr, 30, "%Y-%m-%d %a", &tm);
+			buf_append(buf, timestr, n);
+			buf_appendf(buf, "</td></tr>\n<tr>");
+			prev_day = tm.tm_mday;
+		} else {
+			buf_appendf(buf, "<tr>");
+		}
+
+		if (r->temp_max.has_value)
+			style = pink_border;
+
+		buf_appendf(buf, "<td>%02d</td>", tm.tm_hour);
+
+//		if (r->temp_hourly.has_value)
+//			buf_appendf(buf, "<td>%d</td>", r->temp_hourly.celcius);
+//		else
+//			buf_appendf(buf, "<td></td>");
+
+		if (r->temp_apparent.has_value)
+			buf_appendf(buf, "<td>%d</td>", r->temp_apparent.celcius);
+		else
+			buf_appendf(buf, "<td></td>");
+
+		if (r->temp_min.has_value)
+			buf_appendf(buf, "<td%s>%d</td>", style, r->temp_min.celcius);
+		else if (r->temp_max.has_value)
+			buf_appendf(buf, "<td%s>%d</td>", style, r->temp_max.celcius);
+		else
+			buf_appendf(buf, "<td></td>");
+
+		if (r->humidity.has_value)
+			buf_appendf(buf, "<td>%d</td>", r->humidity.percent);
+		else
+			buf_appendf(buf, "<td></td>");
+
+		if (r->cloud_amount.has_value)
+			buf_appendf(buf, "<td>%d</td>", r->cloud_amount.percent);
+		else
+			buf_appendf(buf, "<td></td>");
+
+		if (r->wind_speed.has_value)
+			buf_appendf(buf, "<td>%d</td>", r->wind_speed.mps);
+		else
+			buf_appendf(buf, "<td></td>");
+
+		if (r->wind_dir.has_value)
+			buf_appendf(buf, "<td>%d</td>", r->wind_dir.degrees);
+		else
+			buf_appendf(buf, "<td></td>");
+
+		if (r->snow_amount.has_value && r->snow_amount.centimeters > 0)
+			buf_add_snow(buf, "<td>%d</td>", "<td>%.1f</td>", r->snow_amount.centimeters, dwml->units);
+		else
+			buf_appendf(buf, "<td></td>");
+
+		if (r->weather != NULL)
+			buf_appendf(buf, "<td>%s</td>", r->weather);
+		else
+			buf_appendf(buf, "<td></td>");
+
+		buf_appendf(buf, "</tr>\n");
+	}
+
+	buf_appendf(buf, "</table>\n");
+}
+
+/* ===== digest ===================== */
+
+static int
+mean(const struct column_stats *st)
+{
+	return (st->sum + (st->sum < 0 ? -1 : 1) * (int64_t)st->count / 2) / (int64_t)st->count;
+}
+
+void
+dwml_format_digest_text(struct buf *buf, const struct dwml *dwml)
+{
+	struct day_summary *days;
+	long i, n;
+	char timestr[30];
+	struct tm tm;
+
+	n = dwml_daily_summary(dwml, &days);
+	if (n < 0) {
+		buf_appendf(buf, "cannot allocate daily summary\n");
+		return;
+	}
+
+	buf_appendf(buf, "========== === === === === ==== =====\n");
+	buf_appendf(buf, "DATE...... DAY TEMP....... WIND SNOW.\n");
+	buf_appendf(buf, "               MIN MAX AVG  MAX TOTAL\n");
+	buf_appendf(buf, "========== === === === === ==== =====\n");
+
+	for (i = 0; i < n; i++) {
+		const struct day_summary *d = &days[i];
+		if (d->temp.count == 0 && d->wind.count == 0 && d->snow.count == 0)
+			continue;
+
+		tz_localtime(dwml->tz, d->start, &tm);
+		strftime(timestr, 30, "%Y-%m-%d %a", &tm);
+		buf_appendf(buf, "%s", timestr);
+
+		if (d->temp.count > 0)
+			buf_appendf(buf, "%4d%4d%4d", d->temp.min, d->temp.max, mean(&d->temp));
+		else
+			buf_append(buf, "            ", 12);
+
+		if (d->wind.count > 0)
+			buf_appendf(buf, "%5d", d->wind.max);
+		else
+			buf_append(buf, "     ", 5);
+
+		if (d->snow.count > 0)
+			buf_add_snow(buf, "%6d", "%6.1f", d->snow.sum, dwml->units);
+
+		buf_append(buf, "\n", 1);
+	}
+
+	buf_appendf(buf, "========== === === === === ==== =====\n");
+	buf_appendf(buf, "temperature in %s, wind in %s, snow in %s\n",
+		    temp_unit[dwml->units], speed_unit[dwml->units], snow_unit[dwml->units]);
+
+	free(days);
+}
+
+void
+dwml_format_digest_html(struct buf *buf, const struct dwml *dwml)
+{
+	struct day_summary *days;
+	long i, n;
+	char timestr[30];
+	struct tm tm;
+
+	n = dwml_daily_summary(dwml, &days);
+	if (n < 0) {
+		buf_appendf(buf, "cannot allocate daily summary\n");
+		return;
+	}
+
+	buf_appendf(buf, "<table border=\"0\">\n");
+	buf_appendf(buf, "<tr style=\"background-color: lightsteelblue;\">"
+		    "<th>DAY</th><th colspan=\"3\">TEMP</th><th>WIND</th><th>SNOW</th></tr>\n"
+		    "<tr><th></th><th>MIN</th><th>MAX</th><th>AVG</th><th>MAX</th><th>TOTAL</th></tr>\n");
+
+	for (i = 0; i < n; i++) {
+		const struct day_summary *d = &days[i];
+		if (d->temp.count == 0 && d->wind.count == 0 && d->snow.count == 0)
+			continue;
+
+		tz_localtime(dwml->tz, d->start, &tm);
+		strftime(timestr, 30, "%Y-%m-%d %a", &tm);
+		buf_appendf(buf, "<tr><td>%s</td>", timestr);
+
+		if (d->temp.count > 0)
+			buf_appendf(buf, "<td>%d</td><td>%d</td><td>%d</td>", d->temp.min, d->temp.max, mean(&d->temp));
+		else
+			buf_appendf(buf, "<td></td><td></td><td></td>");
+
+		if (d->wind.count > 0)
+			buf_appendf(buf, "<td>%d</td>", d->wind.max);
+		else
+			buf_appendf(buf, "<td></td>");
+
+		if (d->snow.count > 0 && d->snow.sum > 0)
+			buf_add_snow(buf, "<td>%d</td>", "<td>%.1f</td>", d->snow.sum, dwml->units);
+		else
+			buf_appendf(buf, "<td></td>");
+
+		buf_appendf(buf, "</tr>\n");
+	}
+
+	buf_appendf(buf, "</table>\n");
+	buf_appendf(buf, "<p>temperature in %s, wind in %s, snow in %s</p>\n",
+		    temp_unit[dwml->units], speed_unit[dwml->units], snow_unit[dwml->units]);
+
+	free(days);
+}
@@ -0,0 +1,260 @@
+/**
+ * Serge Voilokov, 2015.
+ * Column kernels: unit conversion and daily summary.
+ *
+ * Rows are gathered into contiguous value and presence arrays, so kernel
+ * loops have no early exits and no data dependent branches and compiler
+ * can vectorize them.
+ */
+
+#include "dwml.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DAY (24 * 3600)
+
+/* ===== kernels ===================== */
+
+static void
+scale_round(int32_t *value, size_t n, float scale, float offset)
+{
+	size_t i;
+	float x;
+
+	for (i = 0; i < n; i++) {
+		x = value[i] * scale + offset;
+		value[i] = (int32_t)(x + (x < 0 ? -0.5f : 0.5f));
+	}
+}
+
+void
+dwml_column_stats(const int32_t *value, const uint8_t *has_value, size_t n, struct column_stats *st)
+{
+	int32_t min = INT32_MAX, max = INT32_MIN, v;
+	int64_t sum = 0;
+	size_t i, count = 0;
+	bool h;
+
+	for (i = 0; i < n; i++) {
+		v = value[i];
+		h = has_value[i];
+		min = h && v < min ? v : min;
+		max = h && v > max ? v : max;
+		sum += h ? v : 0;
+		count += h;
+	}
+
+	st->min = min;
+	st->max = max;
+	st->sum = sum;
+	st->count = count;
+}
+
+void
+dwml_column_convert(int32_t *value, size_t n, enum column col, enum units units)
+{
+	if (units != UNITS_IMPERIAL)
+		return;
+
+	switch (col) {
+	case COLUMN_TEMP_HOURLY:
+	case COLUMN_TEMP_APPARENT:
+	case COLUMN_TEMP_MIN:
+	case COLUMN_TEMP_MAX:
+		scale_round(value, n, 1.8f, 32.0f);
+		break;
+	case COLUMN_WIND_SPEED:
+		scale_round(value, n, 2.2369363f, 0.0f);
+		break;
+	case COLUMN_SNOW_AMOUNT:
+		/* tenths of inch, whole inches lose most of snow forecast */
+		scale_round(value, n, 3.9370079f, 0.0f);
+		break;
+	default:
+		break;
+	}
+}
+
+/* ===== rows ======================== */
+
+void
+dwml_column_values(const struct dwml *dwml, enum column col, int32_t *value, uint8_t *has_value)
+{
+	size_t i;
+	bool *has;
+
+	for (i = 0; i < dwml->n_rows; i++) {
+		value[i] = *dwml_column(&dwml->rows[i], col, &has);
+		has_value[i] = *has;
+	}
+}
+
+static void
+set_column_values(struct dwml *dwml, enum column col, const int32_t *value)
+{
+	size_t i;
+	bool *has;
+
+	for (i = 0; i < dwml->n_rows; i++)
+		*dwml_column(&dwml->rows[i], col, &has) = value[i];
+}
+
+int
+dwml_set_units(struct dwml *dwml, enum units units)
+{
+	int32_t *value;
+	uint8_t *has_value;
+	int c;
+
+	if (dwml->units == units)
+		return 0;
+
+	if (dwml->units != UNITS_METRIC) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	value = malloc(dwml->n_rows * sizeof(int32_t) + 1);
+	has_value = malloc(dwml->n_rows + 1);
+	if (value == NULL || has_value == NULL) {
+		free(value);
+		free(has_value);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (c = 0; c < COLUMN_ENUM_MAX; c++) {
+		dwml_column_values(dwml, c, value, has_value);
+		dwml_column_convert(value, dwml->n_rows, c, units);
+		set_column_values(dwml, c, value);
+	}
+
+	dwml->units = units;
+
+	free(value);
+	free(has_value);
+
+	return 0;
+}
+
+/* ===== days ======================== */
+
+/* daytime max temperature intervals, min temperature layout has nighttime ones */
+static const struct time_layout *
+day_layout(const struct dwml *dwml)
+{
+	const struct time_layout *tl = dwml->max_temp_layout;
+
+	return tl != NULL && tl->period == 24 && tl->count > 0 ? tl : NULL;
+}
+
+/* first row at or after t */
+static size_t
+lower_bound(const struct dwml *dwml, time_t t)
+{
+	size_t lo = 0, hi = dwml->n_rows, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (dwml->rows[mid].time < t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* local midnight on or before t */
+static time_t
+local_midnight(const struct tz *tz, time_t t)
+{
+	struct tm tm;
+
+	tz_localtime(tz, t, &tm);
+
+	return t - tm.tm_hour * 3600 - tm.tm_min * 60 - tm.tm_sec;
+}
+
+long
+dwml_daily_summary(const struct dwml *dwml, struct day_summary **days)
+{
+	const struct time_layout *tl = day_layout(dwml);
+	int32_t *value[3] = { NULL };
+	uint8_t *has_value[3] = { NULL };
+	const enum column cols[3] = { COLUMN_TEMP_HOURLY, COLUMN_WIND_SPEED, COLUMN_SNOW_AMOUNT };
+	size_t i, n, lo, hi, c, lead;
+	struct day_summary *d;
+	time_t t;
+	long ret = -1;
+
+	*days = NULL;
+	if (dwml->n_rows == 0)
+		return 0;
+
+	/*
+	 * Day buckets start at max temperature intervals, local midnight if
+	 * there are none. Rows before the first interval join the first day
+	 * on the same date, or make a partial day of their own.
+	 */
+	if (tl != NULL) {
+		t = tl->intervals[0].start_valid_time;
+		lead = dwml->rows[0].time < t && local_midnight(dwml->tz, dwml->rows[0].time) != local_midnight(dwml->tz, t);
+		n = tl->count + lead;
+		*days = calloc(n, sizeof(struct day_summary));
+		if (*days == NULL)
+			return -1;
+		for (i = lead; i < n; i++) {
+			(*days)[i].start = tl->intervals[i - lead].start_valid_time;
+			(*days)[i].end = i + 1 < n ? tl->intervals[i + 1 - lead].start_valid_time : (*days)[i].start + DAY;
+		}
+		if (lead)
+			(*days)[0].end = t;
+		if (dwml->rows[0].time < t)
+			(*days)[0].start = dwml->rows[0].time;
+	} else {
+		t = local_midnight(dwml->tz, dwml->rows[0].time);
+		n = (dwml->rows[dwml->n_rows - 1].time - t) / DAY + 1;
+		*days = calloc(n, sizeof(struct day_summary));
+		if (*days == NULL)
+			return -1;
+		for (i = 0; i < n; i++) {
+			(*days)[i].start = i == 0 ? t : (*days)[i - 1].end;
+			/* day after dst change is 23 or 25 hours */
+			(*days)[i].end = local_midnight(dwml->tz, (*days)[i].start + DAY + 2 * 3600);
+		}
+	}
+
+	for (c = 0; c < 3; c++) {
+		value[c] = malloc(dwml->n_rows * sizeof(int32_t));
+		has_value[c] = malloc(dwml->n_rows);
+		if (value[c] == NULL || has_value[c] == NULL)
+			goto done;
+		dwml_column_values(dwml, cols[c], value[c], has_value[c]);
+	}
+
+	for (i = 0; i < n; i++) {
+		d = &(*days)[i];
+		lo = lower_bound(dwml, d->start);
+		hi = lower_bound(dwml, d->end);
+		dwml_column_stats(value[0] + lo, has_value[0] + lo, hi - lo, &d->temp);
+		dwml_column_stats(value[1] + lo, has_value[1] + lo, hi - lo, &d->wind);
+		dwml_column_stats(value[2] + lo, has_value[2] + lo, hi - lo, &d->snow);
+	}
+	ret = n;
+
+done:
+	for (c = 0; c < 3; c++) {
+		free(value[c]);
+		free(has_value[c]);
+	}
+
+	if (ret < 0) {
+		free(*days);
+		*days = NULL;
+	}
+
+	return ret;
+}
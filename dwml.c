@@ -0,0 +1,934 @@
+/**
+ * Serge Voilokov, 2015.
+ * DWML parser.
+ */
+
+#include "dwml.h"
+#include "common/struct.h"
+#include "common/xml.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <libxml/parser.h>
+
+static const char *temperature_type_names[] = {
+	[TEMPERATURE_HOURLY] = "hourly",
+	[TEMPERATURE_MAXIMUM] = "maximum",
+	[TEMPERATURE_MINIMUM] = "minimum",
+	[TEMPERATURE_APPARENT] = "apparent"
+};
+
+static const enum column temperature_columns[] = {
+	[TEMPERATURE_HOURLY] = COLUMN_TEMP_HOURLY,
+	[TEMPERATURE_MAXIMUM] = COLUMN_TEMP_MAX,
+	[TEMPERATURE_MINIMUM] = COLUMN_TEMP_MIN,
+	[TEMPERATURE_APPARENT] = COLUMN_TEMP_APPARENT
+};
+
+static enum temperature_type
+get_temp_type(const char *name)
+{
+	size_t i;
+
+	if (name == NULL)
+		return TEMPERATURE_ENUM_MAX;
+
+	for (i = 0; i < TEMPERATURE_ENUM_MAX; i++)
+		if (strcmp(name, temperature_type_names[i]) == 0)
+			return i;
+
+	return TEMPERATURE_ENUM_MAX;
+}
+
+static const char *status_names[] = {
+	[DWML_OK] = "ok",
+	[DWML_ERR_IO] = "io",
+	[DWML_ERR_XML] = "xml",
+	[DWML_ERR_FORMAT] = "format",
+	[DWML_ERR_NOMEM] = "memory"
+};
+
+const char *
+dwml_status_name(enum dwml_status status)
+{
+	return status <= DWML_ERR_NOMEM ? status_names[status] : "unknown";
+}
+
+/* keep first error of document, later ones are usually its consequences */
+static void
+set_error(struct dwml_error *error, enum dwml_status status, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (error == NULL || error->status != DWML_OK)
+		return;
+
+	error->status = status;
+	va_start(ap, fmt);
+	vsnprintf(error->message, sizeof(error->message), fmt, ap);
+	va_end(ap);
+}
+
+/* utc offsets seen in layout times, document does not name its zone */
+struct zone_samples
+{
+	size_t n;
+	time_t t[8];
+	int32_t offset[8];
+};
+
+/* 2015-08-21T08:00:00-04:00 */
+static int
+parse_time(const char *text, time_t *t, int32_t *offset)
+{
+	int year, mon, mday, hour, min, sec, off_h, off_m;
+	char sign;
+
+	if (text == NULL || sscanf(text, "%d-%d-%dT%d:%d:%d%c%d:%d", &year, &mon, &mday, &hour, &min, &sec,
+		   &sign, &off_h, &off_m) != 9 || (sign != '+' && sign != '-'))
+		return -1;
+
+	*offset = (sign == '-' ? -1 : 1) * (off_h * 3600 + off_m * 60);
+	*t = tz_timegm(year, mon, mday, hour, min, sec) - *offset;
+
+	return 0;
+}
+
+/* keep first time and every offset change */
+static void
+add_sample(struct zone_samples *zs, time_t t, int32_t offset)
+{
+	if (zs->n == sizeof(zs->t) / sizeof(zs->t[0]) || (zs->n > 0 && zs->offset[zs->n - 1] == offset))
+		return;
+
+	zs->t[zs->n] = t;
+	zs->offset[zs->n] = offset;
+	zs->n++;
+}
+
+static void
+free_layout(struct time_layout *tl)
+{
+	if (tl == NULL)
+		return;
+
+	free(tl->key);
+	free(tl->intervals);
+	free(tl->rows);
+	free(tl);
+}
+
+/* NDFD layouts have at most a few hundred intervals */
+#define MAX_INTERVALS 10000
+
+static struct time_layout *
+parse_time_layout(const xmlNodePtr layout_node, struct zone_samples *zs, struct dwml_error *error)
+{
+	xmlNodePtr n = NULL;
+	const char *text;
+	int res = 0;
+	int i = 0;
+	int32_t offset;
+
+	n = first_el(layout_node, "layout-key");
+	if (n == NULL || (text = get_ctext(n)) == NULL) {
+		set_error(error, DWML_ERR_FORMAT, "no layout key in time-layout");
+		return NULL;
+	}
+
+	struct time_layout *tl = calloc(1, sizeof(struct time_layout));
+	if (tl == NULL || (tl->key = strdup(text)) == NULL) {
+		set_error(error, DWML_ERR_NOMEM, "cannot allocate time layout");
+		goto fail;
+	}
+
+	res = sscanf(tl->key, "k-p%dh-n%d-%d", &tl->period, &tl->count, &tl->seq_number);
+	if (res != 3 || tl->count <= 0 || tl->count > MAX_INTERVALS) {
+		set_error(error, DWML_ERR_FORMAT, "cannot parse layout key: %s", tl->key);
+		goto fail;
+	}
+
+	tl->intervals = calloc(tl->count, sizeof(struct time_interval));
+	if (tl->intervals == NULL) {
+		set_error(error, DWML_ERR_NOMEM, "cannot allocate %d intervals of %s", tl->count, tl->key);
+		goto fail;
+	}
+
+	for (i = 0, n = first_el(layout_node, "start-valid-time"); n != NULL; n = next_el(n), i++) {
+		text = get_ctext(n);
+		if (i == tl->count) {
+			set_error(error, DWML_ERR_FORMAT, "more start-valid-time than %d in %s", tl->count, tl->key);
+			goto fail;
+		}
+		if (parse_time(text, &tl->intervals[i].start_valid_time, &offset) != 0) {
+			set_error(error, DWML_ERR_FORMAT, "cannot parse start-valid-time: %s", text ? text : "");
+			goto fail;
+		}
+		add_sample(zs, tl->intervals[i].start_valid_time, offset);
+	}
+
+	for (i = 0, n = first_el(layout_node, "end-valid-time"); n != NULL; n = next_el(n), i++) {
+		text = get_ctext(n);
+		if (i == tl->count) {
+			set_error(error, DWML_ERR_FORMAT, "more end-valid-time than %d in %s", tl->count, tl->key);
+			goto fail;
+		}
+		if (parse_time(text, &tl->intervals[i].end_valid_time, &offset) != 0) {
+			set_error(error, DWML_ERR_FORMAT, "cannot parse end-valid-time: %s", text ? text : "");
+			goto fail;
+		}
+	}
+
+	return tl;
+
+fail:
+	free_layout(tl);
+	return NULL;
+}
+
+static const struct time_layout *
+find_layout(const struct dwml *dwml, xmlNodePtr node)
+{
+	size_t i;
+	const char *layout_name = get_attr(node, "time-layout");
+
+	if (layout_name == NULL)
+		return NULL;
+
+	for (i = 0; i < dwml->n_layouts; i++)
+		if (strcmp(dwml->time_layouts[i]->key, layout_name) == 0)
+			return dwml->time_layouts[i];
+
+	return NULL;
+}
+
+static struct row *
+get_row(struct dwml* dwml, const struct time_layout *layout, size_t idx)
+{
+	if (layout == NULL || idx >= (size_t)layout->count || layout->rows[idx] < 0)
+		return NULL;
+
+	return &dwml->rows[layout->rows[idx]];
+}
+
+/* numeric values of parameter block into column of rows of its layout */
+static void
+parse_values(struct dwml *dwml, const xmlNodePtr node, enum column col)
+{
+	size_t i;
+	xmlNodePtr vn;
+	struct row *row;
+	bool *has_value;
+	int *value;
+	const char *text;
+	const struct time_layout *layout = find_layout(dwml, node);
+
+	for (i = 0, vn = first_el(node, "value"); vn != NULL; vn = next_el(vn), i++) {
+		row = get_row(dwml, layout, i);
+		if (row == NULL || (text = get_ctext(vn)) == NULL)
+			continue;
+
+		value = dwml_column(row, col, &has_value);
+		*value = atoi(text);
+		*has_value = true;
+	}
+}
+
+static void
+parse_temperature(struct dwml* dwml, const xmlNodePtr node)
+{
+	enum temperature_type etemp = get_temp_type(get_attr(node, "type"));
+
+	/* unknown types are skipped, not fatal */
+	if (etemp == TEMPERATURE_ENUM_MAX)
+		return;
+
+	/* digest days follow it even when its values are not decoded */
+	if (etemp == TEMPERATURE_MAXIMUM)
+		dwml->max_temp_layout = find_layout(dwml, node);
+
+	if (dwml->fields & DWML_FIELD(temperature_columns[etemp]))
+		parse_values(dwml, node, temperature_columns[etemp]);
+}
+
+static void
+parse_weather(struct dwml* dwml, const xmlNodePtr node)
+{
+	size_t i;
+	xmlNodePtr nc, nv;
+	struct buf wxbuf;
+	struct row *row;
+	const struct time_layout *layout = find_layout(dwml, node);
+
+	buf_init(&wxbuf);
+
+	for (i = 0, nc = first_el(node, "weather-conditions"); nc != NULL; nc = next_el(nc), i++) {
+		row = get_row(dwml, layout, i);
+		if (row == NULL)
+			continue;
+
+		for (nv = first_el(nc, "value"); nv != NULL; nv = next_el(nv)) {
+			const char *coverage = get_attr(nv, "coverage");
+			const char *intensity = get_attr(nv, "intensity");
+			const char *additive = get_attr(nv, "additive");
+			const char *qualifier = get_attr(nv, "qualifier");
+			const char *weather_type = get_attr(nv, "weather-type");
+
+			if (coverage == NULL || weather_type == NULL)
+				continue;
+
+			if (intensity != NULL && strcmp(intensity, "none") == 0)
+				intensity = NULL;
+
+			if (qualifier != NULL && strcmp(qualifier, "none") == 0)
+				qualifier = NULL;
+
+			if (additive != NULL) {
+				if (strcmp(additive, "and") == 0)
+					buf_appendf(&wxbuf, ",");
+				else
+					buf_appendf(&wxbuf, " %s", additive);
+			}
+
+			if (intensity != NULL)
+				buf_appendf(&wxbuf, " %s", intensity);
+
+			if (strcmp(weather_type, "thunderstorms") == 0)
+				weather_type = "TND";
+			else if (strcmp(weather_type, "rain showers") == 0)
+				weather_type = "SHW";
+
+			if (strcmp(coverage, "slight chance") == 0)
+				coverage = "20%";
+			else if (strcmp(coverage, "chance") == 0)
+				coverage = "40%";
+			else if (strcmp(coverage, "likely") == 0)
+				coverage = "60%";
+
+			buf_appendf(&wxbuf, " %s %s", weather_type, coverage);
+
+			if (qualifier != NULL)
+				buf_appendf(&wxbuf, " (%s)", qualifier);
+		}
+
+		if (wxbuf.len > 0) {
+			free(row->weather);
+			row->weather = strdup(wxbuf.s);
+			buf_clean(&wxbuf);
+		}
+	}
+
+	free(wxbuf.s);
+}
+
+/*
+ * <hazard-conditions> per layout interval, each with zero or more <hazard>.
+ * The same hazard in adjacent intervals becomes one time range.
+ */
+static int
+parse_hazards(struct dwml *dwml, const xmlNodePtr node, struct dwml_error *error)
+{
+	size_t i, j;
+	xmlNodePtr nc, nh;
+	struct hazard h, *prev, *hazards;
+	const char *code, *phenomena, *significance;
+	const struct time_layout *layout = find_layout(dwml, node);
+
+	if (layout == NULL)
+		return 0;
+
+	for (i = 0, nc = first_el(node, "hazard-conditions"); nc != NULL && i < (size_t)layout->count;
+	     nc = next_el(nc), i++) {
+		for (nh = first_el(nc, "hazard"); nh != NULL; nh = next_el(nh)) {
+			code = get_attr(nh, "hazardCode");
+			phenomena = get_attr(nh, "phenomena");
+			significance = get_attr(nh, "significance");
+			if (code == NULL)
+				continue;
+
+			memset(&h, 0, sizeof(h));
+			strncpy(h.code, code, sizeof(h.code) - 1);
+			strncpy(h.phenomena, phenomena != NULL ? phenomena : "", sizeof(h.phenomena) - 1);
+			strncpy(h.significance, significance != NULL ? significance : "", sizeof(h.significance) - 1);
+			h.start = layout->intervals[i].start_valid_time;
+			h.end = layout->intervals[i].end_valid_time;
+			if (h.end == 0)
+				h.end = h.start + layout->period * 3600;
+
+			/* other hazards of the interval come in between, extend latest one of the code */
+			for (prev = NULL, j = dwml->n_hazards; j > 0; j--) {
+				if (strcmp(dwml->hazards[j - 1].code, h.code) == 0) {
+					prev = &dwml->hazards[j - 1];
+					break;
+				}
+			}
+			if (prev != NULL && prev->end == h.start) {
+				prev->end = h.end;
+				continue;
+			}
+
+			hazards = realloc(dwml->hazards, (dwml->n_hazards + 1) * sizeof(struct hazard));
+			if (hazards == NULL) {
+				set_error(error, DWML_ERR_NOMEM, "cannot allocate %zu hazards", dwml->n_hazards + 1);
+				return -1;
+			}
+			dwml->hazards = hazards;
+			dwml->hazards[dwml->n_hazards++] = h;
+		}
+	}
+
+	return 0;
+}
+
+/* numeric parameter blocks other than temperature, which is told apart by type */
+static const struct {
+	const char *name;
+	enum column col;
+} value_blocks[] = {
+	{ "wind-speed",    COLUMN_WIND_SPEED },
+	{ "direction",     COLUMN_WIND_DIR },
+	{ "cloud-amount",  COLUMN_CLOUD_AMOUNT },
+	{ "precipitation", COLUMN_SNOW_AMOUNT },
+	{ "humidity",      COLUMN_HUMIDITY }
+};
+
+/* decode only blocks in dwml->fields, others are not even looked at */
+static int
+parse_parameters(struct dwml* dwml, const xmlNodePtr node, struct dwml_error *error)
+{
+	xmlNodePtr n;
+	size_t i;
+
+	for (n = first_el(node, "temperature"); n != NULL; n = next_el(n))
+		parse_temperature(dwml, n);
+
+	for (i = 0; i < sizeof(value_blocks) / sizeof(value_blocks[0]); i++) {
+		if ((dwml->fields & DWML_FIELD(value_blocks[i].col)) == 0)
+			continue;
+		for (n = first_el(node, value_blocks[i].name); n != NULL; n = next_el(n))
+			parse_values(dwml, n, value_blocks[i].col);
+	}
+
+	if (dwml->fields & DWML_FIELD_WEATHER)
+		for (n = first_el(node, "weather"); n != NULL; n = next_el(n))
+			parse_weather(dwml, n);
+
+	if (dwml->fields & DWML_FIELD_HAZARDS)
+		for (n = first_el(node, "hazards"); n != NULL; n = next_el(n))
+			if (parse_hazards(dwml, n, error) != 0)
+				return -1;
+
+	return 0;
+}
+
+static int
+cmp_time(const void *a, const void *b)
+{
+	time_t ta = *(const time_t *)a, tb = *(const time_t *)b;
+
+	return ta < tb ? -1 : ta > tb;
+}
+
+/*
+ * Create one row per distinct start time inside the horizon, so coarse
+ * 6h/24h parameters do not pay for empty hourly slots, and map every
+ * layout interval to its row.
+ */
+static int
+build_rows(struct dwml* dwml, struct dwml_error *error)
+{
+	size_t i, j, n = 0, total = 0;
+	time_t t, *times, *found;
+	struct time_layout *tl;
+
+	/* rows start in the current hour */
+	time_t from = dwml->base_time - 3600;
+	time_t to = dwml->horizon > 0 ? dwml->base_time + dwml->horizon : 0;
+
+	for (i = 0; i < dwml->n_layouts; i++)
+		total += dwml->time_layouts[i]->count;
+
+	times = malloc(total * sizeof(time_t) + 1);
+	if (times == NULL) {
+		set_error(error, DWML_ERR_NOMEM, "cannot allocate %zu row times", total);
+		return -1;
+	}
+
+	for (i = 0; i < dwml->n_layouts; i++) {
+		tl = dwml->time_layouts[i];
+		for (j = 0; j < (size_t)tl->count; j++) {
+			t = tl->intervals[j].start_valid_time;
+			if (t <= from || (to != 0 && t >= to))
+				continue;
+			times[n++] = t;
+		}
+	}
+
+	qsort(times, n, sizeof(time_t), cmp_time);
+
+	dwml->n_rows = 0;
+	for (i = 0; i < n; i++)
+		if (dwml->n_rows == 0 || times[dwml->n_rows - 1] != times[i])
+			times[dwml->n_rows++] = times[i];
+
+	dwml->rows = calloc(dwml->n_rows + 1, sizeof(struct row));
+	if (dwml->rows == NULL) {
+		set_error(error, DWML_ERR_NOMEM, "cannot allocate %zu rows", dwml->n_rows);
+		dwml->n_rows = 0;
+		free(times);
+		return -1;
+	}
+	for (i = 0; i < dwml->n_rows; i++)
+		dwml->rows[i].time = times[i];
+
+	for (i = 0; i < dwml->n_layouts; i++) {
+		tl = dwml->time_layouts[i];
+		tl->rows = malloc(tl->count * sizeof(int) + 1);
+		if (tl->rows == NULL) {
+			set_error(error, DWML_ERR_NOMEM, "cannot allocate rows of %s", tl->key);
+			free(times);
+			return -1;
+		}
+		for (j = 0; j < (size_t)tl->count; j++) {
+			found = bsearch(&tl->intervals[j].start_valid_time, times, dwml->n_rows,
+					sizeof(time_t), cmp_time);
+			tl->rows[j] = found != NULL ? found - times : -1;
+		}
+	}
+
+	free(times);
+
+	return 0;
+}
+
+/* point is index of parameters block to parse, -1 merges all of them */
+static int
+parse_data(struct dwml* dwml, const xmlNodePtr data_node, int point, struct dwml_error *error)
+{
+	xmlNodePtr n = NULL;
+	size_t i = 0, count = 0;
+	struct zone_samples zs = { 0 };
+
+	if (data_node == NULL) {
+		set_error(error, DWML_ERR_FORMAT, "no data element");
+		return -1;
+	}
+
+	for (n = first_el(data_node, "time-layout"); n != NULL; n = next_el(n))
+		count++;
+
+	if (count == 0) {
+		set_error(error, DWML_ERR_FORMAT, "no time-layout in data");
+		return -1;
+	}
+
+	dwml->time_layouts = calloc(count, sizeof(struct time_layout *));
+	if (dwml->time_layouts == NULL) {
+		set_error(error, DWML_ERR_NOMEM, "cannot allocate %zu time layouts", count);
+		return -1;
+	}
+
+	/* n_layouts counts parsed ones, so dwml_free sees no holes */
+	for (n = first_el(data_node, "time-layout"); n != NULL; n = next_el(n)) {
+		dwml->time_layouts[dwml->n_layouts] = parse_time_layout(n, &zs, error);
+		if (dwml->time_layouts[dwml->n_layouts] == NULL)
+			return -1;
+		dwml->n_layouts++;
+	}
+
+	if (dwml->tz == NULL)
+		dwml->tz = tz_guess(zs.t, zs.offset, zs.n);
+
+	if (build_rows(dwml, error) != 0)
+		return -1;
+
+	for (i = 0, n = first_el(data_node, "parameters"); n != NULL; n = next_el(n), i++)
+		if ((point < 0 || i == (size_t)point) && parse_parameters(dwml, n, error) != 0)
+			return -1;
+
+	return 0;
+}
+
+static struct dwml *
+new_dwml(const struct dwml_opts *opts, struct dwml_error *error)
+{
+	struct dwml *dwml = calloc(1, sizeof(struct dwml));
+
+	if (dwml == NULL) {
+		set_error(error, DWML_ERR_NOMEM, "cannot allocate forecast");
+		return NULL;
+	}
+
+	if (opts == NULL) {
+		dwml->base_time = time(NULL);
+		dwml->horizon = DWML_DEFAULT_HORIZON * 3600;
+	} else {
+		dwml->base_time = opts->base_time != 0 ? opts->base_time : time(NULL);
+		dwml->horizon = (time_t)opts->horizon * 3600;
+		dwml->tz = opts->tz;
+		dwml->fields = opts->fields;
+	}
+
+	if (dwml->fields == 0)
+		dwml->fields = DWML_FIELDS_ALL;
+
+	return dwml;
+}
+
+/* <creation-date refresh-frequency="PT1H">2015-08-21T08:00:00Z</creation-date> */
+static void
+parse_head(struct dwml* dwml, const xmlNodePtr root_element)
+{
+	xmlNodePtr n;
+	const char *freq;
+	int hours, year, mon, mday, hour, min, sec;
+
+	if ((n = first_el(root_element, "head")) == NULL ||
+	    (n = first_el(n, "product")) == NULL ||
+	    (n = first_el(n, "creation-date")) == NULL)
+		return;
+
+	if (get_ctext(n) != NULL &&
+	    sscanf(get_ctext(n), "%d-%d-%dT%d:%d:%dZ", &year, &mon, &mday, &hour, &min, &sec) == 6)
+		dwml->creation_date = tz_timegm(year, mon, mday, hour, min, sec);
+
+	freq = get_attr(n, "refresh-frequency");
+	if (freq != NULL && sscanf(freq, "PT%dH", &hours) == 1)
+		dwml->refresh_frequency = hours * 3600;
+}
+
+/* document element, NULL if it is not dwml */
+static xmlNodePtr
+dwml_root(xmlDoc *doc, struct dwml_error *error)
+{
+	xmlNodePtr root_element = xmlDocGetRootElement(doc);
+
+	if (root_element == NULL || xmlStrcmp(root_element->name, (const xmlChar *)"dwml") != 0) {
+		set_error(error, DWML_ERR_FORMAT, "root element is %s, not dwml",
+			  root_element != NULL ? (const char *)root_element->name : "missing");
+		return NULL;
+	}
+
+	return root_element;
+}
+
+static struct dwml *
+load_doc(xmlDoc *doc, const struct dwml_opts *opts, struct dwml_error *error)
+{
+	xmlNodePtr root_element, data;
+	struct dwml *dwml = NULL;
+
+	root_element = dwml_root(doc, error);
+	if (root_element == NULL)
+		goto done;
+
+	dwml = new_dwml(opts, error);
+	if (dwml == NULL)
+		goto done;
+	parse_head(dwml, root_element);
+
+	data = first_el(root_element, "data");
+	if (parse_data(dwml, data, -1, error) != 0) {
+		dwml_free(dwml);
+		dwml = NULL;
+	}
+
+done:
+	xmlFreeDoc(doc);
+
+	return dwml;
+}
+
+static struct dwml **
+load_doc_points(xmlDoc *doc, const struct dwml_opts *opts, size_t *n_points, struct dwml_error *error)
+{
+	xmlNodePtr root_element, data, n;
+	size_t i;
+	struct dwml **points = NULL;
+
+	*n_points = 0;
+
+	root_element = dwml_root(doc, error);
+	if (root_element == NULL)
+		goto done;
+
+	data = first_el(root_element, "data");
+	if (data == NULL) {
+		set_error(error, DWML_ERR_FORMAT, "no data element");
+		goto done;
+	}
+
+	for (n = first_el(data, "parameters"); n != NULL; n = next_el(n))
+		(*n_points)++;
+
+	if (*n_points == 0) {
+		set_error(error, DWML_ERR_FORMAT, "no parameters in data");
+		goto done;
+	}
+
+	points = calloc(*n_points, sizeof(struct dwml *));
+	if (points == NULL) {
+		set_error(error, DWML_ERR_NOMEM, "cannot allocate %zu forecast points", *n_points);
+		*n_points = 0;
+		goto done;
+	}
+
+	for (i = 0; i < *n_points; i++) {
+		points[i] = new_dwml(opts, error);
+		if (points[i] == NULL)
+			break;
+		parse_head(points[i], root_element);
+		if (parse_data(points[i], data, i, error) != 0)
+			break;
+	}
+
+	/* one bad layout spoils every point, they share it */
+	if (i < *n_points) {
+		for (i = 0; i < *n_points; i++)
+			dwml_free(points[i]);
+		free(points);
+		points = NULL;
+		*n_points = 0;
+	}
+
+done:
+	xmlFreeDoc(doc);
+
+	return points;
+}
+
+/* not well formed document, libxml messages end with newline */
+static void
+set_xml_error(struct dwml_error *error, xmlParserCtxtPtr ctxt, const char *name)
+{
+	size_t n;
+
+	set_error(error, DWML_ERR_XML, "%s:%d: %s", name, ctxt->lastError.line,
+		  ctxt->lastError.message != NULL ? ctxt->lastError.message : "not well formed");
+
+	if (error != NULL && (n = strlen(error->message)) > 0 && error->message[n - 1] == '\n')
+		error->message[n - 1] = '\0';
+}
+
+/* caller reports errors, libxml does not print them */
+#define PARSE_OPTIONS (XML_PARSE_NOERROR | XML_PARSE_NOWARNING)
+
+static xmlDoc *
+read_memory(const char *data, size_t size, const char *name, struct dwml_error *error)
+{
+	xmlParserCtxtPtr ctxt;
+	xmlDoc *doc;
+
+	if (size > INT_MAX) {
+		set_error(error, DWML_ERR_IO, "%s is too large", name);
+		return NULL;
+	}
+
+	ctxt = xmlNewParserCtxt();
+	if (ctxt == NULL) {
+		set_error(error, DWML_ERR_IO, "cannot create parser for %s", name);
+		return NULL;
+	}
+
+	doc = xmlCtxtReadMemory(ctxt, data, size, name, NULL, PARSE_OPTIONS);
+	if (doc == NULL)
+		set_xml_error(error, ctxt, name);
+
+	xmlFreeParserCtxt(ctxt);
+
+	return doc;
+}
+
+struct dwml *
+dwml_parse_memory(const char *data, size_t size, const struct dwml_opts *opts, struct dwml_error *error)
+{
+	xmlDoc *doc;
+
+	if (error != NULL)
+		memset(error, 0, sizeof(struct dwml_error));
+
+	doc = read_memory(data, size, "document", error);
+	if (doc == NULL)
+		return NULL;
+
+	return load_doc(doc, opts, error);
+}
+
+/* stream gzip file through push parser, without temporary file; closes fd */
+static xmlDoc *
+read_gz(int fd, const char *fname, struct dwml_error *error)
+{
+	char chunk[16384];
+	xmlParserCtxtPtr ctxt;
+	xmlDoc *doc = NULL;
+	gzFile f;
+	int n;
+
+	f = gzdopen(fd, "rb");
+	if (f == NULL) {
+		set_error(error, DWML_ERR_IO, "cannot open %s: %s", fname, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	n = gzread(f, chunk, sizeof(chunk));
+	if (n < 0) {
+		set_error(error, DWML_ERR_IO, "cannot read %s", fname);
+		goto done;
+	}
+
+	if (n == 0) {
+		set_error(error, DWML_ERR_XML, "%s is empty", fname);
+		goto done;
+	}
+
+	ctxt = xmlCreatePushParserCtxt(NULL, NULL, chunk, n, fname);
+	if (ctxt == NULL) {
+		set_error(error, DWML_ERR_IO, "cannot create parser for %s", fname);
+		goto done;
+	}
+
+	xmlCtxtUseOptions(ctxt, PARSE_OPTIONS);
+
+	/* stop feeding at first error, rest of document is not needed */
+	while (ctxt->wellFormed && (n = gzread(f, chunk, sizeof(chunk))) > 0)
+		xmlParseChunk(ctxt, chunk, n, 0);
+
+	if (n < 0)
+		set_error(error, DWML_ERR_IO, "cannot read %s", fname);
+	else if (ctxt->wellFormed)
+		xmlParseChunk(ctxt, NULL, 0, 1);
+
+	doc = ctxt->myDoc;
+	if (!ctxt->wellFormed || n < 0) {
+		set_xml_error(error, ctxt, fname);
+		xmlFreeDoc(doc);
+		doc = NULL;
+	}
+
+	xmlFreeParserCtxt(ctxt);
+done:
+	gzclose(f);
+
+	return doc;
+}
+
+/*
+ * Plain files, e.g. -f archives, are mapped and parsed in place: no read
+ * syscalls and no copies through stdio or zlib buffers. Cache files are
+ * gzip and go through the stream reader.
+ */
+static xmlDoc *
+read_file(const char *fname, struct dwml_error *error)
+{
+	struct stat st;
+	unsigned char *data;
+	xmlDoc *doc;
+	int fd;
+
+	if (error != NULL)
+		memset(error, 0, sizeof(struct dwml_error));
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		set_error(error, DWML_ERR_IO, "cannot open %s: %s", fname, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+
+	/* pipes and the like have no size to map */
+	if (!S_ISREG(st.st_mode) || st.st_size > INT_MAX)
+		return read_gz(fd, fname, error);
+
+	if (st.st_size == 0) {
+		set_error(error, DWML_ERR_XML, "%s is empty", fname);
+		close(fd);
+		return NULL;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		return read_gz(fd, fname, error);
+
+	if (st.st_size >= 2 && data[0] == 0x1f && data[1] == 0x8b) {
+		munmap(data, st.st_size);
+		return read_gz(fd, fname, error);
+	}
+
+	/* parser reads front to back once, let kernel read ahead and drop behind */
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+	doc = read_memory((const char *)data, st.st_size, fname, error);
+
+	munmap(data, st.st_size);
+	close(fd);
+
+	return doc;
+}
+
+struct dwml *
+dwml_parse_file(const char *fname, const struct dwml_opts *opts, struct dwml_error *error)
+{
+	xmlDoc *doc = read_file(fname, error);
+	if (doc == NULL)
+		return NULL;
+
+	return load_doc(doc, opts, error);
+}
+
+struct dwml **
+dwml_parse_file_points(const char *fname, const struct dwml_opts *opts, size_t *n_points,
+		       struct dwml_error *error)
+{
+	xmlDoc *doc = read_file(fname, error);
+	if (doc == NULL) {
+		*n_points = 0;
+		return NULL;
+	}
+
+	return load_doc_points(doc, opts, n_points, error);
+}
+
+int *
+dwml_column(struct row *r, enum column col, bool **has_value)
+{
+	switch (col) {
+	case COLUMN_TEMP_HOURLY:   *has_value = &r->temp_hourly.has_value;   return &r->temp_hourly.celcius;
+	case COLUMN_TEMP_APPARENT: *has_value = &r->temp_apparent.has_value; return &r->temp_apparent.celcius;
+	case COLUMN_TEMP_MIN:      *has_value = &r->temp_min.has_value;      return &r->temp_min.celcius;
+	case COLUMN_TEMP_MAX:      *has_value = &r->temp_max.has_value;      return &r->temp_max.celcius;
+	case COLUMN_HUMIDITY:      *has_value = &r->humidity.has_value;      return &r->humidity.percent;
+	case COLUMN_CLOUD_AMOUNT:  *has_value = &r->cloud_amount.has_value;  return &r->cloud_amount.percent;
+	case COLUMN_WIND_SPEED:    *has_value = &r->wind_speed.has_value;    return &r->wind_speed.mps;
+	case COLUMN_WIND_DIR:      *has_value = &r->wind_dir.has_value;      return &r->wind_dir.degrees;
+	default:                   *has_value = &r->snow_amount.has_value;   return &r->snow_amount.centimeters;
+	}
+}
+
+void
+dwml_free(struct dwml *dwml)
+{
+	size_t i;
+
+	if (dwml == NULL)
+		return;
+
+	for (i = 0; i < dwml->n_layouts; i++)
+		free_layout(dwml->time_layouts[i]);
+
+	for (i = 0; i < dwml->n_rows; i++)
+		free(dwml->rows[i].weather);
+
+	free(dwml->rows);
+	free(dwml->hazards);
+	free(dwml->time_layouts);
+	free(dwml);
+}
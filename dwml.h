@@ -0,0 +1,309 @@
+/**
+ * Serge Voilokov, 2015.
+ * libdwml: NOAA DWML forecast model, parser and formatters.
+ */
+
+#ifndef DWML_H
+#define DWML_H
+
+#include "tz.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* output buffer of formatters, from common/struct.h */
+struct buf;
+
+/* ===== data structures ===================== */
+
+struct time_interval
+{
+	time_t start_valid_time;
+	time_t end_valid_time;
+};
+
+struct time_layout
+{
+	char *key;          /* example k-p24h-n7-1, k-p3h-n37-3 */
+	int period;         /* total time period of layout */
+	int seq_number;     /* sequence number of layout */
+	int count;          /* number of intervals */
+	struct time_interval *intervals;
+	int *rows;          /* row index for each interval, -1 if outside of horizon */
+};
+
+/* forecast display row */
+
+enum temperature_type
+{
+	TEMPERATURE_HOURLY,
+	TEMPERATURE_MAXIMUM,
+	TEMPERATURE_MINIMUM,
+	TEMPERATURE_APPARENT,
+	TEMPERATURE_ENUM_MAX
+};
+
+struct temperature
+{
+	int celcius;
+	bool has_value;
+};
+
+struct humidity
+{
+	int percent;
+	bool has_value;
+};
+
+struct wind_speed
+{
+	int mps;
+	bool has_value;
+};
+
+struct wind_direction
+{
+	int degrees;
+	bool has_value;
+};
+
+struct cloud_amount
+{
+	int percent;
+	bool has_value;
+};
+
+struct snow_amount
+{
+	int centimeters;
+	bool has_value;
+};
+
+struct row
+{
+	time_t time;                         /* rounded to the start of the hour */
+	struct temperature temp_hourly;
+	struct temperature temp_max;
+	struct temperature temp_min;
+	struct temperature temp_apparent;
+	struct humidity humidity;
+	struct wind_speed wind_speed;
+	struct wind_direction wind_dir;
+	struct cloud_amount cloud_amount;
+	struct snow_amount snow_amount;
+	char *weather;
+};
+
+/* watch, warning or advisory in effect over time range, from wwa element */
+struct hazard
+{
+	char code[8];               /* phenomena.significance code, e.g. WS.W */
+	char phenomena[32];         /* Winter Storm */
+	char significance[16];      /* Watch, Warning, Advisory, Statement */
+	time_t start;
+	time_t end;
+};
+
+/* numeric row columns for generic access, see dwml_column */
+enum column
+{
+	COLUMN_TEMP_HOURLY,
+	COLUMN_TEMP_APPARENT,
+	COLUMN_TEMP_MIN,
+	COLUMN_TEMP_MAX,
+	COLUMN_HUMIDITY,
+	COLUMN_CLOUD_AMOUNT,
+	COLUMN_WIND_SPEED,
+	COLUMN_WIND_DIR,
+	COLUMN_SNOW_AMOUNT,
+	COLUMN_ENUM_MAX
+};
+
+/* parameter blocks to decode, bit per numeric column and one for weather */
+#define DWML_FIELD(col) (1u << (col))
+#define DWML_FIELD_WEATHER (1u << COLUMN_ENUM_MAX)
+#define DWML_FIELD_HAZARDS (1u << (COLUMN_ENUM_MAX + 1))
+#define DWML_FIELDS_ALL (DWML_FIELD_HAZARDS | (DWML_FIELD_HAZARDS - 1))
+
+/* fields read by each output */
+#define DWML_FIELDS_TEXT DWML_FIELDS_ALL
+#define DWML_FIELDS_HTML (DWML_FIELDS_ALL & ~DWML_FIELD(COLUMN_TEMP_HOURLY))
+/* maximum temperature brings 24 hour layout for day buckets */
+#define DWML_FIELDS_DIGEST (DWML_FIELD(COLUMN_TEMP_HOURLY) | DWML_FIELD(COLUMN_TEMP_MAX) | \
+			    DWML_FIELD(COLUMN_WIND_SPEED) | DWML_FIELD(COLUMN_SNOW_AMOUNT))
+
+/* imperial rows hold fahrenheit, miles per hour and tenths of inch of snow */
+enum units
+{
+	UNITS_METRIC,
+	UNITS_IMPERIAL
+};
+
+enum legend_position {
+	LEGEND_TOP,   /* useful for terminals */
+	LEGEND_BOTTOM /* useful for emails */
+};
+
+#define DWML_DEFAULT_HORIZON (24 * 7)
+
+struct dwml_opts
+{
+	time_t base_time;   /* rows start at this hour, 0 means now */
+	int horizon;        /* hours after base_time to keep, 0 keeps everything */
+	const struct tz *tz; /* zone of the forecast point, NULL guesses it from document */
+	unsigned fields;    /* DWML_FIELD bits to decode, 0 decodes all */
+};
+
+struct dwml
+{
+	time_t creation_date;               /* NOAA response generating time */
+	time_t base_time;                   /* time from which rows data are calculated */
+	time_t horizon;                     /* seconds after base_time covered by rows, 0 is unlimited */
+	time_t refresh_frequency;           /* period from creation_date when next fetch makes sence */
+	const struct tz *tz;                /* rows are rendered in this zone */
+	enum units units;                   /* units of row values */
+	unsigned fields;                    /* decoded parameter blocks, others have no values */
+	size_t n_layouts;                   /* number of time layouts */
+	struct time_layout **time_layouts;  /* array of pointers to time layouts */
+	const struct time_layout *max_temp_layout; /* daytime maximum temperature, digest days */
+	size_t n_rows;                      /* number of rows */
+	struct row *rows;                   /* one row per distinct start time, sorted by time */
+	size_t n_hazards;
+	struct hazard *hazards;             /* by start time, whole document horizon */
+};
+
+/* ===== parsing ===================== */
+
+enum dwml_status
+{
+	DWML_OK,
+	DWML_ERR_IO,        /* cannot open or read file */
+	DWML_ERR_XML,       /* not well formed xml */
+	DWML_ERR_FORMAT,    /* well formed, but not a usable dwml document */
+	DWML_ERR_NOMEM      /* document needs more memory than there is */
+};
+
+/* first problem found in document */
+struct dwml_error
+{
+	enum dwml_status status;
+	char message[256];
+};
+
+/*
+ * Parsers return NULL for a malformed document and describe it in error,
+ * which may be NULL, instead of exiting, so batch runs can skip it.
+ */
+
+/* parse DWML document from memory; NULL opts means from now for DWML_DEFAULT_HORIZON hours */
+struct dwml *dwml_parse_memory(const char *data, size_t size, const struct dwml_opts *opts,
+			       struct dwml_error *error);
+
+/* parse DWML file, plain or gzip; plain regular files are mmapped */
+struct dwml *dwml_parse_file(const char *fname, const struct dwml_opts *opts, struct dwml_error *error);
+
+/*
+ * Parse each forecast point of multi point document separately,
+ * in order of <parameters> blocks. Returns array of n_points forecasts.
+ */
+struct dwml **dwml_parse_file_points(const char *fname, const struct dwml_opts *opts, size_t *n_points,
+				     struct dwml_error *error);
+
+/* name of status for logs */
+const char *dwml_status_name(enum dwml_status status);
+
+/* fixed width text table */
+void dwml_format_text(struct buf *buf, const struct dwml *dwml, enum legend_position legend_pos);
+
+/* html table for emails and weatherui */
+void dwml_format_html(struct buf *buf, const struct dwml *dwml);
+
+/* ===== column kernels ===================== */
+
+struct column_stats
+{
+	int32_t min;
+	int32_t max;
+	int64_t sum;
+	size_t count;       /* values present */
+};
+
+/* forecast day summary */
+struct day_summary
+{
+	time_t start;               /* day bucket from max temperature layout */
+	time_t end;
+	struct column_stats temp;   /* hourly temperature */
+	struct column_stats wind;   /* wind speed */
+	struct column_stats snow;   /* snow amount */
+};
+
+/* copy column of all rows into contiguous arrays of n_rows elements */
+void dwml_column_values(const struct dwml *dwml, enum column col, int32_t *value, uint8_t *has_value);
+
+/* min, max, sum of present values */
+void dwml_column_stats(const int32_t *value, const uint8_t *has_value, size_t n, struct column_stats *st);
+
+/* convert metric values of column to units */
+void dwml_column_convert(int32_t *value, size_t n, enum column col, enum units units);
+
+/* convert row values in place, only metric to imperial is supported; -1 with errno on error */
+int dwml_set_units(struct dwml *dwml, enum units units);
+
+/* summary per forecast day, returns number of days in malloced *days, -1 if out of memory */
+long dwml_daily_summary(const struct dwml *dwml, struct day_summary **days);
+
+/* daily digest: min, max, mean temperature, max wind, total snow */
+void dwml_format_digest_text(struct buf *buf, const struct dwml *dwml);
+void dwml_format_digest_html(struct buf *buf, const struct dwml *dwml);
+
+/* ===== machine readable outputs ===================== */
+
+/* json object with one row object per line, missing values left out */
+void dwml_format_json(struct buf *buf, const struct dwml *dwml);
+
+/* header line, one line per row, empty cells for missing values */
+void dwml_format_csv(struct buf *buf, const struct dwml *dwml);
+
+#define DWML_BIN_MAGIC "WXBIN01"
+#define DWML_BIN_VERSION 1
+
+/*
+ * Fixed schema binary forecast: header followed by n_rows records, host
+ * byte order. Values are in units of the header, imperial snow in tenths
+ * of inch, so a consumer can mmap the file and index rows directly.
+ */
+struct dwml_bin_header
+{
+	char magic[8];              /* DWML_BIN_MAGIC */
+	uint32_t version;
+	uint32_t record_size;       /* sizeof(struct dwml_bin_row) */
+	int64_t creation_date;
+	int64_t base_time;
+	uint32_t units;             /* enum units */
+	uint32_t fields;            /* decoded DWML_FIELD bits */
+	uint64_t n_rows;
+	char tz[80];                /* zone name, e.g. America/New_York */
+};
+
+struct dwml_bin_row
+{
+	int64_t time;
+	int32_t value[COLUMN_ENUM_MAX]; /* by enum column */
+	uint32_t has_value;         /* DWML_FIELD bits of present values and weather */
+	char weather[80];           /* truncated, zero terminated */
+};
+
+void dwml_format_bin(struct buf *buf, const struct dwml *dwml);
+
+/* check header of mapped binary forecast; 0 and pointers into data if valid */
+int dwml_bin_map(const void *data, size_t size, const struct dwml_bin_header **header,
+		 const struct dwml_bin_row **rows);
+
+/* value of numeric column in row, has_value points to its flag */
+int *dwml_column(struct row *row, enum column col, bool **has_value);
+
+void dwml_free(struct dwml *dwml);
+
+#endif /* DWML_H */
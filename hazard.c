@@ -0,0 +1,241 @@
+/**
+ * Serge Voilokov, 2015.
+ * Index of hazards by zip for out of schedule alerts.
+ *
+ * One small file of records sorted by zip and start time, updated by every
+ * delivery run from the wwa element of forecasts it has fetched anyway, so
+ * the scheduler lists zips under a warning without another request.
+ * Updates from threads and processes are serialized by flock of a lock file
+ * opened per update, readers see whole files replaced by rename.
+ */
+
+#include "hazard.h"
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+struct index_header
+{
+	char magic[8];
+	uint64_t count;
+};
+
+static int
+cmp_records(const void *a, const void *b)
+{
+	const struct hazard_record *x = a, *y = b;
+
+	if (x->zip != y->zip)
+		return x->zip < y->zip ? -1 : 1;
+	if (x->start != y->start)
+		return x->start < y->start ? -1 : 1;
+
+	return strncmp(x->code, y->code, sizeof(x->code));
+}
+
+/* records of index, NULL with zero count if there is none or it is corrupted */
+static struct hazard_record *
+read_index(const char *path, size_t *count)
+{
+	struct index_header h;
+	struct hazard_record *records = NULL;
+	struct stat sb;
+	FILE *f;
+
+	*count = 0;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		return NULL;
+
+	if (fstat(fileno(f), &sb) != 0 || fread(&h, sizeof(h), 1, f) != 1 ||
+	    memcmp(h.magic, HAZARD_MAGIC, sizeof(HAZARD_MAGIC)) != 0) {
+		warnx("%s is not a hazard index", path);
+		goto done;
+	}
+
+	/* count is checked against file size before it sizes an allocation */
+	if (h.count != (sb.st_size - sizeof(h)) / sizeof(struct hazard_record)) {
+		warnx("%s is corrupted, %llu records in header", path, (unsigned long long)h.count);
+		goto done;
+	}
+
+	records = malloc(h.count * sizeof(struct hazard_record) + 1);
+	if (records == NULL) {
+		warn("cannot allocate hazard index");
+		goto done;
+	}
+
+	if (fread(records, sizeof(struct hazard_record), h.count, f) != h.count) {
+		warn("cannot read %s", path);
+		free(records);
+		records = NULL;
+	} else {
+		*count = h.count;
+	}
+
+done:
+	fclose(f);
+
+	return records;
+}
+
+static int
+write_index(const char *path, const struct hazard_record *records, size_t count)
+{
+	char tmp[PATH_MAX];
+	struct index_header h;
+	bool ok;
+	FILE *f;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, HAZARD_MAGIC, sizeof(HAZARD_MAGIC));
+	h.count = count;
+
+	if (snprintf(tmp, PATH_MAX, "%s.%d.tmp", path, getpid()) >= PATH_MAX) {
+		warnx("%s: path is too long", path);
+		return -1;
+	}
+
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		warn("cannot create %s", tmp);
+		return -1;
+	}
+
+	ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+	     fwrite(records, sizeof(struct hazard_record), count, f) == count;
+	if (fclose(f) != 0 || !ok) {
+		warn("cannot write %s", tmp);
+		unlink(tmp);
+		return -1;
+	}
+
+	if (rename(tmp, path) != 0) {
+		warn("cannot rename %s to %s", tmp, path);
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+hazard_update(const char *dir, int zip, const struct dwml *dwml)
+{
+	char path[PATH_MAX], lock_path[PATH_MAX];
+	struct hazard_record *old, *records, *r;
+	size_t n_old, n = 0, n_new = 0, i, first = SIZE_MAX, n_zip = 0;
+	time_t now = time(NULL);
+	bool changed;
+	int fd, res = -1;
+
+	if (snprintf(path, PATH_MAX, "%s/%s", dir, HAZARD_INDEX) >= PATH_MAX ||
+	    snprintf(lock_path, PATH_MAX, "%s/%s.lock", dir, HAZARD_INDEX) >= PATH_MAX) {
+		warnx("%s: path is too long", dir);
+		return -1;
+	}
+
+	fd = open(lock_path, O_RDWR | O_CREAT, 0644);
+	if (fd == -1) {
+		warn("cannot open %s", lock_path);
+		return -1;
+	}
+	if (flock(fd, LOCK_EX) != 0) {
+		warn("cannot lock %s", lock_path);
+		close(fd);
+		return -1;
+	}
+
+	old = read_index(path, &n_old);
+
+	records = malloc((n_old + dwml->n_hazards) * sizeof(struct hazard_record) + 1);
+	if (records == NULL) {
+		warn("cannot allocate hazard index");
+		goto done;
+	}
+
+	/* other zips keep their hazards until they expire */
+	changed = old == NULL;
+	for (i = 0; i < n_old; i++) {
+		if (old[i].zip == (uint32_t)zip) {
+			if (first == SIZE_MAX)
+				first = i;
+			n_zip++;
+		} else if (old[i].end <= now) {
+			changed = true;
+		} else {
+			records[n++] = old[i];
+		}
+	}
+
+	for (i = 0; i < dwml->n_hazards; i++) {
+		if (dwml->hazards[i].end <= now)
+			continue;
+		r = &records[n + n_new++];
+		memset(r, 0, sizeof(*r));
+		r->zip = zip;
+		memcpy(r->code, dwml->hazards[i].code, sizeof(r->code));
+		memcpy(r->phenomena, dwml->hazards[i].phenomena, sizeof(r->phenomena));
+		memcpy(r->significance, dwml->hazards[i].significance, sizeof(r->significance));
+		r->start = dwml->hazards[i].start;
+		r->end = dwml->hazards[i].end;
+		r->issued = dwml->creation_date;
+	}
+
+	qsort(records + n, n_new, sizeof(struct hazard_record), cmp_records);
+
+	/* same hazards as before, only issue time differs */
+	if (!changed && n_zip == n_new) {
+		for (i = 0; i < n_new; i++)
+			if (cmp_records(&old[first + i], &records[n + i]) != 0 ||
+			    old[first + i].end != records[n + i].end)
+				break;
+		changed = i < n_new;
+	} else {
+		changed = true;
+	}
+
+	res = 0;
+	if (changed) {
+		n += n_new;
+		qsort(records, n, sizeof(struct hazard_record), cmp_records);
+		res = write_index(path, records, n);
+	}
+
+done:
+	flock(fd, LOCK_UN);
+	close(fd);
+	free(records);
+	free(old);
+
+	return res;
+}
+
+int
+hazard_query(const char *dir, time_t from, time_t to, hazard_cb cb, void *arg)
+{
+	char path[PATH_MAX];
+	struct hazard_record *records;
+	size_t n, i;
+
+	snprintf(path, PATH_MAX, "%s/%s", dir, HAZARD_INDEX);
+
+	records = read_index(path, &n);
+	if (records == NULL)
+		return -1;
+
+	for (i = 0; i < n; i++)
+		if (records[i].start < to && records[i].end > from)
+			cb(&records[i], arg);
+
+	free(records);
+
+	return 0;
+}
@@ -0,0 +1,40 @@
+/**
+ * Serge Voilokov, 2015.
+ * Index of hazards by zip for out of schedule alerts.
+ */
+
+#ifndef HAZARD_H
+#define HAZARD_H
+
+#include "dwml.h"
+#include <stdint.h>
+#include <time.h>
+
+#define HAZARD_INDEX "hazards.idx"
+#define HAZARD_MAGIC "WXHZD1"
+
+struct hazard_record
+{
+	uint32_t zip;
+	uint32_t reserved;
+	char code[8];
+	char phenomena[32];
+	char significance[16];
+	int64_t start;
+	int64_t end;
+	int64_t issued;             /* creation date of forecast it came from */
+};
+
+typedef void (*hazard_cb)(const struct hazard_record *r, void *arg);
+
+/*
+ * Replace hazards of zip in dir/hazards.idx with those of its forecast and
+ * drop expired ones. The file is rewritten only when something changed,
+ * so zips without hazards cost one read under lock. Returns -1 on error.
+ */
+int hazard_update(const char *dir, int zip, const struct dwml *dwml);
+
+/* hazards in effect at some time in [from, to), in zip order; -1 if there is no index */
+int hazard_query(const char *dir, time_t from, time_t to, hazard_cb cb, void *arg);
+
+#endif /* HAZARD_H */
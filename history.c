@@ -0,0 +1,488 @@
+/**
+ * Serge Voilokov, 2015.
+ * Append-only forecast history store.
+ *
+ * zip-NNNNN.wxh holds encoded forecasts back to back, zip-NNNNN.wxi holds
+ * fixed size index records with issue time, offset and size of each one.
+ * A forecast record is:
+ *
+ *   varint n_rows
+ *   for each row:
+ *     zigzag varint  time delta from previous row (first row: from issue time)
+ *     varint         presence bits, one per column, bit 9 is weather
+ *     zigzag varint  for each present numeric column: delta from the value
+ *                    at the same time in the previous issuance, or from the
+ *                    previous value of the column in this record
+ *     varint         if weather is present: 0 when it equals previous
+ *                    issuance, else length + 1 followed by text
+ *
+ * Keyframes do not reference previous issuance, so a query decodes at most
+ * HISTORY_KEYFRAME records before the first one it returns.
+ */
+
+#include "history.h"
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#define WEATHER_BIT (1 << COLUMN_ENUM_MAX)
+
+struct index_record
+{
+	int64_t issued;
+	uint64_t offset;
+	uint32_t size;
+	uint32_t keyframe;
+};
+
+struct encoder
+{
+	uint8_t *p;
+	size_t len;
+	size_t cap;
+};
+
+struct decoder
+{
+	const uint8_t *p;
+	const uint8_t *end;
+	bool error;
+};
+
+/* ===== rows ====================== */
+
+static const struct row *
+find_row(const struct history_forecast *f, time_t t)
+{
+	size_t lo = 0, hi, mid;
+
+	if (f == NULL)
+		return NULL;
+
+	hi = f->n_rows;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (f->rows[mid].time < t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo < f->n_rows && f->rows[lo].time == t ? &f->rows[lo] : NULL;
+}
+
+/* reference for delta: same time in previous issuance or previous value in this record */
+static int
+reference(const struct row *prev_row, int c, int last)
+{
+	int *value;
+	bool *has_value;
+
+	if (prev_row == NULL)
+		return last;
+
+	value = dwml_column((struct row *)prev_row, c, &has_value);
+
+	return *has_value ? *value : last;
+}
+
+/* ===== varints ===================== */
+
+static void
+put_byte(struct encoder *e, uint8_t b)
+{
+	if (e->len == e->cap) {
+		e->cap = e->cap == 0 ? 1024 : e->cap * 2;
+		e->p = realloc(e->p, e->cap);
+		if (e->p == NULL)
+			err(1, "cannot allocate history buffer");
+	}
+
+	e->p[e->len++] = b;
+}
+
+static void
+put_varint(struct encoder *e, uint64_t v)
+{
+	while (v >= 0x80) {
+		put_byte(e, v | 0x80);
+		v >>= 7;
+	}
+	put_byte(e, v);
+}
+
+static void
+put_zigzag(struct encoder *e, int64_t v)
+{
+	put_varint(e, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+static uint64_t
+get_varint(struct decoder *d)
+{
+	uint64_t v = 0;
+	int shift = 0;
+
+	while (d->p < d->end && shift < 64) {
+		v |= (uint64_t)(*d->p & 0x7f) << shift;
+		if ((*d->p++ & 0x80) == 0)
+			return v;
+		shift += 7;
+	}
+
+	d->error = true;
+
+	return 0;
+}
+
+static int64_t
+get_zigzag(struct decoder *d)
+{
+	uint64_t v = get_varint(d);
+
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/* ===== records ===================== */
+
+static void
+encode(struct encoder *e, const struct dwml *dwml, time_t issued, const struct history_forecast *prev)
+{
+	size_t i;
+	int c, *value, last[COLUMN_ENUM_MAX] = { 0 };
+	bool *has_value;
+	unsigned mask;
+	time_t prev_time = issued;
+	const struct row *prev_row;
+	struct row *r;
+
+	put_varint(e, dwml->n_rows);
+
+	for (i = 0; i < dwml->n_rows; i++) {
+		r = &dwml->rows[i];
+		prev_row = find_row(prev, r->time);
+
+		put_zigzag(e, r->time - prev_time);
+		prev_time = r->time;
+
+		mask = 0;
+		for (c = 0; c < COLUMN_ENUM_MAX; c++) {
+			value = dwml_column(r, c, &has_value);
+			if (*has_value)
+				mask |= 1 << c;
+		}
+		if (r->weather != NULL)
+			mask |= WEATHER_BIT;
+
+		put_varint(e, mask);
+
+		for (c = 0; c < COLUMN_ENUM_MAX; c++) {
+			value = dwml_column(r, c, &has_value);
+			if (!*has_value)
+				continue;
+			put_zigzag(e, (int64_t)*value - reference(prev_row, c, last[c]));
+			last[c] = *value;
+		}
+
+		if (r->weather != NULL) {
+			if (prev_row != NULL && prev_row->weather != NULL && strcmp(prev_row->weather, r->weather) == 0) {
+				put_varint(e, 0);
+			} else {
+				const char *w = r->weather;
+				put_varint(e, strlen(w) + 1);
+				while (*w != 0)
+					put_byte(e, *w++);
+			}
+		}
+	}
+}
+
+static void
+free_forecast(struct history_forecast *f)
+{
+	size_t i;
+
+	for (i = 0; i < f->n_rows; i++)
+		free(f->rows[i].weather);
+	free(f->rows);
+	f->n_rows = 0;
+	f->rows = NULL;
+}
+
+static int
+decode(struct history_forecast *f, const uint8_t *data, size_t size, const struct history_forecast *prev)
+{
+	struct decoder d = { data, data + size, false };
+	size_t i, n;
+	int c, *value, last[COLUMN_ENUM_MAX] = { 0 };
+	bool *has_value;
+	unsigned mask;
+	time_t prev_time = f->issued;
+	const struct row *prev_row;
+	struct row *r;
+
+	n = get_varint(&d);
+	if (d.error || n > size)
+		return -1;
+
+	f->n_rows = n;
+	f->rows = calloc(n, sizeof(struct row));
+	if (f->rows == NULL && n > 0)
+		err(1, "cannot allocate history rows");
+
+	for (i = 0; i < n && !d.error; i++) {
+		r = &f->rows[i];
+		r->time = prev_time + get_zigzag(&d);
+		prev_time = r->time;
+		prev_row = find_row(prev, r->time);
+
+		mask = get_varint(&d);
+
+		for (c = 0; c < COLUMN_ENUM_MAX; c++) {
+			if ((mask & (1 << c)) == 0)
+				continue;
+			value = dwml_column(r, c, &has_value);
+			*value = reference(prev_row, c, last[c]) + get_zigzag(&d);
+			*has_value = true;
+			last[c] = *value;
+		}
+
+		if (mask & WEATHER_BIT) {
+			size_t len = get_varint(&d);
+
+			if (len == 0) {
+				if (prev_row == NULL || prev_row->weather == NULL)
+					d.error = true;
+				else
+					r->weather = strdup(prev_row->weather);
+			} else if (len - 1 > (size_t)(d.end - d.p)) {
+				d.error = true;
+			} else {
+				r->weather = strndup((const char *)d.p, len - 1);
+				d.p += len - 1;
+			}
+		}
+	}
+
+	if (d.error) {
+		free_forecast(f);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* ===== files ======================= */
+
+static int
+open_files(const char *dir, int zip, int flags, int *index_fd, int *data_fd)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, PATH_MAX, "%s/zip-%05d.wxi", dir, zip);
+	*index_fd = open(path, flags, 0644);
+	if (*index_fd == -1)
+		return -1;
+
+	snprintf(path, PATH_MAX, "%s/zip-%05d.wxh", dir, zip);
+	*data_fd = open(path, flags, 0644);
+	if (*data_fd == -1) {
+		close(*index_fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* NULL with a warning if index cannot be read */
+static struct index_record *
+read_index(int fd, int zip, size_t *n)
+{
+	struct stat st;
+	struct index_record *idx;
+
+	if (fstat(fd, &st) != 0) {
+		warn("cannot stat history index for zip %05d", zip);
+		return NULL;
+	}
+
+	/* size comes from the file, a broken one must not stop the run */
+	*n = st.st_size / sizeof(struct index_record);
+	idx = malloc(*n * sizeof(struct index_record) + 1);
+	if (idx == NULL) {
+		warn("cannot allocate history index for zip %05d", zip);
+		return NULL;
+	}
+
+	if (pread(fd, idx, *n * sizeof(struct index_record), 0) != (ssize_t)(*n * sizeof(struct index_record))) {
+		warn("cannot read history index for zip %05d", zip);
+		free(idx);
+		return NULL;
+	}
+
+	return idx;
+}
+
+/*
+ * Decode records from the keyframe preceding first up to last, calling cb
+ * for those issued in [from, to]. Last decoded forecast is left in prev.
+ */
+static long
+replay(int data_fd, const struct index_record *idx, size_t first, size_t last,
+       time_t from, time_t to, history_cb cb, void *arg, struct history_forecast *prev)
+{
+	struct history_forecast cur;
+	uint8_t *data = NULL;
+	size_t i, cap = 0;
+	long count = 0;
+
+	while (first > 0 && !idx[first].keyframe)
+		first--;
+
+	for (i = first; i <= last; i++) {
+		if (idx[i].size > cap) {
+			cap = idx[i].size;
+			data = realloc(data, cap);
+			if (data == NULL)
+				err(1, "cannot allocate history record");
+		}
+
+		if (pread(data_fd, data, idx[i].size, idx[i].offset) != (ssize_t)idx[i].size) {
+			warnx("history record %zu is truncated", i);
+			count = -1;
+			break;
+		}
+
+		cur.issued = idx[i].issued;
+		if (decode(&cur, data, idx[i].size, idx[i].keyframe ? NULL : prev) != 0) {
+			warnx("history record %zu is corrupted", i);
+			count = -1;
+			break;
+		}
+
+		if (cb != NULL && cur.issued >= from && cur.issued <= to) {
+			cb(&cur, arg);
+			count++;
+		}
+
+		free_forecast(prev);
+		*prev = cur;
+	}
+
+	free(data);
+
+	return count;
+}
+
+long
+history_append(const char *dir, int zip, const struct dwml *dwml)
+{
+	int index_fd, data_fd;
+	struct index_record *idx, rec;
+	struct history_forecast prev = { 0, 0, NULL };
+	struct encoder e = { NULL, 0, 0 };
+	size_t n;
+	off_t offset;
+	long ret = -1;
+
+	if (open_files(dir, zip, O_RDWR | O_CREAT, &index_fd, &data_fd) != 0) {
+		warn("cannot open history for zip %05d in %s", zip, dir);
+		return -1;
+	}
+
+	if (flock(index_fd, LOCK_EX) != 0) {
+		warn("cannot lock history for zip %05d", zip);
+		close(index_fd);
+		close(data_fd);
+		return -1;
+	}
+
+	idx = read_index(index_fd, zip, &n);
+	if (idx == NULL) {
+		flock(index_fd, LOCK_UN);
+		close(index_fd);
+		close(data_fd);
+		return -1;
+	}
+
+	rec.issued = dwml->creation_date != 0 ? dwml->creation_date : time(NULL);
+	rec.keyframe = n % HISTORY_KEYFRAME == 0;
+
+	/* previous issuance could not be decoded, start a new chain */
+	if (!rec.keyframe && replay(data_fd, idx, n - 1, n - 1, 0, 0, NULL, NULL, &prev) != 0)
+		rec.keyframe = true;
+
+	encode(&e, dwml, rec.issued, rec.keyframe ? NULL : &prev);
+
+	offset = lseek(data_fd, 0, SEEK_END);
+	rec.offset = offset;
+	rec.size = e.len;
+
+	if (offset == -1 || pwrite(data_fd, e.p, e.len, offset) != (ssize_t)e.len) {
+		warn("cannot write history for zip %05d", zip);
+	} else if (pwrite(index_fd, &rec, sizeof(rec), n * sizeof(rec)) != sizeof(rec)) {
+		warn("cannot write history index for zip %05d", zip);
+	} else {
+		ret = e.len + sizeof(rec);
+	}
+
+	flock(index_fd, LOCK_UN);
+	close(index_fd);
+	close(data_fd);
+	free_forecast(&prev);
+	free(idx);
+	free(e.p);
+
+	return ret;
+}
+
+long
+history_query(const char *dir, int zip, time_t from, time_t to, history_cb cb, void *arg)
+{
+	int index_fd, data_fd;
+	struct index_record *idx;
+	struct history_forecast prev = { 0, 0, NULL };
+	size_t n, first, last;
+	long count = 0;
+
+	if (open_files(dir, zip, O_RDONLY, &index_fd, &data_fd) != 0)
+		return 0;
+
+	if (flock(index_fd, LOCK_SH) != 0) {
+		warn("cannot lock history for zip %05d", zip);
+		close(index_fd);
+		close(data_fd);
+		return -1;
+	}
+
+	idx = read_index(index_fd, zip, &n);
+	if (idx == NULL) {
+		flock(index_fd, LOCK_UN);
+		close(index_fd);
+		close(data_fd);
+		return -1;
+	}
+
+	for (first = 0; first < n && idx[first].issued < from; first++)
+		;
+	for (last = first; last < n && idx[last].issued <= to; last++)
+		;
+
+	if (last > first)
+		count = replay(data_fd, idx, first, last - 1, from, to, cb, arg, &prev);
+
+	flock(index_fd, LOCK_UN);
+	close(index_fd);
+	close(data_fd);
+	free_forecast(&prev);
+	free(idx);
+
+	return count;
+}
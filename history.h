@@ -0,0 +1,34 @@
+/**
+ * Serge Voilokov, 2015.
+ * Append-only forecast history store, one file pair per zip.
+ */
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "dwml.h"
+
+/* every HISTORY_KEYFRAME-th forecast is encoded without reference to previous one */
+#define HISTORY_KEYFRAME 24
+
+/* decoded forecast issuance */
+struct history_forecast
+{
+	time_t issued;          /* creation_date of forecast */
+	size_t n_rows;
+	struct row *rows;       /* sorted by time */
+};
+
+typedef void (*history_cb)(const struct history_forecast *f, void *arg);
+
+/*
+ * Append forecast to dir/zip-NNNNN.wxh. Values are zigzag varint deltas
+ * against the same valid time of the previous issuance.
+ * Returns number of bytes written or -1 on error.
+ */
+long history_append(const char *dir, int zip, const struct dwml *dwml);
+
+/* call cb for each forecast issued in [from, to], oldest first; returns count or -1 on error */
+long history_query(const char *dir, int zip, time_t from, time_t to, history_cb cb, void *arg);
+
+#endif /* HISTORY_H */
@@ -3,29 +3,114 @@
  * Get forecast from NOAA for specified zip code.
  */
 
+#include "dwml.h"
+#include "cache.h"
+#include "change.h"
+#include "hazard.h"
+#include "history.h"
+#include "trace.h"
+#include "pipeline.h"
+#include "plan.h"
+#include "shmcache.h"
+#include "zipdb.h"
 #include "common/net.h"
-#include "common/xml.h"
 #include "version.h"
 #include <err.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <string.h>
 #include <getopt.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <curl/curl.h>
-
-#define _XOPEN_SOURCE
-#include <time.h>
+#include <libxml/parser.h>
+#include <zlib.h>
 
 static bool debug = false;
 static const char *mail_recipients = false; /* send mail to comma delimited recipients */
 static bool html = false;                   /* output in html format */
-static int zip = 10010;                     /* get weather forecast for zip code */
+static bool digest = false;                 /* daily summary instead of hourly table */
+
+enum output_format
+{
+	FORMAT_TABLE,       /* text or html, see -t */
+	FORMAT_JSON,
+	FORMAT_CSV,
+	FORMAT_BIN
+};
+
+static enum output_format format = FORMAT_TABLE;
+static enum units units = UNITS_METRIC;
+static int zips[PLAN_MAX_POINTS * 10] = { 10010 }; /* get weather forecast for zip codes */
+static size_t n_zips = 1;
+static char zipdb_fname[PATH_MAX];          /* zip to grid point table */
+static const char *zipdb_csv = NULL;        /* build zip table from this csv */
+static struct dwml_opts opts = {            /* forecast window */
+	.horizon = DWML_DEFAULT_HORIZON
+};
 static char fname[PATH_MAX];                /* path to current dwml file */
+static struct cache cache;                  /* fetched dwml files */
+static uint64_t cache_budget = CACHE_DEFAULT_BUDGET;
+static const char *snapshot_dir = NULL;     /* write rendered html table for weatherui */
+static const char *shm_name = NULL;         /* and publish it in shared memory */
+static struct shmcache shm;
+static const char *history_dir = NULL;      /* append forecasts to history store */
+static const char *hazard_dir = NULL;       /* update hazards index for alerts */
+static int alerts_hours = -1;               /* list indexed hazards instead of delivery */
+static enum change_mode change_mode = CHANGE_OFF; /* suppress unchanged reports */
+static struct change_thresholds thresholds;
+static char state_dir[PATH_MAX];            /* last sent forecasts for change detection */
+static const char *schedule = "default";    /* subscriber schedule of this run */
+static bool stats = false;                  /* print stage timings */
+static const char *trace_fname = NULL;      /* append trace events to this file */
+static const char *ndfd_url = NULL;         /* NDFD_URL or local stand-in */
+static char smtp_fname[PATH_MAX];           /* smtp server and credentials */
+static const char *prefetch_fname = NULL;   /* upcoming send times to warm cache for */
+static int lead = 5;                        /* minutes to have prefetch done before send */
+static atomic_size_t failed;                /* requests skipped or stored in part */
+
+enum delivery_stage
+{
+	STAGE_FETCH,
+	STAGE_PARSE,
+	STAGE_RENDER,
+	STAGE_SEND,
+	STAGE_ENUM_MAX
+};
+
+/* workers per stage, 0 is one per cpu */
+static int workers[STAGE_ENUM_MAX] = { 4, 0, 0, 2 };
 
 static struct option longopts[] = {
 	{ "zip",          required_argument, NULL, 'z' },
 	{ "mail",         required_argument, NULL, 'm' },
 	{ "html",         no_argument,       NULL, 't' },
+	{ "digest",       no_argument,       NULL, 'y' },
+	{ "format",       required_argument, NULL, 'F' },
+	{ "units",        required_argument, NULL, 'u' },
 	{ "file",         required_argument, NULL, 'f' },
+	{ "snapshot",     required_argument, NULL, 's' },
+	{ "shm",          required_argument, NULL, 'x' },
+	{ "history",      required_argument, NULL, 'H' },
+	{ "hazards",      required_argument, NULL, 'A' },
+	{ "alerts",       required_argument, NULL, 'a' },
+	{ "days",         required_argument, NULL, 'D' },
+	{ "tz",           required_argument, NULL, 'Z' },
+	{ "zipdb",        required_argument, NULL, 'g' },
+	{ "cache-size",   required_argument, NULL, 'K' },
+	{ "make-zipdb",   required_argument, NULL, 'G' },
+	{ "changes",      required_argument, NULL, 'c' },
+	{ "thresholds",   required_argument, NULL, 'C' },
+	{ "state",        required_argument, NULL, 'W' },
+	{ "schedule",     required_argument, NULL, 'n' },
+	{ "stats",        no_argument,       NULL, 'S' },
+	{ "trace",        required_argument, NULL, 'T' },
+	{ "pipeline",     required_argument, NULL, 'P' },
+	{ "url",          required_argument, NULL, 'U' },
+	{ "smtp",         required_argument, NULL, 'M' },
+	{ "prefetch",     required_argument, NULL, 'p' },
+	{ "lead",         required_argument, NULL, 'L' },
 	{ "debug",        no_argument,       NULL, 'd' },
 	{ "help",         no_argument,       NULL, 'h' },
 	{ "version",      no_argument,       NULL, 'v' },
@@ -35,7 +120,13 @@ static struct option longopts[] = {
 static void
 synopsis()
 {
-	printf("usage: weather [-dmthv] [-z zip] [-m \"email1,email2,..\"]\n");
+	printf("usage: weather [-dmthvy] [-F format] [-z zip,...] [-m \"email1,email2,..\"] [-s dir] [-x shm]\n"
+	       "               [-H dir] [-D days] [-Z zone] [-u units] [-g zipdb] [-K MB] [--stats] [--trace=file]\n"
+	       "               [-c skip|rows] [-C thresholds] [-W dir] [-n schedule]\n"
+	       "               [-P fetch,parse,render,send] [-U url] [-M file]\n"
+	       "       weather -p file|- [-L minutes] [-g zipdb] [-P fetch] [-U url]\n"
+	       "       weather -a hours -A dir\n"
+	       "       weather -G zips.csv [-g zipdb]\n");
 }
 
 static void
@@ -45,730 +136,816 @@ usage()
 
 	printf(
 	       "options:\n"
-	       "    -z, --zip=zipcode      get weather forecast for zipcode\n"
+	       "    -z, --zip=zip,...      get weather forecast for comma separated zipcodes\n"
 	       "    -m, --mail=recipients  send email to recipients\n"
 	       "    -t, --html             output in html format\n"
+	       "    -y, --digest           daily digest: min, max, mean temperature, max wind, total snow\n"
+	       "    -F, --format=format    print json, csv or bin instead of table; json of several\n"
+	       "                           zips is one {\"zip\":...,\"forecast\":...} object per zip,\n"
+	       "                           csv and bin take one zip, bin layout is dwml_bin_header\n"
+	       "    -u, --units=units      metric or imperial, default metric\n"
 	       "    -d, --debug            output debug information\n"
-	       "    -f, --file             input dwml file for debugging\n"
+	       "    -f, --file             input dwml file for debugging, plain or gzip\n"
+	       "    -s, --snapshot=dir     write html table to dir/zip-NNNNN.html for weatherui\n"
+	       "    -x, --shm=name         publish html table and bin forecast of each zip in POSIX\n"
+	       "                           shared memory, e.g. /weather-forecasts, for weatherui;\n"
+	       "                           takes 64 MB, up to 256 MB for runs of over 512 zips\n"
+	       "    -H, --history=dir      append forecast to dir/zip-NNNNN.wxh history store\n"
+	       "    -A, --hazards=dir      keep watches, warnings and advisories of zips in\n"
+	       "                           dir/hazards.idx\n"
+	       "    -a, --alerts=hours     list indexed hazards in effect within hours from now:\n"
+	       "                           zip, code, start, end, significance, phenomena\n"
+	       "    -D, --days=n           forecast horizon in days, default 7, 0 for all data\n"
+	       "    -Z, --tz=zone          render times in zone, e.g. America/Chicago; default is\n"
+	       "                           US zone matching utc offsets of forecast document\n"
+	       "    -g, --zipdb=file       zip to NDFD grid table, default ~/.config/weather/zipdb.bin;\n"
+	       "                           zips in the same grid cell share one fetch\n"
+	       "    -K, --cache-size=MB    keep at most MB of fetched forecasts in ~/.cache/weather,\n"
+	       "                           least recently used are evicted, default 64\n"
+	       "    -G, --make-zipdb=csv   build zip table from zip,lat,lon lines\n"
+	       "    -c, --changes=mode     skip unchanged reports, or send only changed rows:\n"
+	       "                           skip, rows\n"
+	       "    -C, --thresholds=list  changed row thresholds, default\n"
+	       "                           temp=2,wind=3,dir=45,humidity=20,cloud=20,snow=1,weather=1\n"
+	       "    -W, --state=dir        last sent forecasts, default ~/.cache/weather/state\n"
+	       "    -n, --schedule=name    subscriber schedule, keeps separate state, default 'default'\n"
+	       "    -S, --stats            print stage timings and byte counts to stderr\n"
+	       "    -T, --trace=file       append Chrome trace events to file\n"
+	       "    -P, --pipeline=list    workers of fetch,parse,render,send stages,\n"
+	       "                           default 4,ncpu,ncpu,2; --stats adds queue depths\n"
+	       "    -U, --url=url          NDFD client url, e.g. local stand-in from bench/stand-in.py\n"
+	       "    -M, --smtp=file        smtp server and credentials, default ~/.config/weather/smtp.txt\n"
+	       "    -p, --prefetch=file    warm cache for 'zip next_send' lines, - for stdin, see\n"
+	       "                           db/prefetch.sh; zips sent at the same time are fetched as\n"
+	       "                           the delivery run with these zips in ascending order\n"
+	       "                           and the same output options\n"
+	       "    -L, --lead=minutes     finish each prefetch this long before send, default 5\n"
 	       "    -v, --version          print version\n"
 	       );
 }
 
-/* ===== data structures ===================== */
-
-struct time_interval
-{
-	time_t start_valid_time;
-	time_t end_valid_time;
-};
-
-struct time_layout
+static size_t
+write_gz(char *data, size_t size, size_t n, void *f)
 {
-	const char *key;    /* example k-p24h-n7-1, k-p3h-n37-3 */
-	int period;         /* total time period of layout */
-	int seq_number;     /* sequence number of layout */
-	int count;          /* number of intervals */
-	struct time_interval *intervals;
-};
-
-/* forecast display row */
+	return gzwrite(f, data, size * n) == (int)(size * n) ? size * n : 0;
+}
 
-enum temperature_type
+/* response is compressed while it is received, cache keeps only gzip file */
+static int
+fetch_forecast(const char *fname, const char *url, int zip)
 {
-	TEMPERATURE_HOURLY,
-	TEMPERATURE_MAXIMUM,
-	TEMPERATURE_MINIMUM,
-	TEMPERATURE_APPARENT,
-	TEMPERATURE_ENUM_MAX
-};
+	CURL *curl;
+	CURLcode res;
+	gzFile f;
+
+	f = gzopen(fname, "wb6");
+	if (f == NULL) {
+		warn("cannot create %s", fname);
+		return -1;
+	}
 
-const char *temperature_type_names[] = {
-	[TEMPERATURE_HOURLY] = "hourly",
-	[TEMPERATURE_MAXIMUM] = "maximum",
-	[TEMPERATURE_MINIMUM] = "minimum",
-	[TEMPERATURE_APPARENT] = "apparent"
-};
+	curl = curl_easy_init();
+	if (curl == NULL)
+		errx(1, "cannot init curl");
 
-struct temperature
-{
-	int celcius;
-	bool has_value;
-};
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_gz);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, f);
+	curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT, 60L);
 
-struct humidity
-{
-	int percent;
-	bool has_value;
-};
+	res = curl_easy_perform(curl);
+	curl_easy_cleanup(curl);
 
-struct wind_speed
-{
-	int mps;
-	bool has_value;
-};
-
-struct wind_direction
-{
-	int degrees;
-	bool has_value;
-};
+	if (gzclose(f) != Z_OK || res != CURLE_OK) {
+		unlink(fname);
+		warnx("cannot fetch forecast for zip %d: %s", zip, curl_easy_strerror(res));
+		return -1;
+	}
 
-struct cloud_amount
-{
-	int percent;
-	bool has_value;
-};
+	return 0;
+}
 
-struct snow_amount
+/* replace snapshot atomically, so weatherui never maps a partial file */
+static int
+write_snapshot(const struct buf *html, int zip)
 {
-	int centimeters;
-	bool has_value;
-};
+	char path[PATH_MAX], tmp[PATH_MAX];
+	FILE *f;
+	bool ok;
+
+	snprintf(path, PATH_MAX, "%s/zip-%05d.html", snapshot_dir, zip);
+	if (snprintf(tmp, PATH_MAX, "%s.%d.tmp", path, getpid()) >= PATH_MAX) {
+		warnx("%s: path is too long", path);
+		return -1;
+	}
 
-struct row
-{
-	time_t time;                         /* rounded to the start of the hour */
-	struct temperature temp_hourly;
-	struct temperature temp_max;
-	struct temperature temp_min;
-	struct temperature temp_apparent;
-	struct humidity humidity;
-	struct wind_speed wind_speed;
-	struct wind_direction wind_dir;
-	struct cloud_amount cloud_amount;
-	struct snow_amount snow_amount;
-	char *weather;
-};
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		warn("cannot create %s", tmp);
+		return -1;
+	}
 
-enum legend_position {
-	LEGEND_TOP,   /* useful for terminals */
-	LEGEND_BOTTOM /* useful for emails */
-};
+	ok = fwrite(html->s, 1, html->len, f) == html->len;
+	if (fclose(f) != 0 || !ok) {
+		warn("cannot write %s", tmp);
+		unlink(tmp);
+		return -1;
+	}
 
-#define MAX_HOURS 24*7
+	if (rename(tmp, path) != 0) {
+		warn("cannot rename %s to %s", tmp, path);
+		unlink(tmp);
+		return -1;
+	}
 
-struct dwml
-{
-	time_t creation_date;               /* NOAA response generating time */
-	time_t base_time;                   /* time from which rows data are calculated */
-	time_t refresh_frequency;           /* period from creation_date when next fetch makes sence */
-	size_t n_layouts;                   /* number of time layouts */
-	struct time_layout **time_layouts;  /* array of pointers to time layouts */
-	struct row table[MAX_HOURS];        /* table with rows from current hour to +MAX_HOURS */
-};
+	return 0;
+}
 
-static enum temperature_type
-get_temp_type(const char *name)
+/* html table for weatherui as snapshot file and in shared memory, with bin forecast */
+static void
+publish(const struct dwml *dwml, int zip)
 {
-	size_t i;
-
-	for (i = 0; i < TEMPERATURE_ENUM_MAX; i++)
-		if (strcmp(name, temperature_type_names[i]) == 0)
-			return i;
+	struct buf html, bin;
+	uint64_t start;
+
+	buf_init(&html);
+	dwml_format_html(&html, dwml);
+
+	/* weatherui keeps showing previous snapshot */
+	if (snapshot_dir != NULL && write_snapshot(&html, zip) != 0)
+		atomic_fetch_add(&failed, 1);
+
+	if (shm_name != NULL) {
+		buf_init(&bin);
+		dwml_format_bin(&bin, dwml);
+		start = trace_now();
+		if (shmcache_put(&shm, zip, dwml->creation_date, html.s, html.len, bin.s, bin.len) != 0)
+			warnx("zip %d: forecast not published, too large or slot is busy", zip);
+		trace_span("shm", zip, start, html.len + bin.len);
+		free(bin.s);
+	}
 
-	return TEMPERATURE_ENUM_MAX;
+	free(html.s);
 }
 
 static void
-isoize_time(char *timestr, const char *dwml_time)
+version()
 {
-	strncpy(timestr, dwml_time, 25);
-	timestr[22] = timestr[23];
-	timestr[23] = timestr[24];
-	timestr[24] = 0;
+	printf("weather\n");
+	printf("version %s\n", app_version);
+	printf("date %s\n", app_date);
 }
 
-static struct time_layout *
-parse_time_layout(const xmlNodePtr layout_node)
+static int
+send_email_to_me(const char *body, int zip)
 {
-	xmlNodePtr n = NULL;
-	int res = 0;
-	int i = 0;
-	struct tm tm;
-	char timestr[26];
-
-	n = first_el(layout_node, "layout-key");
-	if (n == NULL)
-		err(1, "no layout key in time-layout");
-
-	struct time_layout *tl = malloc(sizeof(struct time_layout));
-
-	tl->key = get_ctext(n);
-	res = sscanf(tl->key, "k-p%dh-n%d-%d", &tl->period, &tl->count, &tl->seq_number);
-	if (res != 3)
-		err(1, "cannot parse layout key: %s", tl->key);
+	char subject[100];
+	sprintf(subject, "wx: weather for zip %05d", zip);
+	struct message m = {
+		.to = "serge0x76+weather@gmail.com",
+		.from = "serge0x76@gmail.com",
+		.subject = subject,
+		.body = body,
+		.content_type = "text/html"
+	};
 
-	tl->intervals = calloc(tl->count, sizeof(struct time_interval));
+	return send_email(&m, smtp_fname);
+}
 
-	for (i = 0, n = first_el(layout_node, "start-valid-time"); n != NULL; n = next_el(n), i++) {
-		const char *text = get_ctext(n);
-		/* remove semicolon, i.e. 2015-08-21T08:00:00-04:00 to 2015-08-21T08:00:00-0400 */
-		isoize_time(timestr, text);
-		/* parse: 2015-08-21T08:00:00-0400 */
-		if (strptime(timestr, "%Y-%m-%dT%H:%M:%S%z", &tm) == NULL)
-			err(1, "cannot parse start-valid-time: %s", text);
-		tl->intervals[i].start_valid_time = mktime(&tm);
-	}
+static void
+parse_zips(const char *list)
+{
+	char *s = strdup(list), *tok, *save = NULL;
 
-	for (i = 0, n = first_el(layout_node, "end-valid-time"); n != NULL; n = next_el(n), i++) {
-		const char *text = get_ctext(n);
-		isoize_time(timestr, text);
-		if (strptime(timestr, "%Y-%m-%dT%H:%M:%S%z", &tm) == NULL)
-			err(1, "cannot parse end-valid-time: %s", text);
-		tl->intervals[i].end_valid_time = mktime(&tm);
+	n_zips = 0;
+	for (tok = strtok_r(s, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+		if (n_zips == sizeof(zips) / sizeof(zips[0]))
+			errx(1, "too many zips, max %zu", sizeof(zips) / sizeof(zips[0]));
+		zips[n_zips++] = atoi(tok);
 	}
 
-	return tl;
+	free(s);
 }
 
-static const struct time_layout *
-find_layout(const struct dwml *dwml, xmlNodePtr node)
+/* planned request moving through fetch and parse stages */
+struct job
 {
-	size_t i;
-	const char *layout_name = get_attr(node, "time-layout");
-
-	for (i = 0; i < dwml->n_layouts; i++)
-		if (strcmp(dwml->time_layouts[i]->key, layout_name) == 0)
-			return dwml->time_layouts[i];
+	const struct plan_request *req;
+	const char *params;
+	time_t t;                   /* hour of cache entry */
+	char key[32];               /* cache entry */
+	char path[PATH_MAX];        /* cached or input dwml file */
+	size_t n_points;
+	struct dwml **points;
+	atomic_size_t refs;         /* reports of points not sent yet */
+};
 
-	return NULL;
-}
+/* one zip of parsed point moving through render and send stages */
+struct report
+{
+	struct job *job;
+	const struct dwml *dwml;
+	int zip;
+	struct buf out;
+	struct change_state state;
+	bool *changed;
+};
 
+/* last report of the job frees parsed points */
 static void
-parse_temperature(struct dwml* dwml, const xmlNodePtr node)
+release_job(struct job *job)
 {
 	size_t i;
-	xmlNodePtr vn;
-	int row_idx;
-	const char *value;
-
-	const char *type = get_attr(node, "type");
-	enum temperature_type etemp = get_temp_type(type);
-	const struct time_layout * layout = find_layout(dwml, node);
-
-	for (i = 0, vn = first_el(node, "value"); vn != NULL; vn = next_el(vn), i++) {
-		value = get_ctext(vn);
-		row_idx = (layout->intervals[i].start_valid_time - dwml->base_time) / 3600;
-		if (row_idx < 0 || row_idx >= MAX_HOURS)
-			continue;
-
-		switch (etemp) {
-			case TEMPERATURE_MAXIMUM:
-				dwml->table[row_idx].temp_max.celcius = atoi(value);
-				dwml->table[row_idx].temp_max.has_value = true;
-				break;
-
-			case TEMPERATURE_MINIMUM:
-				dwml->table[row_idx].temp_min.celcius = atoi(value);
-				dwml->table[row_idx].temp_min.has_value = true;
-				break;
 
-			case TEMPERATURE_HOURLY:
-				dwml->table[row_idx].temp_hourly.celcius = atoi(value);
-				dwml->table[row_idx].temp_hourly.has_value = true;
-				break;
+	if (atomic_fetch_sub(&job->refs, 1) != 1)
+		return;
 
-			case TEMPERATURE_APPARENT:
-				dwml->table[row_idx].temp_apparent.celcius = atoi(value);
-				dwml->table[row_idx].temp_apparent.has_value = true;
-				break;
+	for (i = 0; i < job->n_points; i++)
+		dwml_free(job->points[i]);
+	free(job->points);
+	free(job);
+}
 
-			default:
-				fprintf(stderr, "invalid etype");
-				break;
-		}
+static void
+free_report(struct report *r)
+{
+	if (change_mode != CHANGE_OFF) {
+		change_free(&r->state);
+		free(r->changed);
 	}
+	free(r->out.s);
+	release_job(r->job);
+	free(r);
 }
 
+/* find request in cache, or fetch it once across threads and processes */
 static void
-parse_weather(struct dwml* dwml, const xmlNodePtr node)
+stage_fetch(struct pipeline *p, int stage, void *item)
 {
-	size_t i;
-	xmlNodePtr nc, nv;
-	struct buf wxbuf;
-	int row_idx;
-	const struct time_layout *layout = find_layout(dwml, node);
-
-	buf_init(&wxbuf);
-
-	for (i = 0, nc = first_el(node, "weather-conditions"); nc != NULL; nc = next_el(nc), i++) {
-		row_idx = (layout->intervals[i].start_valid_time - dwml->base_time) / 3600;
-
-		if (row_idx < 0 || row_idx >= MAX_HOURS)
-			continue;
-
-		for (nv = first_el(nc, "value"); nv != NULL; nv = next_el(nv)) {
-			const char *coverage = get_attr(nv, "coverage");
-			const char *intensity = get_attr(nv, "intensity");
-			const char *additive = get_attr(nv, "additive");
-			const char *qualifier = get_attr(nv, "qualifier");
-			const char *weather_type = get_attr(nv, "weather-type");
-
-			if (strcmp(intensity, "none") == 0)
-				intensity = NULL;
-
-			if (strcmp(qualifier, "none") == 0)
-				qualifier = NULL;
-
-			if (additive != NULL) {
-				if (strcmp(additive, "and") == 0)
-					buf_appendf(&wxbuf, ",");
-				else
-					buf_appendf(&wxbuf, " %s", additive);
-			}
+	struct job *job = item;
+	const struct plan_request *req = job->req;
+	char *key = job->key, tmp[PATH_MAX];
+	struct stat st;
+	struct buf url;
+	time_t now = job->t;
+	uint64_t start;
+	int zip = req->points[0].zips[0], lock, n, res = 0;
+	bool hit;
+
+	if (*fname != 0) {
+		strcpy(job->path, fname);
+		pipeline_emit(p, stage, job);
+		return;
+	}
 
-			if (intensity != NULL)
-				buf_appendf(&wxbuf, " %s", intensity);
+	buf_init(&url);
+	plan_url(&url, ndfd_url, req, job->params);
 
-			if (strcmp(weather_type, "thunderstorms") == 0)
-				weather_type = "TND";
-			else if (strcmp(weather_type, "rain showers") == 0)
-				weather_type = "SHW";
+	if (debug)
+		fprintf(stderr, "zip %d, %zu points. Fetching %s\n", zip, req->n_points, url.s);
 
-			if (strcmp(coverage, "slight chance") == 0)
-				coverage = "20%";
-			else if (strcmp(coverage, "chance") == 0)
-				coverage = "40%";
-			else if (strcmp(coverage, "likely") == 0)
-				coverage = "60%";
+	if (req->by_zip && req->n_points == 1)
+		n = snprintf(key, sizeof(job->key), "zip-%05d", zip);
+	else
+		n = snprintf(key, sizeof(job->key), "%s-%05d-%zu", req->by_zip ? "zips" : "grid", zip, req->n_points);
+
+	/* document with fewer elements is a different entry */
+	if (opts.fields != DWML_FIELDS_ALL)
+		snprintf(key + n, sizeof(job->key) - n, "-f%x", opts.fields);
+
+	start = trace_now();
+	hit = cache_lookup(&cache, key, now, job->path);
+	trace_span("cache", zip, start, 0);
+
+	if (!hit && debug && prefetch_fname == NULL)
+		errx(1, "no cached forecast %s for this hour", key);
+
+	if (!hit) {
+		/* another run may be fetching the same entry, wait for it */
+		start = trace_now();
+		lock = cache_lock_entry(&cache, key, now);
+		hit = cache_lookup(&cache, key, now, job->path);
+		trace_span("wait", zip, start, 0);
+
+		if (!hit) {
+			cache_tmp_path(&cache, key, now, tmp);
+			start = trace_now();
+			res = fetch_forecast(tmp, url.s, zip);
+			trace_span("fetch", zip, start, stat(tmp, &st) == 0 ? st.st_size : 0);
+			if (res == 0)
+				cache_commit(&cache, key, now, tmp, job->path);
+		}
 
-			buf_appendf(&wxbuf, " %s %s", weather_type, coverage);
+		cache_unlock_entry(&cache, key, now, lock);
+	}
 
-			if (qualifier != NULL)
-				buf_appendf(&wxbuf, " (%s)", qualifier);
-		}
+	free(url.s);
 
-		if (wxbuf.len > 0) {
-			dwml->table[row_idx].weather = strdup(wxbuf.s);
-			buf_clean(&wxbuf);
-		}
+	/* skip request, the rest of the run goes on */
+	if (res != 0) {
+		atomic_fetch_add(&failed, 1);
+		free(job);
+		return;
 	}
+
+	pipeline_emit(p, stage, job);
 }
 
-static struct row *
-get_row(struct dwml* dwml, const struct time_layout *layout, int idx)
+/* drop request with unusable document; cached copy is removed, so next run fetches it again */
+static void
+skip_job(struct job *job)
 {
-	int row_idx = (layout->intervals[idx].start_valid_time - dwml->base_time) / 3600;
-	if (row_idx < 0 || row_idx >= MAX_HOURS)
-		return NULL;
+	size_t i;
+
+	if (*fname == 0)
+		cache_remove(&cache, job->key, job->t);
 
-	return &dwml->table[row_idx];
+	for (i = 0; i < job->n_points; i++)
+		dwml_free(job->points[i]);
+	free(job->points);
+	free(job);
+
+	atomic_fetch_add(&failed, 1);
 }
 
+/* parse points of request and fan them out to every zip of each point */
 static void
-parse_parameters(struct dwml* dwml, const xmlNodePtr node)
+stage_parse(struct pipeline *p, int stage, void *item)
 {
-	xmlNodePtr n, vn;
-	const struct time_layout *layout;
-	size_t i;
-	struct row* row;
+	struct job *job = item;
+	const struct plan_request *req = job->req;
+	struct dwml_error error;
+	struct report *r;
+	struct stat st;
+	uint64_t start;
+	size_t i, j, n = 0;
+	int zip = req->points[0].zips[0];
 
-	for (n = first_el(node, "temperature"); n != NULL; n = next_el(n))
-		parse_temperature(dwml, n);
+	if (debug)
+		fprintf(stderr, "Cached filename: %s\n", job->path);
 
-	for (n = first_el(node, "wind-speed"); n != NULL; n = next_el(n)) {
-		layout = find_layout(dwml, n);
-		for (i = 0, vn = first_el(n, "value"); vn != NULL; vn = next_el(vn), i++) {
-			row = get_row(dwml, layout, i);
-			if (row == NULL)
-				continue;
+	start = trace_now();
+	job->points = dwml_parse_file_points(job->path, &opts, &job->n_points, &error);
+	trace_span("parse", zip, start, stat(job->path, &st) == 0 ? st.st_size : 0);
 
-			row->wind_speed.mps = atoi(get_ctext(vn));
-			row->wind_speed.has_value = true;
-		}
+	if (job->points == NULL) {
+		warnx("zip %d: skipping forecast, %s error: %s", zip, dwml_status_name(error.status), error.message);
+		skip_job(job);
+		return;
 	}
 
-	for (n = first_el(node, "direction"); n != NULL; n = next_el(n)) {
-		layout = find_layout(dwml, n);
-		for (i = 0, vn = first_el(n, "value"); vn != NULL; vn = next_el(vn), i++) {
-			row = get_row(dwml, layout, i);
-			if (row == NULL)
-				continue;
+	if (job->n_points != req->n_points) {
+		warnx("zip %d: skipping %s: expected %zu forecast points, got %zu",
+		      zip, job->path, req->n_points, job->n_points);
+		skip_job(job);
+		return;
+	}
 
-			row->wind_dir.degrees = atoi(get_ctext(vn));
-			row->wind_dir.has_value = true;
+	for (i = 0; i < req->n_points; i++)
+		n += req->points[i].n_zips;
+
+	/* held by parse until every report is queued */
+	atomic_init(&job->refs, n + 1);
+
+	for (i = 0; i < req->n_points; i++) {
+		for (j = 0; j < req->points[i].n_zips; j++) {
+			r = calloc(1, sizeof(struct report));
+			if (r == NULL)
+				err(1, "cannot allocate report");
+			r->job = job;
+			r->dwml = job->points[i];
+			r->zip = req->points[i].zips[j];
+			pipeline_emit(p, stage, r);
 		}
 	}
 
-	for (n = first_el(node, "cloud-amount"); n != NULL; n = next_el(n)) {
-		layout = find_layout(dwml, n);
-		for (i = 0, vn = first_el(n, "value"); vn != NULL; vn = next_el(vn), i++) {
-			row = get_row(dwml, layout, i);
-			if (row == NULL)
-				continue;
+	release_job(job);
+}
 
-			row->cloud_amount.percent = atoi(get_ctext(vn));
-			row->cloud_amount.has_value = true;
-		}
+/* snapshot, history and change detection, then format report for one zip */
+static void
+stage_render(struct pipeline *p, int stage, void *item)
+{
+	struct report *r = item;
+	const struct dwml *dwml = r->dwml;
+	const struct dwml *report = dwml;
+	struct dwml view;
+	size_t i, n_changed;
+	uint64_t start;
+	int zip = r->zip;
+
+	buf_init(&r->out);
+
+	if (snapshot_dir != NULL || shm_name != NULL)
+		publish(dwml, zip);
+
+	if (history_dir != NULL) {
+		start = trace_now();
+		long n = history_append(history_dir, zip, dwml);
+		trace_span("history", zip, start, n > 0 ? n : 0);
+		if (n < 0)
+			atomic_fetch_add(&failed, 1);
 	}
 
-	for (n = first_el(node, "precipitation"); n != NULL; n = next_el(n)) {
-		layout = find_layout(dwml, n);
-		for (i = 0, vn = first_el(n, "value"); vn != NULL; vn = next_el(vn), i++) {
-			row = get_row(dwml, layout, i);
-			if (row == NULL)
-				continue;
+	if (hazard_dir != NULL) {
+		start = trace_now();
+		int res = hazard_update(hazard_dir, zip, dwml);
+		trace_span("hazards", zip, start, dwml->n_hazards);
+		if (res != 0)
+			atomic_fetch_add(&failed, 1);
+	}
 
-			row->snow_amount.centimeters = atoi(get_ctext(vn));
-			row->snow_amount.has_value = true;
+	if (change_mode != CHANGE_OFF) {
+		start = trace_now();
+		/* unreadable state counts as failure, zip gets full report and new state */
+		if (change_load(&r->state, state_dir, zip, schedule) != 0)
+			atomic_fetch_add(&failed, 1);
+		r->changed = calloc(dwml->n_rows + 1, sizeof(bool));
+		if (r->changed == NULL)
+			err(1, "cannot allocate changed rows");
+		n_changed = change_diff(&r->state, dwml, &thresholds, r->changed);
+		trace_span("diff", zip, start, n_changed);
+
+		if (debug)
+			fprintf(stderr, "zip %05d: %zu of %zu rows changed\n", zip, n_changed, dwml->n_rows);
+
+		if (n_changed == 0) {
+			trace_span("unchanged", zip, start, 0);
+			free_report(r);
+			return;
 		}
-	}
 
-	for (n = first_el(node, "humidity"); n != NULL; n = next_el(n)) {
-		layout = find_layout(dwml, n);
-		for (i = 0, vn = first_el(n, "value"); vn != NULL; vn = next_el(vn), i++) {
-			row = get_row(dwml, layout, i);
-			if (row == NULL)
-				continue;
+		if (change_mode == CHANGE_SKIP)
+			for (i = 0; i < dwml->n_rows; i++)
+				r->changed[i] = true;
+	}
 
-			row->humidity.percent = atoi(get_ctext(vn));
-			row->humidity.has_value = true;
-		}
+	/* shallow copy to filter or convert rows, dwml is shared by zips of the point */
+	if (change_mode == CHANGE_ROWS || units != UNITS_METRIC) {
+		view = *dwml;
+		view.n_rows = 0;
+		view.rows = malloc(dwml->n_rows * sizeof(struct row) + 1);
+		if (view.rows == NULL)
+			err(1, "cannot allocate report rows");
+		for (i = 0; i < dwml->n_rows; i++)
+			if (r->changed == NULL || r->changed[i])
+				view.rows[view.n_rows++] = dwml->rows[i];
+		if (dwml_set_units(&view, units) != 0)
+			err(1, "cannot convert report units");
+		report = &view;
 	}
 
-	for (n = first_el(node, "weather"); n != NULL; n = next_el(n))
-		parse_weather(dwml, n);
+	start = trace_now();
+	if (format == FORMAT_JSON)
+		dwml_format_json(&r->out, report);
+	else if (format == FORMAT_CSV)
+		dwml_format_csv(&r->out, report);
+	else if (format == FORMAT_BIN)
+		dwml_format_bin(&r->out, report);
+	else if (digest && html)
+		dwml_format_digest_html(&r->out, report);
+	else if (digest)
+		dwml_format_digest_text(&r->out, report);
+	else if (html)
+		dwml_format_html(&r->out, report);
+	else
+		dwml_format_text(&r->out, report, LEGEND_TOP);
+	trace_span("format", zip, start, r->out.len);
+
+	if (report != dwml)
+		free(view.rows);
+
+	pipeline_emit(p, stage, r);
 }
 
+/* print or mail report, then remember it as sent */
 static void
-buf_add_temperature(struct buf *buf, const struct temperature *t)
+stage_send(struct pipeline *p, int stage, void *item)
 {
-	if (t->has_value)
-		buf_appendf(buf, "%4d", t->celcius);
-	else
-		buf_append(buf, "    ", 4);
-}
+	struct report *r = item;
+	uint64_t start;
+	int res = 0;
 
-static bool
-row_is_empty(const struct row *r)
-{
-	bool has_value = false;
+	if (format != FORMAT_TABLE) {
+		flockfile(stdout);
+		if (n_zips > 1)
+			printf("{\"zip\":\"%05d\",\"forecast\":", r->zip);
+		fwrite(r->out.s, 1, r->out.len, stdout);
+		if (n_zips > 1)
+			puts("}");
+		funlockfile(stdout);
+	} else if (mail_recipients == NULL) {
+		flockfile(stdout);
+		if (n_zips > 1)
+			printf("zip %05d\n", r->zip);
+		puts(r->out.s);
+		funlockfile(stdout);
+	} else {
+		buf_appendf(&r->out, "<br>\n<br>\nweather %s(%s) at host: %s, user: %s\n",
+			    app_version, app_date, getenv("HOST"), getenv("USER"));
+		start = trace_now();
+		res = send_email_to_me(r->out.s, r->zip);
+		trace_span("send", r->zip, start, r->out.len);
+	}
 
-	has_value |= r->temp_hourly.has_value;
-	has_value |= r->temp_apparent.has_value;
-	has_value |= r->temp_max.has_value;
-	has_value |= r->temp_min.has_value;
-	has_value |= r->humidity.has_value;
-	has_value |= r->cloud_amount.has_value;
-	has_value |= r->wind_speed.has_value;
-	has_value |= r->wind_dir.has_value;
-	has_value |= r->snow_amount.has_value;
-	has_value |= r->weather != NULL;
+	/* rows of unsent report stay changed for the next run */
+	if (res != 0)
+		atomic_fetch_add(&failed, 1);
+	else if (change_mode != CHANGE_OFF && change_save(&r->state, r->dwml, r->changed) != 0)
+		atomic_fetch_add(&failed, 1);
 
-	return !has_value;
+	free_report(r);
 }
 
+/* "fetch,parse,render,send" worker counts, empty keeps default */
 static void
-format_legend(struct buf *buf, const char *timestr)
+parse_workers(const char *list)
 {
-	struct tm tm;
-	time_t now = time(NULL);
+	char *s = strdup(list), *tok = s, *next;
+	size_t i;
 
-	buf_appendf(buf, "\nInfo\n");
-	buf_appendf(buf,   "====\n");
-	buf_appendf(buf, "UTC:         %s", asctime(gmtime_r(&now, &tm)));
-	buf_appendf(buf, "report time: %s\n", timestr);
-	buf_appendf(buf, "Legend\n");
-	buf_appendf(buf, "======\n");
-	buf_appendf(buf, "TMP -- hourly temperature, celsius\n");
-	buf_appendf(buf, "APR -- hourly apparent temperature, celsius\n");
-	buf_appendf(buf, "MIN -- minimal temperature for a day, celsius\n");
-	buf_appendf(buf, "MAX -- maximum temperature for a day, celsius\n");
-	buf_appendf(buf, "HUM -- humidity, relative\n");
-	buf_appendf(buf, "CLD -- cloud amount, percent\n");
-	buf_appendf(buf, "SPD -- wind speed, meters per second\n");
-	buf_appendf(buf, "DIR -- wind direction, degrees\n");
-	buf_appendf(buf, "SNW -- snow, centimeters\n");
-	buf_appendf(buf, "TND -- thunderstorms\n");
-	buf_appendf(buf, "SHW -- rain showers\n");
+	for (i = 0; i < STAGE_ENUM_MAX && tok != NULL; i++, tok = next) {
+		next = strchr(tok, ',');
+		if (next != NULL)
+			*next++ = 0;
+		if (*tok == 0)
+			continue;
+		workers[i] = atoi(tok);
+		if (workers[i] < 1)
+			errx(1, "invalid worker count %s", tok);
+	}
+
+	if (tok != NULL)
+		errx(1, "too many pipeline stages in %s", list);
+
+	free(s);
 }
 
 static void
-format_text_table(struct buf *buf, const struct dwml *dwml, enum legend_position legend_pos)
+print_alert(const struct hazard_record *r, void *arg)
 {
-	size_t i, n;
-	char timestr[30];
+	char start[32], end[32];
+	time_t t;
 	struct tm tm;
-	int prev_day = 0;
 
-	localtime_r(&dwml->base_time, &tm);
-	n = strftime(timestr, 30, "%Y-%m-%d %H", &tm);
+	t = r->start;
+	strftime(start, sizeof(start), "%Y-%m-%dT%H:%MZ", gmtime_r(&t, &tm));
+	t = r->end;
+	strftime(end, sizeof(end), "%Y-%m-%dT%H:%MZ", gmtime_r(&t, &tm));
 
-	if (legend_pos == LEGEND_TOP)
-		format_legend(buf, timestr);
-
-	buf_appendf(buf, "========== ==  === === === === === === === === === ===================\n");
-	buf_appendf(buf, "DATE...... HR  AIR.................... WIND... SNW CONDITIONS.........\n");
-	buf_appendf(buf, "               TMP APR MIN MAX HUM CLD SPD DIR    \n");
-	buf_appendf(buf, "========== ==  === === === === === === === === === ===================\n");
+	printf("%05u\t%.8s\t%s\t%s\t%.16s\t%.32s\n", r->zip, r->code, start, end, r->significance, r->phenomena);
+}
 
-	for (i = 0; i < MAX_HOURS; i++) {
-		const struct row *r = &dwml->table[i];
-		if (r->time == 0 || row_is_empty(r))
-			continue;
+/* zips under hazards now or within alerts_hours, for out of schedule alerts */
+static int
+list_alerts()
+{
+	time_t now = time(NULL);
 
-		localtime_r(&r->time, &tm);
-		if (prev_day != tm.tm_mday) {
-			n = strftime(timestr, 30, "%Y-%m-%d ", &tm);
-			buf_append(buf, timestr, n);
-			prev_day = tm.tm_mday;
-		} else {
-			buf_append(buf, "           ", 11);
-		}
+	if (hazard_dir == NULL)
+		errx(1, "alerts need hazards index dir, see -A");
 
-		buf_appendf(buf, "%02d ", tm.tm_hour);
+	if (hazard_query(hazard_dir, now, now + alerts_hours * 3600 + 1, print_alert, NULL) != 0)
+		errx(1, "no hazards index in %s", hazard_dir);
 
-		buf_add_temperature(buf, &r->temp_hourly);
-		buf_add_temperature(buf, &r->temp_apparent);
-		buf_add_temperature(buf, &r->temp_min);
-		buf_add_temperature(buf, &r->temp_max);
+	return 0;
+}
 
-		if (r->humidity.has_value)
-			buf_appendf(buf, "%4d", r->humidity.percent);
-		else
-			buf_append(buf, "    ", 4);
+/* history and change state keep every column */
+static unsigned
+output_fields()
+{
+	unsigned fields = digest ? DWML_FIELDS_DIGEST : html ? DWML_FIELDS_HTML : DWML_FIELDS_TEXT;
 
-		if (r->cloud_amount.has_value)
-			buf_appendf(buf, "%4d", r->cloud_amount.percent);
-		else
-			buf_append(buf, "    ", 4);
+	if (format != FORMAT_TABLE)
+		fields = DWML_FIELDS_ALL;
 
-		if (r->wind_speed.has_value)
-			buf_appendf(buf, "%4d", r->wind_speed.mps);
-		else
-			buf_append(buf, "    ", 4);
+	if (snapshot_dir != NULL || shm_name != NULL)
+		fields |= DWML_FIELDS_HTML;
 
-		if (r->wind_dir.has_value)
-			buf_appendf(buf, "%4d", r->wind_dir.degrees);
-		else
-			buf_append(buf, "    ", 4);
+	if (history_dir != NULL || change_mode != CHANGE_OFF)
+		fields = DWML_FIELDS_ALL;
 
-		if (r->snow_amount.has_value)
-			buf_appendf(buf, "%4d", r->snow_amount.centimeters);
-		else
-			buf_append(buf, "    ", 4);
+	if (hazard_dir != NULL)
+		fields |= DWML_FIELD_HAZARDS;
 
-		if (r->weather != NULL)
-			buf_appendf(buf, " %s", r->weather);
+	return fields;
+}
 
-		buf_append(buf, "\n", 1);
-	}
+static struct job *
+new_job(const struct plan_request *req, const char *params, time_t t)
+{
+	struct job *job = calloc(1, sizeof(struct job));
 
-	buf_appendf(buf, "========== ==  === === === === === === === === === ===================\n");
+	if (job == NULL)
+		err(1, "cannot allocate job");
 
-	if (legend_pos == LEGEND_BOTTOM)
-		format_legend(buf, timestr);
+	job->req = req;
+	job->params = params;
+	job->t = t;
 
+	return job;
 }
 
-static const char header[] =
-	"<tr style=\"background-color: lightsteelblue;\">"
-	"<th>HR&nbsp;&nbsp;</th>"
-	"<th colspan=\"4\">AIR</th>"
-	"<th colspan=\"2\">WIND</th>"
-	"<th>SNOW</th>"
-	"<th>CONDITIONS</th>"
-	"</tr>\n"
-	"<tr>"
-	"<th></th>"
-	"<th>TMP</th>"
-	"<th>MNX</th>"
-	"<th>HUM</th>"
-	"<th>CLD</th>"
-	"<th>SPD</th>"
-	"<th>DIR</th>"
-	"</tr>\n";
-
-const char *pink_border = " style=\"border: solid 1px pink; border-bottom: none\"";
-
 static void
-format_html_table(struct buf *buf, const struct dwml *dwml)
+add_stages(struct pipeline *p, size_t n_stages)
 {
-	size_t i, n;
-	char timestr[30];
-	struct tm tm;
-	int prev_day = 0;
-	const char *style = "";
+	static const stage_fn fns[STAGE_ENUM_MAX] = { stage_fetch, stage_parse, stage_render, stage_send };
+	static const char *names[STAGE_ENUM_MAX] = { "fetch", "parse", "render", "send" };
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t i;
 
-	localtime_r(&dwml->base_time, &tm);
-	n = strftime(timestr, 30, "%Y-%m-%d %H %a", &tm);
+	for (i = 0; i < n_stages; i++)
+		pipeline_add_stage(p, names[i], workers[i] > 0 ? workers[i] : ncpu, fns[i]);
+}
 
-	buf_appendf(buf, "<table border=\"0\">\n");
-	buf_appendf(buf, header);
+/* run planned requests through the pipeline */
+static void
+deliver(const struct plan *plan, const char *params)
+{
+	struct pipeline pipeline;
+	size_t i;
 
-	for (i = 0; i < MAX_HOURS; i++) {
-		const struct row *r = &dwml->table[i];
-		if (r->time == 0 || row_is_empty(r))
-			continue;
+	pipeline_init(&pipeline);
+	add_stages(&pipeline, STAGE_ENUM_MAX);
+	pipeline_start(&pipeline);
 
-		localtime_r(&r->time, &tm);
-		if (prev_day != tm.tm_mday) {
-			buf_appendf(buf, "\n<tr><td colspan=\"12\" style=\"border: lightsteelblue 1px solid;\">");
-			n = strftime(timestr, 30, "%Y-%m-%d %a", &tm);
-			buf_append(buf, timestr, n);
-			buf_appendf(buf, "</td></tr>\n<tr>");
-			prev_day = tm.tm_mday;
-		} else {
-			buf_appendf(buf, "<tr>");
-		}
+	for (i = 0; i < plan->n_requests; i++)
+		pipeline_submit(&pipeline, new_job(&plan->requests[i], params, time(NULL)));
 
-		if (r->temp_max.has_value)
-			style = pink_border;
-
-		buf_appendf(buf, "<td>%02d</td>", tm.tm_hour);
-
-//		if (r->temp_hourly.has_value)
-//			buf_appendf(buf, "<td>%d</td>", r->temp_hourly.celcius);
-//		else
-//			buf_appendf(buf, "<td></td>");
-
-		if (r->temp_apparent.has_value)
-			buf_appendf(buf, "<td>%d</td>", r->temp_apparent.celcius);
-		else
-			buf_appendf(buf, "<td></td>");
-
-		if (r->temp_min.has_value)
-			buf_appendf(buf, "<td%s>%d</td>", style, r->temp_min.celcius);
-		else if (r->temp_max.has_value)
-			buf_appendf(buf, "<td%s>%d</td>", style, r->temp_max.celcius);
-		else
-			buf_appendf(buf, "<td></td>");
-
-		if (r->humidity.has_value)
-			buf_appendf(buf, "<td>%d</td>", r->humidity.percent);
-		else
-			buf_appendf(buf, "<td></td>");
-
-		if (r->cloud_amount.has_value)
-			buf_appendf(buf, "<td>%d</td>", r->cloud_amount.percent);
-		else
-			buf_appendf(buf, "<td></td>");
-
-		if (r->wind_speed.has_value)
-			buf_appendf(buf, "<td>%d</td>", r->wind_speed.mps);
-		else
-			buf_appendf(buf, "<td></td>");
-
-		if (r->wind_dir.has_value)
-			buf_appendf(buf, "<td>%d</td>", r->wind_dir.degrees);
-		else
-			buf_appendf(buf, "<td></td>");
-
-		if (r->snow_amount.has_value && r->snow_amount.centimeters > 0)
-			buf_appendf(buf, "<td>%d</td>", r->snow_amount.centimeters);
-		else
-			buf_appendf(buf, "<td></td>");
-
-		if (r->weather != NULL)
-			buf_appendf(buf, "<td>%s</td>", r->weather);
-		else
-			buf_appendf(buf, "<td></td>");
-
-		buf_appendf(buf, "</tr>\n");
+	pipeline_finish(&pipeline);
+
+	if (stats) {
+		trace_print_stats(stderr);
+		pipeline_print_stats(&pipeline, stderr);
 	}
 
-	buf_appendf(buf, "</table>\n");
+	pipeline_free(&pipeline);
 }
 
-static void
-set_rows_time(struct dwml* dwml)
-{
-	size_t i, j;
-	int row_idx;
-	struct time_layout *tl;
-
-	for (i = 0; i < dwml->n_layouts; i++) {
-		tl = dwml->time_layouts[i];
-		for (j = 0; j < tl->count; j++) {
-			row_idx = (tl->intervals[j].start_valid_time - dwml->base_time) / 3600;
-			if (row_idx < 0 || row_idx >= MAX_HOURS)
-				continue;
-			dwml->table[row_idx].time = tl->intervals[j].start_valid_time;
-		}
-	}
-}
+/* ===== prefetch ==================== */
 
-static void
-parse_data(struct dwml* dwml, const xmlNodePtr data_node)
+struct send_time
 {
-	xmlNodePtr n = NULL;
-	size_t i = 0;
-
-	dwml->n_layouts = 0;
-
-	for (n = first_el(data_node, "time-layout"); n != NULL; n = next_el(n))
-		dwml->n_layouts++;
+	int zip;
+	time_t t;
+};
 
-	dwml->time_layouts = calloc(dwml->n_layouts, sizeof(struct time_layout *));
+/* request warmed for deliveries at t, due in cache at deadline */
+struct warm
+{
+	const struct plan_request *req;
+	time_t t;
+	time_t deadline;
+};
 
-	for (i = 0, n = first_el(data_node, "time-layout"); n != NULL; n = next_el(n), i++)
-		dwml->time_layouts[i] = parse_time_layout(n);
+static int
+cmp_send_times(const void *a, const void *b)
+{
+	const struct send_time *x = a, *y = b;
 
-	set_rows_time(dwml);
+	if (x->t != y->t)
+		return x->t < y->t ? -1 : 1;
 
-	for (n = first_el(data_node, "parameters"); n != NULL; n = next_el(n))
-		parse_parameters(dwml, n);
+	return x->zip < y->zip ? -1 : x->zip > y->zip;
 }
 
-static struct dwml*
-load_dwml(const char *file)
+/* "zip next_send" lines, next_send in unix time; sorted by time and zip */
+static size_t
+read_send_times(const char *fname, struct send_time **times)
 {
-	xmlDoc *doc = NULL;
-	xmlNodePtr root_element, data;
-
-	doc = xmlReadFile(file, NULL, 0);
-	if (doc == NULL)
-		err(1, "could not parse file %s", file);
+	FILE *f = strcmp(fname, "-") == 0 ? stdin : fopen(fname, "r");
+	struct send_time *st = NULL;
+	size_t n = 0, cap = 0, i, j;
+	char line[256];
+	long long t;
+	int zip;
+
+	if (f == NULL)
+		err(1, "cannot open %s", fname);
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "%d %lld", &zip, &t) != 2)
+			continue; /* header or comment */
+		if (n == cap) {
+			cap = cap == 0 ? 256 : cap * 2;
+			st = realloc(st, cap * sizeof(struct send_time));
+			if (st == NULL)
+				err(1, "cannot allocate send times");
+		}
+		st[n].zip = zip;
+		st[n].t = t;
+		n++;
+	}
 
-	struct dwml *dwml = calloc(1, sizeof(struct dwml));
-//	dwml->base_time = 1440144000;
-	dwml->base_time = time(NULL);
+	if (f != stdin)
+		fclose(f);
 
-	root_element = xmlDocGetRootElement(doc);
+	qsort(st, n, sizeof(struct send_time), cmp_send_times);
 
-	data = first_el(root_element, "data");
-	parse_data(dwml, data);
+	/* subscribers of the same zip and time share one delivery */
+	for (i = j = 0; i < n; i++)
+		if (j == 0 || cmp_send_times(&st[j - 1], &st[i]) != 0)
+			st[j++] = st[i];
 
-	xmlFreeDoc(doc);
+	*times = st;
 
-	return dwml;
+	return j;
 }
 
+/* prefetched entry is already in cache, nothing else to do */
 static void
-fetch_forecast(const char *fname, const char *url)
+stage_warm(struct pipeline *p, int stage, void *item)
 {
-	struct httpreq_opts opts = {
-		.resp_fname = fname
-	};
+	struct job *job = item;
 
-	if (httpreq(url, NULL, &opts) != 0)
-		err(1, "cannot fetch forecast for zip %d", zip);
-}
+	if (debug)
+		fprintf(stderr, "warm %s for %ld\n", job->path, (long)job->t);
 
-static void
-version()
-{
-	printf("weather\n");
-	printf("version %s\n", app_version);
-	printf("date %s\n", app_date);
+	free(job);
 }
 
+/*
+ * Warm cache for upcoming deliveries. Zips sent at the same time are
+ * planned as the delivery run with those zips in ascending order plans
+ * them, and stored under the hour of send time, so that run finds every
+ * request in cache. Fetches are spread evenly over the time left before
+ * the last deadline, each one no later than lead minutes before its send.
+ */
 static void
-send_email_to_me(const char *body)
+prefetch(const struct zipdb *db, const char *params)
 {
-	char subject[100];
-	sprintf(subject, "wx: weather for zip %05d", zip);
-	struct message m = {
-		.to = "serge0x76+weather@gmail.com",
-		.from = "serge0x76@gmail.com",
-		.subject = subject,
-		.body = body,
-		.content_type = "text/html"
-	};
+	struct send_time *times;
+	struct plan *plans = NULL;
+	struct warm *warm = NULL;
+	struct pipeline pipeline;
+	size_t n_times, n_plans = 0, n_warm = 0, i, j, k;
+	time_t start = time(NULL), now, last, at, spacing;
+	int *group;
+
+	n_times = read_send_times(prefetch_fname, &times);
+	group = malloc((n_times + 1) * sizeof(int));
+	if (group == NULL)
+		err(1, "cannot allocate zips");
+
+	for (i = 0; i < n_times; i = j) {
+		for (j = i; j < n_times && times[j].t == times[i].t; j++)
+			group[j - i] = times[j].zip;
+
+		plans = realloc(plans, (n_plans + 1) * sizeof(struct plan));
+		if (plans == NULL)
+			err(1, "cannot allocate plans");
+		plan_build(&plans[n_plans], j - i > 1 ? db : NULL, group, j - i);
+
+		warm = realloc(warm, (n_warm + plans[n_plans].n_requests) * sizeof(struct warm));
+		if (warm == NULL)
+			err(1, "cannot allocate prefetch");
+		for (k = 0; k < plans[n_plans].n_requests; k++) {
+			warm[n_warm].req = &plans[n_plans].requests[k];
+			warm[n_warm].t = times[i].t;
+			warm[n_warm].deadline = times[i].t - lead * 60;
+			n_warm++;
+		}
+		n_plans++;
+	}
+
+	if (debug)
+		fprintf(stderr, "%zu deliveries, %zu send times, %zu requests\n", n_times, n_plans, n_warm);
+
+	last = n_warm > 0 ? warm[n_warm - 1].deadline : start;
+	spacing = n_warm > 0 && last > start ? (last - start) / (time_t)n_warm : 0;
+
+	pipeline_init(&pipeline);
+	add_stages(&pipeline, STAGE_FETCH + 1);
+	pipeline_add_stage(&pipeline, "warm", 1, stage_warm);
+	pipeline_start(&pipeline);
+
+	/* warm is ordered by deadline, so are submit times; idle workers park in between */
+	for (i = 0; i < n_warm; i++) {
+		at = start + (time_t)i * spacing;
+		if (at > warm[i].deadline)
+			at = warm[i].deadline;
+		while ((now = time(NULL)) < at)
+			sleep(at - now);
+		pipeline_submit(&pipeline, new_job(warm[i].req, params, warm[i].t));
+	}
+
+	pipeline_finish(&pipeline);
+
+	if (stats) {
+		trace_print_stats(stderr);
+		pipeline_print_stats(&pipeline, stderr);
+	}
 
-	char fname[PATH_MAX];
-	snprintf(fname, PATH_MAX, "%s/.config/weather/smtp.txt", getenv("HOME"));
-	send_email(&m, fname);
+	pipeline_free(&pipeline);
+	for (i = 0; i < n_plans; i++)
+		plan_free(&plans[i]);
+	free(plans);
+	free(warm);
+	free(group);
+	free(times);
 }
 
 int main(int argc, char **argv)
@@ -780,13 +957,18 @@ int main(int argc, char **argv)
 
 	int ch;
 
-	while ((ch = getopt_long(argc, argv, "dm:thvz:f:", longopts, NULL)) != -1) {
+	snprintf(zipdb_fname, PATH_MAX, "%s/.config/weather/zipdb.bin", getenv("HOME"));
+	snprintf(state_dir, PATH_MAX, "%s/.cache/weather/state", getenv("HOME"));
+	snprintf(smtp_fname, PATH_MAX, "%s/.config/weather/smtp.txt", getenv("HOME"));
+	change_default_thresholds(&thresholds);
+
+	while ((ch = getopt_long(argc, argv, "dm:thvyF:u:z:f:s:x:H:A:a:D:Z:g:K:G:c:C:W:n:ST:P:U:M:p:L:", longopts, NULL)) != -1) {
 		switch (ch) {
 			case 'd':
 				debug = true;
 				break;
 			case 'z':
-				zip = atoi(optarg);
+				parse_zips(optarg);
 				break;
 			case 'm':
 				mail_recipients = optarg;
@@ -797,6 +979,101 @@ int main(int argc, char **argv)
 			case 't':
 				html = true;
 				break;
+			case 'y':
+				digest = true;
+				break;
+			case 'F':
+				if (strcmp(optarg, "json") == 0)
+					format = FORMAT_JSON;
+				else if (strcmp(optarg, "csv") == 0)
+					format = FORMAT_CSV;
+				else if (strcmp(optarg, "bin") == 0)
+					format = FORMAT_BIN;
+				else
+					errx(1, "unknown format %s", optarg);
+				break;
+			case 'u':
+				if (strcmp(optarg, "metric") == 0)
+					units = UNITS_METRIC;
+				else if (strcmp(optarg, "imperial") == 0)
+					units = UNITS_IMPERIAL;
+				else
+					errx(1, "unknown units %s", optarg);
+				break;
+			case 's':
+				snapshot_dir = optarg;
+				break;
+			case 'x':
+				shm_name = optarg;
+				break;
+			case 'H':
+				history_dir = optarg;
+				break;
+			case 'A':
+				hazard_dir = optarg;
+				break;
+			case 'a':
+				alerts_hours = atoi(optarg);
+				break;
+			case 'D':
+				opts.horizon = atoi(optarg) * 24;
+				break;
+			case 'Z':
+				opts.tz = tz_get(optarg);
+				if (opts.tz == NULL)
+					errx(1, "unknown time zone %s", optarg);
+				break;
+			case 'g':
+				if (snprintf(zipdb_fname, PATH_MAX, "%s", optarg) >= PATH_MAX)
+					errx(1, "%s: path is too long", optarg);
+				break;
+			case 'K':
+				cache_budget = (uint64_t)atoi(optarg) << 20;
+				break;
+			case 'G':
+				zipdb_csv = optarg;
+				break;
+			case 'c':
+				if (strcmp(optarg, "skip") == 0)
+					change_mode = CHANGE_SKIP;
+				else if (strcmp(optarg, "rows") == 0)
+					change_mode = CHANGE_ROWS;
+				else
+					errx(1, "unknown changes mode %s", optarg);
+				break;
+			case 'C':
+				if (change_parse_thresholds(&thresholds, optarg) != 0)
+					errx(1, "invalid thresholds %s", optarg);
+				break;
+			case 'W':
+				if (snprintf(state_dir, PATH_MAX, "%s", optarg) >= PATH_MAX)
+					errx(1, "%s: path is too long", optarg);
+				break;
+			case 'n':
+				schedule = optarg;
+				break;
+			case 'S':
+				stats = true;
+				break;
+			case 'T':
+				trace_fname = optarg;
+				break;
+			case 'P':
+				parse_workers(optarg);
+				break;
+			case 'U':
+				ndfd_url = optarg;
+				break;
+			case 'M':
+				if (snprintf(smtp_fname, PATH_MAX, "%s", optarg) >= PATH_MAX)
+					errx(1, "%s: path is too long", optarg);
+				break;
+			case 'p':
+				prefetch_fname = optarg;
+				break;
+			case 'L':
+				lead = atoi(optarg);
+				break;
 			case 'h':
 				usage();
 				return 1;
@@ -809,57 +1086,89 @@ int main(int argc, char **argv)
 		}
 	}
 
-	curl_global_init(CURL_GLOBAL_ALL);
+	if (zipdb_csv != NULL)
+		return zipdb_build(zipdb_csv, zipdb_fname);
 
-	char timestr[50];
-	struct tm tm;
-	time_t now = time(NULL);
-	char url[1024];
-	struct buf out;
-	const char *urlfmt =
-		"http://graphical.weather.gov/xml/sample_products/browser_interface/ndfdXMLclient.php?"
-		"whichClient=NDFDgenMultiZipCode&"
-		"zipCodeList=%d&&product=time-series&Unit=m&maxt=maxt&mint=mint&temp=temp&"
-		"snow=snow&wspd=wspd&wdir=wdir&sky=sky&wx=wx&rh=rh&appt=appt&wwa=wwa&Submit=Submit";
+	if (alerts_hours >= 0)
+		return list_alerts();
 
-	localtime_r(&now, &tm);
-	buf_init(&out);
+	if (format != FORMAT_TABLE && mail_recipients != NULL)
+		errx(1, "%s format is printed only", format == FORMAT_JSON ? "json" : format == FORMAT_CSV ? "csv" : "bin");
 
-	sprintf(url, urlfmt, zip);
-	if (debug)
-		fprintf(stderr, "zip %d. Fetching %s\n", zip, url);
+	if ((format == FORMAT_CSV || format == FORMAT_BIN) && n_zips > 1)
+		errx(1, "csv and bin formats take one zip");
 
-	if (!debug && *fname == 0) {
-		strftime(timestr, 50, "%Y%m%d-%H", &tm);
-		sprintf(fname, "%s/.cache/weather/zip-%05d-%s.xml", getenv("HOME"), zip, timestr);
+	curl_global_init(CURL_GLOBAL_ALL);
+	xmlInitParser();
+
+	if (stats || trace_fname != NULL)
+		trace_enable();
+
+	char cache_dir[PATH_MAX];
+	snprintf(cache_dir, PATH_MAX, "%s/.cache/weather", getenv("HOME"));
+	if (*fname == 0 && cache_open(&cache, cache_dir, cache_budget) != 0)
+		err(1, "cannot open cache %s", cache_dir);
+
+	if (change_mode != CHANGE_OFF && mkdir(state_dir, 0755) != 0 && errno != EEXIST)
+		err(1, "cannot create %s", state_dir);
+
+	struct plan plan;
+	struct zipdb db;
+	bool have_db = zipdb_open(&db, zipdb_fname) == 0;
+	struct buf params;
+
+	/*
+	 * Table for zips of this run at half load, 64 MB to 256 MB of /dev/shm.
+	 * Zips of other runs beyond that take over slots stored longest ago.
+	 */
+	if (shm_name != NULL) {
+		size_t want = 2 * n_zips;
+		if (want < SHMCACHE_DEFAULT_SLOTS)
+			want = SHMCACHE_DEFAULT_SLOTS;
+		if (want > SHMCACHE_MAX_SLOTS)
+			want = SHMCACHE_MAX_SLOTS;
+		if (shmcache_open(&shm, shm_name, true, want) != 0)
+			err(1, "cannot open shared memory %s", shm_name);
+		if (debug && shmcache_slots(&shm) < want)
+			fprintf(stderr, "%s has %u slots for %zu zips\n", shm_name, shmcache_slots(&shm), n_zips);
 	}
 
-	if (debug)
-		fprintf(stderr, "Cached filename: %s\n", fname);
+	/* request and decode only elements the outputs of this run read */
+	opts.fields = output_fields();
+	buf_init(&params);
+	plan_params(&params, opts.fields);
 
-	if (!debug)
-		fetch_forecast(fname, url);
+	/* a single zip keeps the zip based request, nothing to share */
+	plan_build(&plan, have_db && n_zips > 1 ? &db : NULL, zips, n_zips);
 
-	setenv("TZ", "EST5EDT", 1);
-	tzset();
+	if (debug && prefetch_fname == NULL)
+		fprintf(stderr, "%zu zips, %zu requests\n", n_zips, plan.n_requests);
 
-	const struct dwml *dwml = load_dwml(fname);
+	if (*fname != 0 && (plan.n_requests != 1 || prefetch_fname != NULL))
+		errx(1, "input file can be used only with zips planned into one request");
 
-	if (html)
-		format_html_table(&out, dwml);
+	if (prefetch_fname != NULL)
+		prefetch(have_db ? &db : NULL, params.s);
 	else
-		format_text_table(&out, dwml, LEGEND_TOP);
+		deliver(&plan, params.s);
+
+	if (trace_fname != NULL)
+		trace_write(trace_fname);
+
+	plan_free(&plan);
+	free(params.s);
+	if (*fname == 0)
+		cache_close(&cache);
+	shmcache_close(&shm);
+	if (have_db)
+		zipdb_close(&db);
+	curl_global_cleanup();
+	xmlCleanupParser();
 
-	if (mail_recipients == NULL)
-		puts(out.s);
-	else {
-		buf_appendf(&out, "<br>\n<br>\nweather %s(%s) at host: %s, user: %s\n",
-			    app_version, app_date, getenv("HOST"), getenv("USER"));
-		send_email_to_me(out.s);
+	if (atomic_load(&failed) > 0) {
+		warnx("%zu requests failed or not stored", atomic_load(&failed));
+		return 1;
 	}
 
-	buf_clean(&out);
-	curl_global_cleanup();
-
 	return 0;
 }
@@ -0,0 +1,145 @@
+/**
+ * Serge Voilokov, 2015.
+ * Staged pipeline: worker threads per stage, bounded queues between stages.
+ *
+ * A slow stage fills its input queue and blocks the stage before it, so
+ * memory stays bounded while the other stages keep their own pace.
+ */
+
+#include "pipeline.h"
+#include "trace.h"
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+void
+pipeline_init(struct pipeline *p)
+{
+	memset(p, 0, sizeof(*p));
+}
+
+void
+pipeline_add_stage(struct pipeline *p, const char *name, int workers, stage_fn fn)
+{
+	struct stage *s;
+
+	if (p->n_stages == PIPELINE_MAX_STAGES)
+		errx(1, "too many pipeline stages");
+
+	s = &p->stages[p->n_stages++];
+	s->name = name;
+	s->workers = workers > 0 ? workers : 1;
+	s->fn = fn;
+	s->p = p;
+	queue_init(&s->queue, PIPELINE_QUEUE_SIZE);
+	atomic_init(&s->running, s->workers);
+	atomic_init(&s->items, 0);
+	atomic_init(&s->busy_ns, 0);
+}
+
+static void *
+worker(void *arg)
+{
+	struct stage *s = arg;
+	struct pipeline *p = s->p;
+	int stage = s - p->stages;
+	uint64_t start;
+	void *item;
+
+	while (queue_pop(&s->queue, &item)) {
+		start = trace_now();
+		s->fn(p, stage, item);
+		atomic_fetch_add(&s->busy_ns, trace_now() - start);
+		atomic_fetch_add(&s->items, 1);
+	}
+
+	if (atomic_fetch_sub(&s->running, 1) == 1 && stage + 1 < p->n_stages)
+		queue_close(&p->stages[stage + 1].queue);
+
+	return NULL;
+}
+
+void
+pipeline_start(struct pipeline *p)
+{
+	struct stage *s;
+	int i, j;
+
+	p->start = trace_now();
+
+	for (i = 0; i < p->n_stages; i++) {
+		s = &p->stages[i];
+		s->threads = calloc(s->workers, sizeof(pthread_t));
+		if (s->threads == NULL)
+			err(1, "cannot allocate %s workers", s->name);
+		for (j = 0; j < s->workers; j++)
+			if (pthread_create(&s->threads[j], NULL, worker, s) != 0)
+				errx(1, "cannot start %s worker", s->name);
+	}
+}
+
+void
+pipeline_submit(struct pipeline *p, void *item)
+{
+	queue_push(&p->stages[0].queue, item);
+}
+
+void
+pipeline_emit(struct pipeline *p, int stage, void *item)
+{
+	if (stage + 1 >= p->n_stages)
+		errx(1, "%s is the last pipeline stage", p->stages[stage].name);
+
+	queue_push(&p->stages[stage + 1].queue, item);
+}
+
+void
+pipeline_finish(struct pipeline *p)
+{
+	int i, j;
+
+	if (p->n_stages > 0)
+		queue_close(&p->stages[0].queue);
+
+	for (i = 0; i < p->n_stages; i++)
+		for (j = 0; j < p->stages[i].workers; j++)
+			pthread_join(p->stages[i].threads[j], NULL);
+
+	p->elapsed = trace_now() - p->start;
+}
+
+void
+pipeline_free(struct pipeline *p)
+{
+	int i;
+
+	for (i = 0; i < p->n_stages; i++) {
+		queue_free(&p->stages[i].queue);
+		free(p->stages[i].threads);
+	}
+}
+
+void
+pipeline_print_stats(const struct pipeline *p, FILE *f)
+{
+	const struct stage *s;
+	uint64_t items, busy, pushes;
+	double seconds = p->elapsed / 1e9;
+	int i;
+
+	fprintf(f, "%-10s %7s %7s %10s %8s %10s %10s\n",
+		"stage", "workers", "items", "items/s", "busy%", "queue max", "queue avg");
+
+	for (i = 0; i < p->n_stages; i++) {
+		s = &p->stages[i];
+		items = atomic_load(&s->items);
+		busy = atomic_load(&s->busy_ns);
+		pushes = atomic_load(&s->queue.pushes);
+		fprintf(f, "%-10s %7d %7llu %10.1f %8.1f %10zu %10.1f\n", s->name, s->workers,
+			(unsigned long long)items,
+			seconds > 0 ? items / seconds : 0,
+			seconds > 0 ? 100.0 * busy / (p->elapsed * (double)s->workers) : 0,
+			atomic_load(&s->queue.max_depth),
+			pushes > 0 ? (double)atomic_load(&s->queue.depth_sum) / pushes : 0);
+	}
+}
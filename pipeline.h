@@ -0,0 +1,59 @@
+/**
+ * Serge Voilokov, 2015.
+ * Staged pipeline: worker threads per stage, bounded queues between stages.
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "queue.h"
+#include <pthread.h>
+#include <stdio.h>
+
+#define PIPELINE_MAX_STAGES 8
+#define PIPELINE_QUEUE_SIZE 64
+
+struct pipeline;
+
+/* handle one item, pass results on with pipeline_emit */
+typedef void (*stage_fn)(struct pipeline *p, int stage, void *item);
+
+struct stage
+{
+	const char *name;
+	int workers;
+	stage_fn fn;
+	struct queue queue;             /* items waiting for this stage */
+	pthread_t *threads;
+	atomic_int running;             /* last worker out closes next queue */
+	atomic_uint_fast64_t items;
+	atomic_uint_fast64_t busy_ns;   /* summed over workers */
+	struct pipeline *p;
+};
+
+struct pipeline
+{
+	int n_stages;
+	struct stage stages[PIPELINE_MAX_STAGES];
+	uint64_t start;
+	uint64_t elapsed;
+};
+
+void pipeline_init(struct pipeline *p);
+void pipeline_add_stage(struct pipeline *p, const char *name, int workers, stage_fn fn);
+void pipeline_start(struct pipeline *p);
+
+/* feed first stage; blocks while its queue is full */
+void pipeline_submit(struct pipeline *p, void *item);
+
+/* pass item from stage to the next one */
+void pipeline_emit(struct pipeline *p, int stage, void *item);
+
+/* no more input, wait for every stage to drain */
+void pipeline_finish(struct pipeline *p);
+void pipeline_free(struct pipeline *p);
+
+/* items, throughput, worker utilization and queue depth per stage */
+void pipeline_print_stats(const struct pipeline *p, FILE *f);
+
+#endif /* PIPELINE_H */
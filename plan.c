@@ -0,0 +1,167 @@
+/**
+ * Serge Voilokov, 2015.
+ * Fetch planner.
+ */
+
+#include "plan.h"
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct plan_request *
+add_request(struct plan *plan, bool by_zip)
+{
+	struct plan_request *req;
+
+	plan->requests = realloc(plan->requests, (plan->n_requests + 1) * sizeof(struct plan_request));
+	if (plan->requests == NULL)
+		err(1, "cannot allocate plan");
+
+	req = &plan->requests[plan->n_requests++];
+	req->by_zip = by_zip;
+	req->n_points = 0;
+	req->points = calloc(PLAN_MAX_POINTS, sizeof(struct plan_point));
+	if (req->points == NULL)
+		err(1, "cannot allocate plan points");
+
+	return req;
+}
+
+static void
+add_zip(struct plan_point *pt, int zip)
+{
+	pt->zips = realloc(pt->zips, (pt->n_zips + 1) * sizeof(int));
+	if (pt->zips == NULL)
+		err(1, "cannot allocate plan zips");
+
+	pt->zips[pt->n_zips++] = zip;
+}
+
+/* cur is index of request being filled; requests array moves on realloc */
+static struct plan_point *
+add_point(struct plan *plan, size_t *cur, bool by_zip)
+{
+	struct plan_request *req;
+
+	if (*cur == SIZE_MAX || plan->requests[*cur].n_points == PLAN_MAX_POINTS) {
+		add_request(plan, by_zip);
+		*cur = plan->n_requests - 1;
+	}
+
+	req = &plan->requests[*cur];
+
+	return &req->points[req->n_points++];
+}
+
+void
+plan_build(struct plan *plan, const struct zipdb *db, const int *zips, size_t n_zips)
+{
+	size_t i, j, r;
+	const struct zipdb_record *rec;
+	size_t cur = SIZE_MAX, unknown = SIZE_MAX;
+	struct plan_point *pt;
+
+	memset(plan, 0, sizeof(struct plan));
+
+	for (i = 0; i < n_zips; i++) {
+		rec = db != NULL ? zipdb_find(db, zips[i]) : NULL;
+
+		if (rec == NULL) {
+			pt = add_point(plan, &unknown, true);
+			add_zip(pt, zips[i]);
+			continue;
+		}
+
+		/* linear scan is fine: cells are few compared to fetch cost */
+		pt = NULL;
+		for (r = 0; r < plan->n_requests && pt == NULL; r++) {
+			if (plan->requests[r].by_zip)
+				continue;
+			for (j = 0; j < plan->requests[r].n_points; j++) {
+				struct plan_point *p = &plan->requests[r].points[j];
+				if (p->gx == rec->gx && p->gy == rec->gy) {
+					pt = p;
+					break;
+				}
+			}
+		}
+
+		if (pt == NULL) {
+			pt = add_point(plan, &cur, false);
+			pt->lat = rec->lat;
+			pt->lon = rec->lon;
+			pt->gx = rec->gx;
+			pt->gy = rec->gy;
+		}
+
+		add_zip(pt, zips[i]);
+	}
+}
+
+void
+plan_url(struct buf *url, const char *base, const struct plan_request *req, const char *params)
+{
+	size_t i;
+
+	buf_appendf(url, "%s", base != NULL ? base : NDFD_URL);
+
+	if (req->by_zip) {
+		buf_appendf(url, "whichClient=NDFDgenMultiZipCode&zipCodeList=");
+		for (i = 0; i < req->n_points; i++)
+			buf_appendf(url, "%s%05d", i > 0 ? "+" : "", req->points[i].zips[0]);
+	} else {
+		buf_appendf(url, "whichClient=NDFDgenLatLonList&listLatLon=");
+		for (i = 0; i < req->n_points; i++)
+			buf_appendf(url, "%s%.4f,%.4f", i > 0 ? "+" : "", req->points[i].lat, req->points[i].lon);
+	}
+
+	buf_appendf(url, "%s", params);
+}
+
+/* NDFD element of each field, in order of the former fixed element list */
+static const struct {
+	unsigned field;
+	const char *element;
+} elements[] = {
+	{ DWML_FIELD(COLUMN_TEMP_MAX),      "maxt" },
+	{ DWML_FIELD(COLUMN_TEMP_MIN),      "mint" },
+	{ DWML_FIELD(COLUMN_TEMP_HOURLY),   "temp" },
+	{ DWML_FIELD(COLUMN_SNOW_AMOUNT),   "snow" },
+	{ DWML_FIELD(COLUMN_WIND_SPEED),    "wspd" },
+	{ DWML_FIELD(COLUMN_WIND_DIR),      "wdir" },
+	{ DWML_FIELD(COLUMN_CLOUD_AMOUNT),  "sky" },
+	{ DWML_FIELD_WEATHER,               "wx" },
+	{ DWML_FIELD(COLUMN_HUMIDITY),      "rh" },
+	{ DWML_FIELD(COLUMN_TEMP_APPARENT), "appt" },
+	{ DWML_FIELD_HAZARDS,               "wwa" }
+};
+
+void
+plan_params(struct buf *params, unsigned fields)
+{
+	size_t i;
+
+	buf_appendf(params, "&product=time-series&Unit=m");
+
+	for (i = 0; i < sizeof(elements) / sizeof(elements[0]); i++)
+		if (fields & elements[i].field)
+			buf_appendf(params, "&%s=%s", elements[i].element, elements[i].element);
+
+	buf_appendf(params, "&Submit=Submit");
+}
+
+void
+plan_free(struct plan *plan)
+{
+	size_t i, j;
+
+	for (i = 0; i < plan->n_requests; i++) {
+		for (j = 0; j < plan->requests[i].n_points; j++)
+			free(plan->requests[i].points[j].zips);
+		free(plan->requests[i].points);
+	}
+
+	free(plan->requests);
+	memset(plan, 0, sizeof(struct plan));
+}
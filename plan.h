@@ -0,0 +1,58 @@
+/**
+ * Serge Voilokov, 2015.
+ * Fetch planner: collapse zips sharing NDFD grid cell into one point.
+ */
+
+#ifndef PLAN_H
+#define PLAN_H
+
+#include "dwml.h"
+#include "zipdb.h"
+#include "common/struct.h"
+#include <stdbool.h>
+
+#define NDFD_URL "http://graphical.weather.gov/xml/sample_products/browser_interface/ndfdXMLclient.php?"
+
+/* NDFD rejects longer point lists */
+#define PLAN_MAX_POINTS 200
+
+/* one forecast point of request, fanned out to all zips in its cell */
+struct plan_point
+{
+	double lat;
+	double lon;
+	int gx;
+	int gy;
+	size_t n_zips;
+	int *zips;
+};
+
+/* one upstream request; points come back in the same order */
+struct plan_request
+{
+	bool by_zip;                /* NDFDgenMultiZipCode for zips missing in zipdb */
+	size_t n_points;
+	struct plan_point *points;
+};
+
+struct plan
+{
+	size_t n_requests;
+	struct plan_request *requests;
+};
+
+/* group zips by grid cell; db may be NULL, then every zip is its own point */
+void plan_build(struct plan *plan, const struct zipdb *db, const int *zips, size_t n_zips);
+
+/*
+ * Request url with element list params, i.e. "&product=time-series&temp=temp".
+ * base is NDFD_URL when NULL, or a local stand-in ending with '?'.
+ */
+void plan_url(struct buf *url, const char *base, const struct plan_request *req, const char *params);
+
+/* element list params requesting only DWML_FIELD bits of fields */
+void plan_params(struct buf *params, unsigned fields);
+
+void plan_free(struct plan *plan);
+
+#endif /* PLAN_H */
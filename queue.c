@@ -0,0 +1,235 @@
+/**
+ * Serge Voilokov, 2015.
+ * Bounded lock-free multi-producer multi-consumer queue.
+ *
+ * Every cell has a sequence number telling producers and consumers whose
+ * turn it is, so a push or pop is one compare-and-swap on head or tail.
+ * Waiters that spun without luck park on a condition variable; the other
+ * side takes the lock only when someone is parked.
+ */
+
+#include "queue.h"
+#include <err.h>
+#include <sched.h>
+#include <stdlib.h>
+
+void
+queue_init(struct queue *q, size_t size)
+{
+	size_t i, n = 2;
+
+	while (n < size)
+		n *= 2;
+
+	q->cells = calloc(n, sizeof(struct queue_cell));
+	if (q->cells == NULL)
+		err(1, "cannot allocate queue");
+
+	for (i = 0; i < n; i++)
+		atomic_init(&q->cells[i].seq, i);
+
+	q->mask = n - 1;
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	atomic_init(&q->closed, false);
+	atomic_init(&q->pop_waiters, 0);
+	atomic_init(&q->push_waiters, 0);
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->not_empty, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+	atomic_init(&q->max_depth, 0);
+	atomic_init(&q->depth_sum, 0);
+	atomic_init(&q->pushes, 0);
+}
+
+void
+queue_free(struct queue *q)
+{
+	free(q->cells);
+	q->cells = NULL;
+	pthread_cond_destroy(&q->not_full);
+	pthread_cond_destroy(&q->not_empty);
+	pthread_mutex_destroy(&q->lock);
+}
+
+bool
+queue_try_push(struct queue *q, void *item)
+{
+	struct queue_cell *cell;
+	size_t pos, seq;
+	intptr_t diff;
+
+	pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+	for (;;) {
+		cell = &q->cells[pos & q->mask];
+		seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+								  memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+		}
+	}
+
+	cell->item = item;
+	atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+
+	return true;
+}
+
+bool
+queue_try_pop(struct queue *q, void **item)
+{
+	struct queue_cell *cell;
+	size_t pos, seq;
+	intptr_t diff;
+
+	pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	for (;;) {
+		cell = &q->cells[pos & q->mask];
+		seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		diff = (intptr_t)seq - (intptr_t)(pos + 1);
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+								  memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+		}
+	}
+
+	*item = cell->item;
+	atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+
+	return true;
+}
+
+/* spin briefly, then yield; false once it is time to park */
+static bool
+backoff(unsigned *n)
+{
+	if (++*n < 16)
+		return true;
+	if (*n < 64) {
+		sched_yield();
+		return true;
+	}
+	return false;
+}
+
+/* wake parked threads; fence pairs with the one in park */
+static void
+wake(struct queue *q, atomic_int *waiters, pthread_cond_t *cond)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(waiters, memory_order_relaxed) == 0)
+		return;
+
+	pthread_mutex_lock(&q->lock);
+	pthread_cond_broadcast(cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+void
+queue_push(struct queue *q, void *item)
+{
+	size_t depth, max;
+	unsigned n = 0;
+
+	while (!queue_try_push(q, item)) {
+		if (backoff(&n))
+			continue;
+		pthread_mutex_lock(&q->lock);
+		atomic_fetch_add(&q->push_waiters, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		while (!queue_try_push(q, item))
+			pthread_cond_wait(&q->not_full, &q->lock);
+		atomic_fetch_sub(&q->push_waiters, 1);
+		pthread_mutex_unlock(&q->lock);
+		break;
+	}
+	wake(q, &q->pop_waiters, &q->not_empty);
+
+	depth = queue_depth(q);
+	max = atomic_load_explicit(&q->max_depth, memory_order_relaxed);
+	while (depth > max && !atomic_compare_exchange_weak(&q->max_depth, &max, depth))
+		;
+	atomic_fetch_add_explicit(&q->depth_sum, depth, memory_order_relaxed);
+	atomic_fetch_add_explicit(&q->pushes, 1, memory_order_relaxed);
+}
+
+/* under lock, recheck after announcing so a push in between is not missed */
+static bool
+park_pop(struct queue *q, void **item)
+{
+	bool res;
+
+	pthread_mutex_lock(&q->lock);
+	atomic_fetch_add(&q->pop_waiters, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+	for (;;) {
+		if ((res = queue_try_pop(q, item)))
+			break;
+		if (atomic_load(&q->closed)) {
+			res = queue_try_pop(q, item);
+			break;
+		}
+		pthread_cond_wait(&q->not_empty, &q->lock);
+	}
+	atomic_fetch_sub(&q->pop_waiters, 1);
+	pthread_mutex_unlock(&q->lock);
+
+	return res;
+}
+
+bool
+queue_pop(struct queue *q, void **item)
+{
+	unsigned n = 0;
+	bool res;
+
+	for (;;) {
+		if (queue_try_pop(q, item)) {
+			res = true;
+			break;
+		}
+		/* pushes happen before close, look once more after seeing it */
+		if (atomic_load(&q->closed)) {
+			res = queue_try_pop(q, item);
+			break;
+		}
+		if (!backoff(&n)) {
+			res = park_pop(q, item);
+			break;
+		}
+	}
+
+	if (res)
+		wake(q, &q->push_waiters, &q->not_full);
+
+	return res;
+}
+
+void
+queue_close(struct queue *q)
+{
+	atomic_store(&q->closed, true);
+	pthread_mutex_lock(&q->lock);
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+size_t
+queue_depth(struct queue *q)
+{
+	size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+	return head > tail ? head - tail : 0;
+}
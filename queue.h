@@ -0,0 +1,58 @@
+/**
+ * Serge Voilokov, 2015.
+ * Bounded lock-free multi-producer multi-consumer queue.
+ */
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_LINE 64
+
+struct queue_cell
+{
+	atomic_size_t seq;
+	void *item;
+};
+
+/* Dmitry Vyukov's bounded MPMC queue, positions on separate cache lines */
+struct queue
+{
+	struct queue_cell *cells;
+	size_t mask;
+	_Alignas(CACHE_LINE) atomic_size_t head;    /* next position to push */
+	_Alignas(CACHE_LINE) atomic_size_t tail;    /* next position to pop */
+	_Alignas(CACHE_LINE) atomic_bool closed;
+	_Alignas(CACHE_LINE) atomic_int pop_waiters;    /* parked on empty queue */
+	atomic_int push_waiters;                    /* parked on full queue */
+	pthread_mutex_t lock;                       /* only for parking */
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	atomic_size_t max_depth;
+	atomic_uint_fast64_t depth_sum;             /* depth seen by each push */
+	atomic_uint_fast64_t pushes;
+};
+
+/* size is rounded up to power of two */
+void queue_init(struct queue *q, size_t size);
+void queue_free(struct queue *q);
+
+/* false if queue is full or empty */
+bool queue_try_push(struct queue *q, void *item);
+bool queue_try_pop(struct queue *q, void **item);
+
+/* spin briefly, then park while full or empty; pop returns false when closed and drained */
+void queue_push(struct queue *q, void *item);
+bool queue_pop(struct queue *q, void **item);
+
+/* no more pushes, consumers drain and stop */
+void queue_close(struct queue *q);
+
+size_t queue_depth(struct queue *q);
+
+#endif /* QUEUE_H */
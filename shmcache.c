@@ -0,0 +1,340 @@
+/**
+ * Serge Voilokov, 2015.
+ * Rendered forecasts in POSIX shared memory, seqlock per slot.
+ */
+
+#include "shmcache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* readers give up on a slot rewritten this many times under them */
+#define MAX_RETRIES 1000
+
+static size_t
+segment_size(uint32_t n_slots)
+{
+	return SHMCACHE_SLOT_SIZE + (size_t)n_slots * SHMCACHE_SLOT_SIZE;
+}
+
+/* header takes first slot, so slots stay page aligned */
+static struct shmcache_slot *
+get_slot(const struct shmcache *c, size_t i)
+{
+	return (struct shmcache_slot *)((char *)c->map + SHMCACHE_SLOT_SIZE + i * SHMCACHE_SLOT_SIZE);
+}
+
+static bool
+valid_header(const struct shmcache_header *h, size_t size)
+{
+	/* magic is written last by creator */
+	atomic_thread_fence(memory_order_acquire);
+
+	return memcmp(h->magic, SHMCACHE_MAGIC, sizeof(h->magic)) == 0 &&
+	       h->version == SHMCACHE_VERSION && h->slot_size == SHMCACHE_SLOT_SIZE &&
+	       h->n_slots > 0 && segment_size(h->n_slots) == size;
+}
+
+static int
+create_segment(struct shmcache *c, int fd, uint32_t n_slots)
+{
+	struct shmcache_header h = { .version = SHMCACHE_VERSION, .n_slots = n_slots,
+				     .slot_size = SHMCACHE_SLOT_SIZE };
+
+	c->map_size = segment_size(n_slots);
+	if (ftruncate(fd, c->map_size) != 0)
+		return -1;
+
+#ifndef __APPLE__
+	/* tmpfs too small for table fails here, not with SIGBUS in a writer */
+	errno = posix_fallocate(fd, 0, c->map_size);
+	if (errno != 0)
+		return -1;
+#endif
+
+	c->map = mmap(NULL, c->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (c->map == MAP_FAILED)
+		return -1;
+
+	c->header = c->map;
+	memcpy(c->header, &h, sizeof(h));
+	atomic_thread_fence(memory_order_release);
+	memcpy(c->header->magic, SHMCACHE_MAGIC, sizeof(h.magic));
+
+	return 0;
+}
+
+/* segment of another process, which may still be creating it */
+static int
+map_segment(struct shmcache *c, int fd, bool writer)
+{
+	struct stat st;
+	int i;
+
+	for (i = 0; i < 100; i++) {
+		if (fstat(fd, &st) != 0)
+			return -1;
+
+		if (st.st_size >= SHMCACHE_SLOT_SIZE) {
+			c->map_size = st.st_size;
+			c->map = mmap(NULL, c->map_size, writer ? PROT_READ | PROT_WRITE : PROT_READ,
+				      MAP_SHARED, fd, 0);
+			if (c->map == MAP_FAILED)
+				return -1;
+			c->header = c->map;
+			if (valid_header(c->header, c->map_size))
+				return 0;
+			munmap(c->map, c->map_size);
+		}
+
+		usleep(1000);
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+int
+shmcache_open(struct shmcache *c, const char *name, bool writer, uint32_t n_slots)
+{
+	int fd, res, saved;
+
+	memset(c, 0, sizeof(*c));
+
+	if (writer) {
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+		if (fd != -1) {
+			res = create_segment(c, fd, n_slots > 0 ? n_slots : SHMCACHE_DEFAULT_SLOTS);
+			if (res != 0)
+				shm_unlink(name);
+			goto done;
+		}
+		if (errno != EEXIST)
+			return -1;
+	}
+
+	fd = shm_open(name, writer ? O_RDWR : O_RDONLY, 0);
+	if (fd == -1)
+		return -1;
+
+	res = map_segment(c, fd, writer);
+
+done:
+	saved = errno;
+	close(fd);
+	errno = saved;
+
+	if (res != 0)
+		memset(c, 0, sizeof(*c));
+
+	return res;
+}
+
+uint32_t
+shmcache_slots(const struct shmcache *c)
+{
+	return c->header != NULL ? c->header->n_slots : 0;
+}
+
+void
+shmcache_close(struct shmcache *c)
+{
+	if (c->map != NULL)
+		munmap(c->map, c->map_size);
+
+	memset(c, 0, sizeof(*c));
+}
+
+/* slot of zip; writer claims free slot for it, NULL if table is full */
+static struct shmcache_slot *
+probe(struct shmcache *c, int zip, bool claim)
+{
+	struct shmcache_slot *s;
+	uint32_t i, n;
+	int z;
+
+	i = (uint32_t)zip * 2654435761u % c->header->n_slots;
+	for (n = 0; n < c->header->n_slots; n++, i = (i + 1) % c->header->n_slots) {
+		s = get_slot(c, i);
+		z = atomic_load_explicit(&s->zip, memory_order_acquire);
+		if (z == zip)
+			return s;
+		if (z != 0)
+			continue;
+		if (!claim)
+			return NULL;
+		/* another writer may claim it first, for the same zip or other one */
+		if (atomic_compare_exchange_strong(&s->zip, &z, zip) || z == zip)
+			return s;
+	}
+
+	return NULL;
+}
+
+/* slot put longest ago; put is read unlocked, it is only a hint */
+static struct shmcache_slot *
+oldest(struct shmcache *c)
+{
+	struct shmcache_slot *s, *best = NULL;
+	uint32_t i, now = atomic_load_explicit(&c->header->clock, memory_order_relaxed);
+
+	/* age survives wrap around of clock */
+	for (i = 0; i < c->header->n_slots; i++) {
+		s = get_slot(c, i);
+		if (best == NULL || now - s->put > now - best->put)
+			best = s;
+	}
+
+	return best;
+}
+
+/* take over lock of a writer killed mid-copy; pid is cleared on unlock, so it is never stale */
+static bool
+take_over(struct shmcache_slot *s, unsigned *seq)
+{
+	int pid = atomic_load(&s->writer);
+
+	if (pid <= 0 || kill(pid, 0) == 0 || errno != ESRCH)
+		return false;
+
+	if (!atomic_compare_exchange_strong(&s->writer, &pid, getpid()))
+		return false;
+
+	/* seq stays odd, readers holding the old value retry */
+	*seq = atomic_load(&s->seq) + 2;
+	atomic_store(&s->seq, *seq);
+
+	return true;
+}
+
+/* odd seq also locks out other writers of the slot */
+static int
+lock_slot(struct shmcache_slot *s, unsigned *seq)
+{
+	int i;
+
+	for (i = 0; ; i++) {
+		*seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+		if ((*seq & 1) == 0 && atomic_compare_exchange_weak_explicit(&s->seq, seq, *seq + 1,
+				memory_order_acquire, memory_order_relaxed)) {
+			(*seq)++;
+			atomic_store_explicit(&s->writer, getpid(), memory_order_relaxed);
+			break;
+		}
+		if ((*seq & 1) && i >= MAX_RETRIES && take_over(s, seq))
+			break;
+		if (i == 2 * MAX_RETRIES)
+			return -1;
+		sched_yield();
+	}
+	atomic_thread_fence(memory_order_release);
+
+	return 0;
+}
+
+static void
+unlock_slot(struct shmcache_slot *s, unsigned seq)
+{
+	atomic_store_explicit(&s->writer, 0, memory_order_relaxed);
+	atomic_store_explicit(&s->seq, seq + 1, memory_order_release);
+}
+
+int
+shmcache_put(struct shmcache *c, int zip, time_t creation_date, const char *html, size_t html_len,
+	     const char *bin, size_t bin_len)
+{
+	struct shmcache_slot *s;
+	unsigned seq;
+	bool evict;
+	int i;
+
+	if (zip <= 0 || html_len + bin_len > SHMCACHE_DATA_SIZE)
+		return -1;
+
+	/* slot may be taken over for another zip between probe and lock */
+	for (i = 0; ; i++) {
+		if (i == MAX_RETRIES)
+			return -1;
+
+		s = probe(c, zip, true);
+		evict = s == NULL;
+		if (evict)
+			s = oldest(c);
+
+		if (lock_slot(s, &seq) != 0)
+			return -1;
+
+		/* evicted slot keeps its place in probe chains of other zips */
+		if (evict)
+			atomic_store_explicit(&s->zip, zip, memory_order_relaxed);
+		else if (atomic_load_explicit(&s->zip, memory_order_relaxed) != zip) {
+			unlock_slot(s, seq);
+			continue;
+		}
+		break;
+	}
+
+	s->put = atomic_fetch_add_explicit(&c->header->clock, 1, memory_order_relaxed);
+	s->creation_date = creation_date;
+	s->stored = time(NULL);
+	s->html_len = html_len;
+	s->bin_len = bin_len;
+	memcpy(s->data, html, html_len);
+	memcpy(s->data + html_len, bin, bin_len);
+
+	unlock_slot(s, seq);
+
+	return 0;
+}
+
+int
+shmcache_get(struct shmcache *c, int zip, struct shmcache_entry *e)
+{
+	struct shmcache_slot *s;
+	unsigned seq;
+	size_t len;
+	int i;
+
+	if (c->header == NULL || zip <= 0)
+		return -1;
+
+	s = probe(c, zip, false);
+	if (s == NULL)
+		return -1;
+
+	for (i = 0; i < MAX_RETRIES; i++) {
+		seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+
+		/* claimed, not written yet */
+		if (seq == 0)
+			return -1;
+
+		e->zip = atomic_load_explicit(&s->zip, memory_order_relaxed);
+		e->creation_date = s->creation_date;
+		e->stored = s->stored;
+		e->html_len = s->html_len;
+		e->bin_len = s->bin_len;
+
+		/* lengths may be torn too, bound copy before checking seq */
+		len = e->html_len + e->bin_len;
+		if (len > SHMCACHE_DATA_SIZE)
+			len = SHMCACHE_DATA_SIZE;
+		memcpy(e->data, s->data, len);
+
+		/* slot taken over for another zip */
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&s->seq, memory_order_relaxed) == seq)
+			return e->zip == zip ? 0 : -1;
+	}
+
+	return -1;
+}
@@ -0,0 +1,94 @@
+/**
+ * Serge Voilokov, 2015.
+ * Rendered forecasts in POSIX shared memory, shared by weather and weatherui.
+ */
+
+#ifndef SHMCACHE_H
+#define SHMCACHE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define SHMCACHE_MAGIC "WXSHM01"
+#define SHMCACHE_VERSION 3
+#define SHMCACHE_DEFAULT_NAME "/weather-forecasts"
+#define SHMCACHE_DEFAULT_SLOTS 1024    /* 64 MB */
+#define SHMCACHE_MAX_SLOTS 4096        /* 256 MB */
+#define SHMCACHE_SLOT_SIZE (64 << 10)  /* bytes */
+
+struct shmcache_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t n_slots;       /* open addressing table, probed linearly from zip */
+	uint32_t slot_size;
+	atomic_uint clock;      /* counts puts, orders slots by age */
+};
+
+/*
+ * Fixed size slot of one zip, written under seqlock: seq is odd while a
+ * writer copies data in, readers retry when it changed under them.
+ * Slots are never released, so probe chains stay intact. Once every slot
+ * is claimed, the one stored longest ago is taken over for a new zip
+ * under its lock, and readers check zip of the copy they made.
+ * A writer killed mid-copy leaves seq odd: readers give up on the slot
+ * and the next writer of the zip takes it over once that pid is gone.
+ * One killed right between locking and storing its pid wedges the slot
+ * until the segment is removed.
+ */
+struct shmcache_slot
+{
+	atomic_uint seq;
+	atomic_int zip;
+	atomic_int writer;      /* pid holding odd seq, 0 when unlocked */
+	uint32_t put;           /* clock of last put */
+	int64_t creation_date;  /* of NDFD document */
+	int64_t stored;         /* when the slot was written */
+	uint32_t html_len;
+	uint32_t bin_len;
+	char data[];            /* html table, then binary forecast */
+};
+
+#define SHMCACHE_DATA_SIZE (SHMCACHE_SLOT_SIZE - sizeof(struct shmcache_slot))
+
+/* consistent copy of slot */
+struct shmcache_entry
+{
+	int zip;
+	time_t creation_date;
+	time_t stored;
+	size_t html_len;
+	size_t bin_len;
+	char data[SHMCACHE_DATA_SIZE];
+};
+
+struct shmcache
+{
+	void *map;
+	size_t map_size;
+	struct shmcache_header *header;
+};
+
+/*
+ * Map segment; writer creates it with n_slots if missing, reader maps it
+ * read only. An existing segment keeps its size, see shmcache_slots.
+ * Creating it allocates all of n_slots * SHMCACHE_SLOT_SIZE bytes of
+ * /dev/shm up front, so it fails when tmpfs is too small.
+ */
+int shmcache_open(struct shmcache *c, const char *name, bool writer, uint32_t n_slots);
+void shmcache_close(struct shmcache *c);
+
+/* table size of mapped segment */
+uint32_t shmcache_slots(const struct shmcache *c);
+
+/* store html table and binary forecast of zip; -1 if they do not fit or slot stays busy */
+int shmcache_put(struct shmcache *c, int zip, time_t creation_date, const char *html, size_t html_len,
+		 const char *bin, size_t bin_len);
+
+/* copy slot of zip into entry; -1 if there is none or writer keeps it busy */
+int shmcache_get(struct shmcache *c, int zip, struct shmcache_entry *e);
+
+#endif /* SHMCACHE_H */
@@ -0,0 +1,190 @@
+/**
+ * Serge Voilokov, 2015.
+ * Stage timings and trace-event output.
+ */
+
+#include "trace.h"
+#include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+struct span
+{
+	const char *name;   /* static stage name */
+	int zip;
+	int tid;
+	uint64_t start;
+	uint64_t duration;
+	size_t bytes;
+};
+
+static bool enabled;
+static struct span *spans;
+static size_t n_spans;
+static size_t cap_spans;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int next_tid;
+static __thread int tid;
+
+/* wall clock at trace_now() == 0, converts monotonic times to epoch microseconds */
+static uint64_t epoch_offset_us;
+
+void
+trace_enable()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	epoch_offset_us = ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec - trace_now()) / 1000;
+	enabled = true;
+}
+
+uint64_t
+trace_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+trace_span(const char *name, int zip, uint64_t start, size_t bytes)
+{
+	uint64_t end;
+
+	if (!enabled)
+		return;
+
+	end = trace_now();
+
+	pthread_mutex_lock(&lock);
+
+	if (tid == 0)
+		tid = ++next_tid;
+
+	if (n_spans == cap_spans) {
+		cap_spans = cap_spans == 0 ? 64 : cap_spans * 2;
+		spans = realloc(spans, cap_spans * sizeof(struct span));
+		if (spans == NULL)
+			err(1, "cannot allocate trace spans");
+	}
+
+	spans[n_spans++] = (struct span) {
+		.name = name,
+		.zip = zip,
+		.tid = tid,
+		.start = start,
+		.duration = end - start,
+		.bytes = bytes
+	};
+
+	pthread_mutex_unlock(&lock);
+}
+
+/* stage names are few, open addressing table of them keyed by name hash */
+#define MAX_STAGES 64
+
+struct stage_total
+{
+	const char *name;
+	size_t count;
+	uint64_t total;
+	uint64_t max;
+	size_t bytes;
+};
+
+static unsigned
+name_hash(const char *s)
+{
+	unsigned h = 2166136261u;
+
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+
+	return h;
+}
+
+void
+trace_print_stats(FILE *f)
+{
+	struct stage_total table[MAX_STAGES], *t;
+	struct stage_total *order[MAX_STAGES];
+	size_t i, n = 0;
+	unsigned h;
+
+	memset(table, 0, sizeof(table));
+
+	for (i = 0; i < n_spans; i++) {
+		h = name_hash(spans[i].name) % MAX_STAGES;
+		while (table[h].name != NULL && strcmp(table[h].name, spans[i].name) != 0)
+			h = (h + 1) % MAX_STAGES;
+
+		t = &table[h];
+		if (t->name == NULL) {
+			/* full table, rest of stages are not shown */
+			if (n == MAX_STAGES - 1)
+				continue;
+			t->name = spans[i].name;
+			order[n++] = t;
+		}
+
+		t->count++;
+		t->total += spans[i].duration;
+		t->bytes += spans[i].bytes;
+		if (spans[i].duration > t->max)
+			t->max = spans[i].duration;
+	}
+
+	fprintf(f, "%-10s %6s %12s %12s %12s\n", "stage", "count", "total,ms", "max,ms", "bytes");
+
+	/* stages in order of first appearance */
+	for (i = 0; i < n; i++)
+		fprintf(f, "%-10s %6zu %12.3f %12.3f %12zu\n", order[i]->name, order[i]->count,
+			order[i]->total / 1e6, order[i]->max / 1e6, order[i]->bytes);
+}
+
+void
+trace_write(const char *fname)
+{
+	size_t i;
+	int fd;
+	struct stat st;
+	FILE *f;
+
+	fd = open(fname, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd < 0)
+		err(1, "cannot open trace file %s", fname);
+
+	/* concurrent batch runs append to the same file */
+	flock(fd, LOCK_EX);
+
+	f = fdopen(fd, "a");
+	if (f == NULL)
+		err(1, "cannot open trace file %s", fname);
+
+	if (fstat(fd, &st) == 0 && st.st_size == 0)
+		fprintf(f, "[\n");
+
+	for (i = 0; i < n_spans; i++) {
+		fprintf(f, "{\"name\":\"%s\",\"cat\":\"weather\",\"ph\":\"X\","
+			"\"ts\":%llu,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+			"\"args\":{\"zip\":\"%05d\",\"bytes\":%zu}},\n",
+			spans[i].name,
+			(unsigned long long)(epoch_offset_us + spans[i].start / 1000),
+			spans[i].duration / 1e3, getpid(), spans[i].tid,
+			spans[i].zip, spans[i].bytes);
+	}
+
+	fflush(f);
+	flock(fd, LOCK_UN);
+	fclose(f);
+}
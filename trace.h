@@ -0,0 +1,30 @@
+/**
+ * Serge Voilokov, 2015.
+ * Stage timings for --stats and Chrome trace-event output for --trace.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* start collecting spans */
+void trace_enable();
+
+/* monotonic clock, nanoseconds */
+uint64_t trace_now();
+
+/* record span from start till now; bytes is the amount of data processed */
+void trace_span(const char *name, int zip, uint64_t start, size_t bytes);
+
+/* per stage totals */
+void trace_print_stats(FILE *f);
+
+/*
+ * Append spans to fname in trace-event JSON array format. The closing
+ * bracket is optional in this format, so batch runs can share one file.
+ */
+void trace_write(const char *fname);
+
+#endif /* TRACE_H */
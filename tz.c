@@ -0,0 +1,525 @@
+/**
+ * Serge Voilokov, 2015.
+ * Time zones as precomputed UTC offset transition tables.
+ *
+ * Zones are read from TZif files. Transitions after the last one stored
+ * in the file are generated from the POSIX rule in the file footer up to
+ * TZ_LAST_YEAR, so a lookup is a binary search and a conversion is plain
+ * arithmetic without the global lock of localtime_r.
+ */
+
+#include "tz.h"
+#include <ctype.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ZONEINFO_DIR "/usr/share/zoneinfo"
+#define TZ_LAST_YEAR 2100
+
+/* POSIX TZ rule, only Mm.w.d form used in US */
+struct rule
+{
+	int32_t std_offset;
+	int32_t dst_offset;
+	bool has_dst;
+	int month[2], week[2], day[2];
+	int32_t time[2];        /* local time of start and end of dst */
+};
+
+static pthread_mutex_t zones_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tz **zones;
+static size_t n_zones;
+
+/* in order of preference when offsets match several zones */
+static const char *us_zones[] = {
+	"America/New_York",
+	"America/Chicago",
+	"America/Denver",
+	"America/Phoenix",
+	"America/Los_Angeles",
+	"America/Anchorage",
+	"Pacific/Honolulu",
+	"America/Adak",
+	"America/Puerto_Rico",
+	"Pacific/Guam",
+	"Pacific/Pago_Pago",
+	NULL
+};
+
+/* ===== calendar ==================== */
+
+/* days since 1970-01-01 of proleptic gregorian date, month is 1..12 */
+static int64_t
+days_from_civil(int64_t y, unsigned m, unsigned d)
+{
+	int64_t era;
+	unsigned yoe, doy, doe;
+
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = (unsigned)(y - era * 400);
+	doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+	return era * 146097 + (int64_t)doe - 719468;
+}
+
+static void
+civil_from_days(int64_t z, int *year, unsigned *month, unsigned *day)
+{
+	int64_t era;
+	unsigned doe, yoe, doy, mp;
+
+	z += 719468;
+	era = (z >= 0 ? z : z - 146096) / 146097;
+	doe = (unsigned)(z - era * 146097);
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	*day = doy - (153 * mp + 2) / 5 + 1;
+	*month = mp < 10 ? mp + 3 : mp - 9;
+	*year = (int)(yoe + era * 400 + (*month <= 2));
+}
+
+static int64_t
+floor_div(int64_t a, int64_t b)
+{
+	return a / b - (a % b < 0);
+}
+
+time_t
+tz_timegm(int year, int mon, int mday, int hour, int min, int sec)
+{
+	return days_from_civil(year, mon, mday) * 86400 + hour * 3600 + min * 60 + sec;
+}
+
+/* ===== lookup ====================== */
+
+/* index of first transition after t */
+static size_t
+find_transition(const struct tz *tz, time_t t)
+{
+	size_t lo = 0, hi = tz->n, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (tz->at[mid] <= t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+int32_t
+tz_offset(const struct tz *tz, time_t t)
+{
+	size_t i = find_transition(tz, t);
+
+	return i == 0 ? tz->std_offset : tz->offset[i - 1];
+}
+
+static bool
+is_dst(const struct tz *tz, time_t t)
+{
+	size_t i = find_transition(tz, t);
+
+	return i > 0 && tz->isdst[i - 1];
+}
+
+void
+tz_localtime(const struct tz *tz, time_t t, struct tm *tm)
+{
+	size_t i = find_transition(tz, t);
+	int32_t offset = i == 0 ? tz->std_offset : tz->offset[i - 1];
+	int64_t local = (int64_t)t + offset;
+	int64_t days = floor_div(local, 86400);
+	int secs = local - days * 86400;
+	unsigned month, day;
+	int year;
+
+	civil_from_days(days, &year, &month, &day);
+
+	memset(tm, 0, sizeof(*tm));
+	tm->tm_year = year - 1900;
+	tm->tm_mon = month - 1;
+	tm->tm_mday = day;
+	tm->tm_hour = secs / 3600;
+	tm->tm_min = secs / 60 % 60;
+	tm->tm_sec = secs % 60;
+	tm->tm_wday = (int)(days + 4 - floor_div(days + 4, 7) * 7);   /* 1970-01-01 is Thursday */
+	tm->tm_yday = days - days_from_civil(year, 1, 1);
+	tm->tm_isdst = i > 0 && tz->isdst[i - 1];
+	tm->tm_gmtoff = offset;
+	tm->tm_zone = tz->name;
+}
+
+/* ===== loading ===================== */
+
+static void
+add_transition(struct tz *tz, int64_t at, int32_t offset, bool isdst)
+{
+	if ((tz->n & (tz->n - 1)) == 0) {
+		size_t cap = tz->n == 0 ? 16 : tz->n * 2;
+		tz->at = realloc(tz->at, cap * sizeof(int64_t));
+		tz->offset = realloc(tz->offset, cap * sizeof(int32_t));
+		tz->isdst = realloc(tz->isdst, cap);
+		if (tz->at == NULL || tz->offset == NULL || tz->isdst == NULL)
+			err(1, "cannot allocate zone transitions");
+	}
+
+	tz->at[tz->n] = at;
+	tz->offset[tz->n] = offset;
+	tz->isdst[tz->n] = isdst;
+	tz->n++;
+}
+
+static int64_t
+be(const uint8_t *p, int size)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < size; i++)
+		v = v << 8 | p[i];
+
+	/* sign extend */
+	if (size < 8 && (v & (1ULL << (size * 8 - 1))))
+		v |= ~0ULL << (size * 8);
+
+	return (int64_t)v;
+}
+
+static const char *
+parse_name(const char *s)
+{
+	if (*s == '<') {
+		s = strchr(s, '>');
+		return s != NULL ? s + 1 : NULL;
+	}
+
+	while (isalpha((unsigned char)*s))
+		s++;
+
+	return s;
+}
+
+/* [+-]hh[:mm[:ss]] in seconds */
+static const char *
+parse_hms(const char *s, int32_t *secs)
+{
+	int sign = 1, h = 0, m = 0, sec = 0, n = 0;
+
+	if (*s == '+' || *s == '-')
+		sign = *s++ == '-' ? -1 : 1;
+
+	if (sscanf(s, "%d%n:%d%n:%d%n", &h, &n, &m, &n, &sec, &n) < 1)
+		return NULL;
+
+	*secs = sign * (h * 3600 + m * 60 + sec);
+
+	return s + n;
+}
+
+static const char *
+parse_date(const char *s, struct rule *r, int i)
+{
+	int n = 0;
+
+	if (sscanf(s, ",M%d.%d.%d%n", &r->month[i], &r->week[i], &r->day[i], &n) != 3 || n == 0)
+		return NULL;
+	s += n;
+
+	r->time[i] = 7200;
+	if (*s == '/')
+		s = parse_hms(s + 1, &r->time[i]);
+
+	return s;
+}
+
+/* EST5EDT,M3.2.0,M11.1.0 */
+static int
+parse_rule(const char *s, struct rule *r)
+{
+	int32_t secs;
+
+	memset(r, 0, sizeof(*r));
+
+	if ((s = parse_name(s)) == NULL || (s = parse_hms(s, &secs)) == NULL)
+		return -1;
+	r->std_offset = -secs;
+
+	if (*s == 0 || *s == '\n')
+		return 0;
+
+	if ((s = parse_name(s)) == NULL)
+		return -1;
+
+	r->dst_offset = r->std_offset + 3600;
+	if (*s != ',' && *s != 0 && *s != '\n') {
+		if ((s = parse_hms(s, &secs)) == NULL)
+			return -1;
+		r->dst_offset = -secs;
+	}
+
+	if ((s = parse_date(s, r, 0)) == NULL || (s = parse_date(s, r, 1)) == NULL)
+		return -1;
+
+	r->has_dst = true;
+
+	return 0;
+}
+
+/* utc time of d-th weekday of week w (5 is last) in month m at local time */
+static int64_t
+rule_time(int year, int m, int w, int d, int32_t time, int32_t offset)
+{
+	int64_t first = days_from_civil(year, m, 1);
+	int64_t next = m == 12 ? days_from_civil(year + 1, 1, 1) : days_from_civil(year, m + 1, 1);
+	int64_t day = first + (d - (first + 4) % 7 + 7) % 7 + (w - 1) * 7;
+
+	while (day >= next)
+		day -= 7;
+
+	return day * 86400 + time - offset;
+}
+
+static void
+add_rule_transitions(struct tz *tz, const struct rule *r)
+{
+	int year;
+	unsigned m, d;
+	int64_t last = tz->n > 0 ? tz->at[tz->n - 1] : 0;
+	int64_t start, end;
+
+	if (!r->has_dst) {
+		if (tz->n == 0)
+			tz->std_offset = r->std_offset;
+		else if (tz->offset[tz->n - 1] != r->std_offset)
+			add_transition(tz, last + 1, r->std_offset, false);
+		return;
+	}
+
+	civil_from_days(floor_div(last, 86400), &year, &m, &d);
+
+	for (; year <= TZ_LAST_YEAR; year++) {
+		start = rule_time(year, r->month[0], r->week[0], r->day[0], r->time[0], r->std_offset);
+		end = rule_time(year, r->month[1], r->week[1], r->day[1], r->time[1], r->dst_offset);
+		if (start > last)
+			add_transition(tz, start, r->dst_offset, true);
+		if (end > last)
+			add_transition(tz, end, r->std_offset, false);
+	}
+}
+
+/* RFC 8536 TZif, version 2+ data block is used when present */
+static int
+parse_tzif(struct tz *tz, const uint8_t *p, size_t size)
+{
+	const uint8_t *end = p + size, *times, *types, *info;
+	int64_t isutcnt, isstdcnt, leapcnt, timecnt, typecnt, charcnt;
+	int64_t i;
+	int tsize = 4;
+	struct rule rule;
+	char footer[128];
+	size_t len;
+
+	for (;;) {
+		if (end - p < 44 || memcmp(p, "TZif", 4) != 0)
+			return -1;
+
+		isutcnt = be(p + 20, 4);
+		isstdcnt = be(p + 24, 4);
+		leapcnt = be(p + 28, 4);
+		timecnt = be(p + 32, 4);
+		typecnt = be(p + 36, 4);
+		charcnt = be(p + 40, 4);
+
+		if (typecnt == 0 || end - p < 44 + timecnt * (tsize + 1) + typecnt * 6 + charcnt +
+		    leapcnt * (tsize + 4) + isstdcnt + isutcnt)
+			return -1;
+
+		if (tsize == 8 || p[4] < '2')
+			break;
+
+		/* skip version 1 block */
+		p += 44 + timecnt * 5 + typecnt * 6 + charcnt + leapcnt * 8 + isstdcnt + isutcnt;
+		tsize = 8;
+	}
+
+	times = p + 44;
+	types = times + timecnt * tsize;
+	info = types + timecnt;
+
+	tz->std_offset = be(info, 4);
+
+	for (i = 0; i < timecnt; i++) {
+		if (types[i] >= typecnt)
+			return -1;
+		/* ttinfo is utoff, isdst, desigidx */
+		add_transition(tz, be(times + i * tsize, tsize), be(info + types[i] * 6, 4),
+			       info[types[i] * 6 + 4] != 0);
+	}
+
+	if (tsize != 8)
+		return 0;
+
+	p = info + typecnt * 6 + charcnt + leapcnt * 12 + isstdcnt + isutcnt;
+	if (p >= end || *p != '\n')
+		return 0;
+
+	len = end - p - 1;
+	if (len >= sizeof(footer))
+		len = sizeof(footer) - 1;
+	memcpy(footer, p + 1, len);
+	footer[len] = 0;
+
+	if (*footer != 0 && *footer != '\n' && parse_rule(footer, &rule) == 0)
+		add_rule_transitions(tz, &rule);
+
+	return 0;
+}
+
+static struct tz *
+load_zone(const char *name)
+{
+	char path[512];
+	uint8_t *data;
+	long size;
+	struct tz *tz;
+	FILE *f;
+
+	if (strstr(name, "..") != NULL || strlen(name) >= sizeof(tz->name))
+		return NULL;
+
+	snprintf(path, sizeof(path), "%s/%s", ZONEINFO_DIR, name);
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		return NULL;
+
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	rewind(f);
+
+	data = malloc(size + 1);
+	if (data == NULL)
+		err(1, "cannot allocate zone %s", name);
+
+	tz = calloc(1, sizeof(struct tz));
+	if (tz == NULL)
+		err(1, "cannot allocate zone %s", name);
+	strcpy(tz->name, name);
+
+	if (fread(data, 1, size, f) != (size_t)size || parse_tzif(tz, data, size) != 0) {
+		warnx("cannot parse zone file %s", path);
+		free(tz->at);
+		free(tz->offset);
+		free(tz->isdst);
+		free(tz);
+		tz = NULL;
+	}
+
+	free(data);
+	fclose(f);
+
+	return tz;
+}
+
+static void
+register_zone(struct tz *tz)
+{
+	zones = realloc(zones, (n_zones + 1) * sizeof(struct tz *));
+	if (zones == NULL)
+		err(1, "cannot allocate zones");
+	zones[n_zones++] = tz;
+}
+
+static struct tz *
+find_zone(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < n_zones; i++)
+		if (strcmp(zones[i]->name, name) == 0)
+			return zones[i];
+
+	return NULL;
+}
+
+const struct tz *
+tz_get(const char *name)
+{
+	struct tz *tz;
+
+	pthread_mutex_lock(&zones_lock);
+
+	tz = find_zone(name);
+	if (tz == NULL && (tz = load_zone(name)) != NULL)
+		register_zone(tz);
+
+	pthread_mutex_unlock(&zones_lock);
+
+	return tz;
+}
+
+const struct tz *
+tz_fixed(int32_t offset)
+{
+	char name[64];
+	struct tz *tz;
+
+	snprintf(name, sizeof(name), "UTC%c%02d:%02d", offset < 0 ? '-' : '+',
+		 abs(offset) / 3600, abs(offset) / 60 % 60);
+
+	pthread_mutex_lock(&zones_lock);
+
+	tz = find_zone(name);
+	if (tz == NULL) {
+		tz = calloc(1, sizeof(struct tz));
+		if (tz == NULL)
+			err(1, "cannot allocate zone %s", name);
+		strcpy(tz->name, name);
+		tz->std_offset = offset;
+		register_zone(tz);
+	}
+
+	pthread_mutex_unlock(&zones_lock);
+
+	return tz;
+}
+
+const struct tz *
+tz_guess(const time_t *t, const int32_t *offset, size_t n)
+{
+	const struct tz *tz, *first = NULL;
+	size_t i, j;
+	bool dst;
+
+	for (i = 0; us_zones[i] != NULL && n > 0; i++) {
+		tz = tz_get(us_zones[i]);
+		if (tz == NULL)
+			continue;
+
+		dst = false;
+		for (j = 0; j < n; j++) {
+			if (tz_offset(tz, t[j]) != offset[j])
+				break;
+			dst = dst || is_dst(tz, t[j]);
+		}
+
+		if (j < n)
+			continue;
+		if (dst)
+			return tz;
+		if (first == NULL)
+			first = tz;
+	}
+
+	return first != NULL ? first : tz_fixed(n > 0 ? offset[0] : 0);
+}
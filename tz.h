@@ -0,0 +1,45 @@
+/**
+ * Serge Voilokov, 2015.
+ * Time zones as precomputed UTC offset transition tables.
+ */
+
+#ifndef TZ_H
+#define TZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+struct tz
+{
+	char name[64];
+	size_t n;               /* number of transitions */
+	int64_t *at;            /* transition times, ascending */
+	int32_t *offset;        /* utc offset in seconds starting at at[i] */
+	uint8_t *isdst;         /* offset[i] is daylight saving time */
+	int32_t std_offset;     /* offset before first transition */
+};
+
+/*
+ * Load zone from /usr/share/zoneinfo, e.g. America/Chicago. Zones are loaded
+ * once and never freed, so pointers can be shared between threads.
+ * Returns NULL if zone is unknown.
+ */
+const struct tz *tz_get(const char *name);
+
+/* zone without transitions */
+const struct tz *tz_fixed(int32_t offset);
+
+/*
+ * Pick US zone matching utc offsets observed at times t, fixed zone if
+ * none does. A zone in daylight saving time at t is preferred, summer
+ * offsets of Pacific time match Arizona too.
+ */
+const struct tz *tz_guess(const time_t *t, const int32_t *offset, size_t n);
+
+/* lock free replacements for localtime_r and timegm */
+int32_t tz_offset(const struct tz *tz, time_t t);
+void tz_localtime(const struct tz *tz, time_t t, struct tm *tm);
+time_t tz_timegm(int year, int mon, int mday, int hour, int min, int sec);
+
+#endif /* TZ_H */
@@ -22,6 +22,11 @@ dump_config(struct buf *buf)
 {
 	buf_appendf(buf, "config_file = %s\n", cfg.config_fname);
 	buf_appendf(buf, "cache_dir = %s\n", cfg.cache_dir);
+	buf_appendf(buf, "forecast_dir = %s\n", cfg.forecast_dir);
+	buf_appendf(buf, "forecast_shm = %s\n", cfg.forecast_shm);
+	buf_appendf(buf, "workers = %d\n", cfg.workers);
+	buf_appendf(buf, "spool_dir = %s\n", cfg.spool_dir);
+	buf_appendf(buf, "mail_batch = %d\n", cfg.mail_batch);
 	buf_appendf(buf, "dbhost = %s\n", cfg.dbhost);
 	buf_appendf(buf, "dbname = %s\n", cfg.dbname);
 	buf_appendf(buf, "dbuser = %s\n", cfg.dbuser);
@@ -37,11 +42,20 @@ init_config(int argc, char **argv)
 	int ch, n, line = 0;
 	bool show_config = false;
 
-	while ((ch = getopt(argc, argv, "dihvgp:")) != -1) {
+	cfg.workers = 4;
+	cfg.mail_batch = 50;
+
+	while ((ch = getopt(argc, argv, "dihvgqp:l:")) != -1) {
 		switch (ch) {
 		case 'd':
 			cfg.debug = true;
 			break;
+		case 'l':
+			cfg.listen_port = atoi(optarg);
+			break;
+		case 'q':
+			cfg.sender = true;
+			break;
 		case 'p':
 			cfg.post_data = strdup(optarg);
 			break;
@@ -65,9 +79,11 @@ init_config(int argc, char **argv)
 	if (home == NULL) {
 		cfg.cache_dir = strdup("/tmp/weatherui");
 		cfg.config_fname = strdup("/etc/weatherui.conf");
+		cfg.forecast_dir = strdup("/tmp/weather");
 	} else {
 		asprintf(&cfg.cache_dir, "%s/.cache/weatherui", home);
 		asprintf(&cfg.config_fname, "%s/.config/weatherui/weatherui.conf", home);
+		asprintf(&cfg.forecast_dir, "%s/.cache/weather", home);
 	}
 
 	f = fopen(cfg.config_fname, "rt");
@@ -97,6 +113,16 @@ init_config(int argc, char **argv)
 			cfg.cache_dir = strdup(value);
 		} else if (strcmp("smtp_password_file", key) == 0) {
 			cfg.smtp_password_file = strdup(value);
+		} else if (strcmp("forecast_dir", key) == 0) {
+			cfg.forecast_dir = strdup(value);
+		} else if (strcmp("forecast_shm", key) == 0) {
+			cfg.forecast_shm = strdup(value);
+		} else if (strcmp("workers", key) == 0) {
+			cfg.workers = atoi(value);
+		} else if (strcmp("spool_dir", key) == 0) {
+			cfg.spool_dir = strdup(value);
+		} else if (strcmp("mail_batch", key) == 0) {
+			cfg.mail_batch = atoi(value);
 		}
 	}
 	
@@ -107,6 +133,9 @@ init_config(int argc, char **argv)
 			err(1, "Cannot create dir %s", cfg.cache_dir);
 	}
 
+	if (cfg.spool_dir == NULL)
+		asprintf(&cfg.spool_dir, "%s/spool", cfg.cache_dir);
+
 	if (show_config) {
 		struct buf buf;
 		buf_init(&buf);
@@ -12,9 +12,17 @@ struct config {
 
 	char *cache_dir;    /* base dir for next files */
 	char *config_fname; /* config file name */
+	char *forecast_dir; /* rendered forecast snapshots written by weather -s */
+	char *forecast_shm; /* shared memory segment written by weather -x, NULL if not used */
+	char *spool_dir;    /* outgoing mail queue */
+
+	int listen_port;    /* persistent mode: serve http on this port */
+	int workers;        /* persistent mode: number of worker processes */
+	int mail_batch;     /* sender mode: max messages sent per queue pass */
 
 	bool debug;         /* debug output to console */
 	bool info;          /* print weather db info */
+	bool sender;        /* run mail queue sender */
 };
 
 extern struct config cfg;
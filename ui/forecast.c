@@ -0,0 +1,179 @@
+#include "forecast.h"
+#include "config.h"
+#include "../shmcache.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MAX_ENTRIES 64
+
+/* mapped snapshot; in persistent mode stays mapped between requests */
+struct entry
+{
+	int zip;
+	char *data;
+	size_t size;
+	ino_t ino;
+	time_t mtime;
+	time_t checked;         /* last stat time, snapshot is revalidated once a second */
+	unsigned long used;     /* LRU tick */
+};
+
+static struct entry entries[MAX_ENTRIES];
+static unsigned long tick;
+
+/* segment published by "weather -x"; opened on first use, retried once a second */
+static struct shmcache shm;
+static time_t shm_tried;
+static struct shmcache_entry shm_entry;
+
+static int
+parse_zip(const char *zip)
+{
+	int i;
+
+	for (i = 0; i < 5; i++)
+		if (!isdigit((unsigned char)zip[i]))
+			return -1;
+
+	if (zip[5] != 0)
+		return -1;
+
+	return atoi(zip);
+}
+
+static void
+unmap(struct entry *e)
+{
+	if (e->data != NULL)
+		munmap(e->data, e->size);
+	e->data = NULL;
+	e->zip = 0;
+}
+
+static bool
+map(struct entry *e, const char *path, const struct stat *st)
+{
+	int fd;
+	void *data;
+
+	if (st->st_size == 0)
+		return false;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	data = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (data == MAP_FAILED)
+		return false;
+
+	e->data = data;
+	e->size = st->st_size;
+	e->ino = st->st_ino;
+	e->mtime = st->st_mtime;
+
+	return true;
+}
+
+/* copy of table from shared memory, no file system access */
+static const char *
+shm_table(int zip, size_t *len, time_t now)
+{
+	if (shm.header == NULL) {
+		if (shm_tried == now)
+			return NULL;
+		shm_tried = now;
+		if (shmcache_open(&shm, cfg.forecast_shm, false, 0) != 0)
+			return NULL;
+	}
+
+	if (shmcache_get(&shm, zip, &shm_entry) != 0 || shm_entry.html_len == 0)
+		return NULL;
+
+	*len = shm_entry.html_len;
+
+	return shm_entry.data;
+}
+
+/* latest snapshot file of zip, mapped */
+static struct entry *
+snapshot(int z, time_t now)
+{
+	int i;
+	char path[PATH_MAX];
+	struct stat st;
+	struct entry *e = NULL, *lru = &entries[0];
+
+	for (i = 0; i < MAX_ENTRIES; i++) {
+		if (entries[i].zip == z && entries[i].data != NULL) {
+			e = &entries[i];
+			break;
+		}
+		if (entries[i].used < lru->used)
+			lru = &entries[i];
+	}
+
+	if (e != NULL && e->checked == now)
+		goto found;
+
+	snprintf(path, PATH_MAX, "%s/zip-%05d.html", cfg.forecast_dir, z);
+
+	if (stat(path, &st) != 0) {
+		if (e != NULL)
+			unmap(e);
+		return NULL;
+	}
+
+	/* snapshots are replaced by rename, so a new inode means new data */
+	if (e != NULL && e->ino == st.st_ino && e->mtime == st.st_mtime && e->size == (size_t)st.st_size)
+		goto found;
+
+	if (e == NULL)
+		e = lru;
+
+	unmap(e);
+	if (!map(e, path, &st))
+		return NULL;
+
+	e->zip = z;
+
+found:
+	e->checked = now;
+	e->used = ++tick;
+
+	return e;
+}
+
+const char *
+forecast_table(const char *zip, size_t *len)
+{
+	int z;
+	const char *data = NULL;
+	struct entry *e;
+	time_t now = time(NULL);
+
+	z = parse_zip(zip);
+	if (z < 0)
+		return NULL;
+
+	if (cfg.forecast_shm != NULL)
+		data = shm_table(z, len, now);
+
+	/* newest table wins, a writer that stopped publishing to shm does not pin old data */
+	e = snapshot(z, now);
+	if (e != NULL && (data == NULL || shm_entry.stored < e->mtime)) {
+		*len = e->size;
+		return e->data;
+	}
+
+	return data;
+}
@@ -0,0 +1,11 @@
+#include <stddef.h>
+
+/*
+ * Rendered forecast table for zip from cfg.forecast_dir.
+ * Snapshots are written by "weather -s" and mapped read-only here,
+ * so the request path never fetches from NDFD. With cfg.forecast_shm
+ * the table published by "weather -x" is used unless the snapshot is
+ * newer; the returned pointer is then valid until the next call.
+ * Returns NULL if zip is invalid or there is no snapshot yet.
+ */
+const char *forecast_table(const char *zip, size_t *len);
@@ -0,0 +1,54 @@
+#include "form.h"
+#include <stddef.h>
+
+static int
+hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+bool
+form_next(char **pos, char **name, char **value)
+{
+	char *r = *pos, *w;
+	int hi, lo;
+
+	/* skip empty pairs, i.e. "a=1&&b=2" */
+	while (*r == '&')
+		r++;
+
+	if (*r == 0)
+		return false;
+
+	*name = w = r;
+	*value = NULL;
+
+	/* decoded text is never longer than encoded, so write pointer stays behind read pointer */
+	for (; *r != 0 && *r != '&'; r++) {
+		if (*r == '=' && *value == NULL) {
+			*w++ = 0;
+			*value = w;
+		} else if (*r == '+') {
+			*w++ = ' ';
+		} else if (*r == '%' && (hi = hexval(r[1])) >= 0 && (lo = hexval(r[2])) >= 0) {
+			*w++ = (char)(hi << 4 | lo);
+			r += 2;
+		} else {
+			*w++ = *r;
+		}
+	}
+
+	*pos = (*r == '&') ? r + 1 : r;
+	*w = 0;
+
+	if (*value == NULL)
+		*value = w;
+
+	return true;
+}
@@ -0,0 +1,8 @@
+#include <stdbool.h>
+
+/*
+ * application/x-www-form-urlencoded tokenizer.
+ * Splits and decodes the string in place: each call returns the next
+ * name/value pair and advances *pos. Returns false at the end of input.
+ */
+bool form_next(char **pos, char **name, char **value);
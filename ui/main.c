@@ -1,15 +1,20 @@
 #include "config.h"
+#include "form.h"
+#include "token.h"
+#include "forecast.h"
+#include "server.h"
+#include "metrics.h"
+#include "spool.h"
 #include "common/mysql.h"
 #include "common/crypt.h"
 #include "common/net.h"
 #include "common/regexp.h"
+#include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <err.h>
-#include <inttypes.h>
-#include <curl/curl.h>
 #include "main.html.h"
 #include "confirm.html.h"
 
@@ -19,6 +24,7 @@ struct params {
 	const char *schedule;
 	const char *code;
 	const char *confirm_code;
+	const char *preview_zip;
 	bool email_sent;
 };
 
@@ -32,9 +38,13 @@ struct user
 static MYSQL *mysql;
 static struct buf ebuf;
 static struct buf obuf;
-static char post_data[1024];
+static char *post_data;
+static int post_status;  /* 400 or 413 when post data is rejected */
 static char base_url[1024];
 
+/* forms post a few short fields */
+#define MAX_POST_DATA (64 << 10)
+
 static void
 init_base_url()
 {
@@ -42,48 +52,76 @@ init_base_url()
 		 getenv("REQUEST_SCHEME"), getenv("HTTP_HOST"), getenv("SCRIPT_NAME"));
 }
 
-static void
-parse_post_data(struct params *p)
+/* NULL with post_status set if CONTENT_LENGTH is invalid or over MAX_POST_DATA */
+static char *
+read_post_data()
 {
-	if (cfg.post_data != NULL) {
-		strcpy(post_data, cfg.post_data);
-	} else {
-		char *str = getenv("CONTENT_LENGTH");
-		size_t len = atoi(str);
-		len = fread(post_data, 1, len, stdin);
-		CURL *curl = curl_easy_init();
-		char *output = curl_easy_unescape(curl, post_data, len, NULL);
-		strcpy(post_data, output);
-		curl_free(output);
+	const char *str = getenv("CONTENT_LENGTH");
+	size_t len = 0, n = 0, rd;
+	long long v;
+	char *end;
+
+	if (str != NULL) {
+		errno = 0;
+		v = strtoll(str, &end, 10);
+		if (errno != 0 || end == str || *end != 0 || v < 0) {
+			post_status = 400;
+			return NULL;
+		}
+		if (v > MAX_POST_DATA) {
+			post_status = 413;
+			return NULL;
+		}
+		len = v;
 	}
 
-	char *query = post_data;
-	char *ptr = strstr(query, "email=");
+	char *data = malloc(len + 1);
+	if (data == NULL)
+		err(1, "cannot allocate %zu bytes for post data", len);
+
+	while (n < len && (rd = fread(data + n, 1, len - n, stdin)) > 0)
+		n += rd;
+
+	data[n] = 0;
 
-	if (ptr != NULL)
-		p->email = ptr + 6;
+	return data;
+}
 
-	ptr = strstr(query, "zip=");
-	if (ptr != NULL)
-		p->zip = ptr + 4;
+static void
+parse_post_data(struct params *p)
+{
+	char *name, *value;
 
-	ptr = strstr(query, "time=");
-	if (ptr != NULL)
-		p->schedule = ptr + 5;
+	if (cfg.post_data != NULL)
+		post_data = strdup(cfg.post_data);
+	else
+		post_data = read_post_data();
 
-	ptr = strstr(query, "confirm=");
-	if (ptr != NULL)
-		p->confirm_code = ptr + 8;
+	if (post_data == NULL) {
+		buf_appendf(&ebuf, post_status == 413 ? "request is too large.\n" : "invalid content length.\n");
+		return;
+	}
 
-	ptr = query;
-	while ((ptr = strchr(ptr, '&')) != NULL) {
-		*ptr = 0;
-		ptr++;
+	char *pos = post_data;
+
+	while (form_next(&pos, &name, &value)) {
+		if (strcmp(name, "email") == 0)
+			p->email = value;
+		else if (strcmp(name, "zip") == 0)
+			p->zip = value;
+		else if (strcmp(name, "time") == 0)
+			p->schedule = value;
+		else if (strcmp(name, "confirm") == 0)
+			p->confirm_code = value;
 	}
 
 	if (p->email != NULL && *p->email == 0)
 		buf_appendf(&ebuf, "email is empty.\n");
 
+	/* email goes into spool file header */
+	if (p->email != NULL && strpbrk(p->email, "\r\n") != NULL)
+		buf_appendf(&ebuf, "email is invalid.\n");
+
 	if (p->zip != NULL && *p->zip == 0)
 		buf_appendf(&ebuf, "zip is empty.\n");
 
@@ -94,8 +132,6 @@ parse_post_data(struct params *p)
 static void
 parse_request(struct params *p)
 {
-	post_data[0] = 0;
-
 	char *method = getenv("REQUEST_METHOD");
 	if (method != NULL && strcmp(method, "POST") == 0) {
 		parse_post_data(p);
@@ -106,27 +142,97 @@ parse_request(struct params *p)
 		return;
 
 	char *query = strdup(var);
+	char *name, *value;
+
+	while (form_next(&query, &name, &value)) {
+		if (strcmp(name, "code") == 0)
+			p->code = value;
+		else if (strcmp(name, "emailsent") == 0)
+			p->email_sent = strcmp(value, "1") == 0;
+		else if (strcmp(name, "zip") == 0)
+			p->preview_zip = value;
+	}
+}
+
+static int
+format_preview(const char *zip, struct buf *page)
+{
+	size_t len;
+	uint64_t start = metrics_now();
+	const char *table = forecast_table(zip, &len);
+
+	if (table == NULL) {
+		buf_appendf(page, "No forecast for this zip yet.");
+		return 404;
+	}
+
+	buf_appendf(page, "<html>\n<body>\n<h3>Forecast for zip %s</h3>\n", zip);
+	buf_append(page, table, len);
+	buf_appendf(page, "</body>\n</html>\n");
+	metrics_record(STAGE_RENDER, start);
+
+	return 200;
+}
+
+static void
+handle_http(const char *path, char *query, struct buf *page, int *status)
+{
+	char *name, *value;
+	uint64_t start = metrics_now();
+
+	if (strcmp(path, "/metrics") == 0) {
+		metrics_prometheus(page);
+		return;
+	}
+
+	/* previews live at the root and at the cgi path, as links from CGI pages expect */
+	if (strcmp(path, "/") != 0 && strcmp(path, "/weatherui") != 0) {
+		*status = 404;
+		buf_appendf(page, "Not found.");
+		return;
+	}
+
+	while (form_next(&query, &name, &value)) {
+		if (strcmp(name, "zip") == 0) {
+			*status = format_preview(value, page);
+			metrics_record(STAGE_REQUEST, start);
+			return;
+		}
+	}
+
+	*status = 404;
+	buf_appendf(page, "Not found.");
+}
+
+static void
+open_db()
+{
+	uint64_t start = metrics_now();
+
+	mysql = db_open(cfg.dbhost, cfg.dbname, cfg.dbuser, cfg.dbpassword);
+	metrics_record(STAGE_DB_OPEN, start);
+}
 
-	if (strncmp(query, "code=", 5) == 0)
-		p->code = query + 5;
-	else if (strcmp(query, "emailsent=1") == 0)
-		p->email_sent = true;
+static int
+stmt_prepare(MYSQL_STMT *stmt, const char *query)
+{
+	uint64_t start = metrics_now();
+	int rc = mysql_stmt_prepare(stmt, query, strlen(query));
+
+	metrics_record(STAGE_STMT_PREPARE, start);
+
+	return rc;
 }
 
-static uint64_t
-get_random()
+static int
+stmt_execute(MYSQL_STMT *stmt)
 {
-	uint64_t num = 0;
-	size_t was_read;
+	uint64_t start = metrics_now();
+	int rc = mysql_stmt_execute(stmt);
 
-	FILE *f = fopen("/dev/urandom", "r");
-	if (f == NULL)
-		err(1, "cannot open urandom");
-	was_read = fread(&num, sizeof(uint64_t), 1, f);
-	if (was_read != 1)
-		errx(1, "cannot read from urandom");
+	metrics_record(STAGE_STMT_EXECUTE, start);
 
-	return num;
+	return rc;
 }
 
 static void
@@ -142,11 +248,10 @@ create_user(const char *email, const char *zip, struct buf *confirm_email)
 
 	unsigned long long user_id = 0;
 	char buf_zip[50];
-	char confirm_code[50];
+	char confirm_code[TOKEN_LEN + 1];
 	MYSQL_TIME created;
 
-	snprintf(confirm_code, 50, "%" PRIx64, get_random());
-//	snprintf(confirm_code, 50, "%" PRIx64, 0x123LLU);
+	token_generate(confirm_code, TOKEN_LEN);
 
 	const char *qselect = "select user_id, zip, created from USER where email = ?;";
 	const char *qinsert = "insert into USER(email, zip, confirm_code) values(?, ?, ?);";
@@ -187,7 +292,7 @@ create_user(const char *email, const char *zip, struct buf *confirm_email)
 	column[2].length = &col_length[2];
 
 	stmt = mysql_stmt_init(mysql);
-	rc = mysql_stmt_prepare(stmt, qselect, strlen(qselect));
+	rc = stmt_prepare(stmt, qselect);
 	if (rc != 0)
 		errx(1, "cannot prepare select query. %s", mysql_error(mysql));
 
@@ -199,7 +304,7 @@ create_user(const char *email, const char *zip, struct buf *confirm_email)
 	if (rc != 0)
 		errx(1, "cannot bind params. %s", mysql_error(mysql));
 
-	rc = mysql_stmt_execute(stmt);
+	rc = stmt_execute(stmt);
 	if (rc != 0)
 		errx(1, "cannot execute stmt. %s", mysql_error(mysql));
 
@@ -211,7 +316,7 @@ create_user(const char *email, const char *zip, struct buf *confirm_email)
 
 		stmt1 = mysql_stmt_init(mysql);
 
-		rc = mysql_stmt_prepare(stmt1, qinsert, strlen(qinsert));
+		rc = stmt_prepare(stmt1, qinsert);
 		if (rc != 0)
 			errx(1, "cannot prepare insert query. %s", mysql_error(mysql));
 
@@ -219,7 +324,7 @@ create_user(const char *email, const char *zip, struct buf *confirm_email)
 		if (rc != 0)
 			errx(1, "cannot bind params. %s", mysql_error(mysql));
 
-		rc = mysql_stmt_execute(stmt1);
+		rc = stmt_execute(stmt1);
 		if (rc != 0)
 			errx(1, "cannot execute stmt. %s", mysql_error(mysql));
 
@@ -227,7 +332,7 @@ create_user(const char *email, const char *zip, struct buf *confirm_email)
 
 		/* select again */
 
-		rc = mysql_stmt_execute(stmt);
+		rc = stmt_execute(stmt);
 		if (rc != 0)
 			errx(1, "cannot execute stmt. %s", mysql_error(mysql));
 
@@ -246,7 +351,7 @@ create_user(const char *email, const char *zip, struct buf *confirm_email)
 
 		stmt1 = mysql_stmt_init(mysql);
 
-		rc = mysql_stmt_prepare(stmt1, qupdate, strlen(qupdate));
+		rc = stmt_prepare(stmt1, qupdate);
 		if (rc != 0)
 			errx(1, "cannot prepare update query. %s", mysql_error(mysql));
 
@@ -259,7 +364,7 @@ create_user(const char *email, const char *zip, struct buf *confirm_email)
 		if (rc != 0)
 			errx(1, "cannot bind update params. %s", mysql_error(mysql));
 
-		rc = mysql_stmt_execute(stmt1);
+		rc = stmt_execute(stmt1);
 		if (rc != 0)
 			errx(1, "cannot execute stmt. %s", mysql_error(mysql));
 
@@ -319,7 +424,7 @@ get_user(const char *code, struct user *user)
 	column[2].length = &col_length[2];
 
 	stmt = mysql_stmt_init(mysql);
-	rc = mysql_stmt_prepare(stmt, qselect, strlen(qselect));
+	rc = stmt_prepare(stmt, qselect);
 	if (rc != 0)
 		errx(1, "cannot prepare select query. %s", mysql_error(mysql));
 
@@ -331,7 +436,7 @@ get_user(const char *code, struct user *user)
 	if (rc != 0)
 		errx(1, "cannot bind columns. %s", mysql_error(mysql));
 
-	rc = mysql_stmt_execute(stmt);
+	rc = stmt_execute(stmt);
 	if (rc != 0)
 		errx(1, "cannot execute stmt. %s", mysql_error(mysql));
 
@@ -383,7 +488,7 @@ confirm_user(const char *code, const char *zip, const char *schedule)
 	param[2].length = &par_length[2];
 
 	stmt = mysql_stmt_init(mysql);
-	rc = mysql_stmt_prepare(stmt, qupdate, strlen(qupdate));
+	rc = stmt_prepare(stmt, qupdate);
 	if (rc != 0)
 		errx(1, "cannot prepare update query. %s", mysql_error(mysql));
 
@@ -391,7 +496,7 @@ confirm_user(const char *code, const char *zip, const char *schedule)
 	if (rc != 0)
 		errx(1, "cannot bind params. %s", mysql_error(mysql));
 
-	rc = mysql_stmt_execute(stmt);
+	rc = stmt_execute(stmt);
 	if (rc != 0)
 		errx(1, "cannot execute stmt. %s", mysql_error(mysql));
 
@@ -399,24 +504,44 @@ confirm_user(const char *code, const char *zip, const char *schedule)
 	mysql_stmt_close(stmt);
 }
 
-static void
-send_wetreps_email(const char *to, const char *body)
+static int
+send_wetreps_email(const char *to, const char *subject, const char *body)
 {
 	struct message m = {
 		.to = to,
 		.from = "serge0x76+wetreps@gmail.com",
-		.subject = "wetreps",
+		.subject = subject,
 		.body = body
 	};
 
-	send_email(&m, cfg.smtp_password_file);
+	uint64_t start = metrics_now();
+	int res = send_email(&m, cfg.smtp_password_file);
+
+	metrics_record(STAGE_EMAIL, start);
+
+	return res;
 }
 
 int main(int argc, char **argv, char **envp)
 {
+	uint64_t start = metrics_now();
+
 	if (init_config(argc, argv) != 0)
 		return 1;
 
+	metrics_init(cfg.listen_port != 0);
+	metrics_record(STAGE_CONFIG, start);
+
+	if (cfg.listen_port != 0) {
+		http_serve(cfg.listen_port, cfg.workers, handle_http);
+		return 0;
+	}
+
+	if (cfg.sender) {
+		spool_run(cfg.mail_batch, send_wetreps_email);
+		return 0;
+	}
+
 	struct buf confirm_email, page;
 	struct params p;
 	memset(&p, 0, sizeof(struct params));
@@ -428,14 +553,24 @@ int main(int argc, char **argv, char **envp)
 	parse_request(&p);
 
 	if (ebuf.len > 0) {
+		if (post_status == 413)
+			printf("Status: 413 Payload Too Large\r\n");
+		else if (post_status == 400)
+			printf("Status: 400 Bad Request\r\n");
 		buf_appendf(&page, "<font color=\"red\">ERROR: %s</font> <a href=\"%s\">back</a>",
 			    ebuf.s, base_url);
 		goto flush;
 	}
 
+	if (p.preview_zip != NULL) {
+		if (format_preview(p.preview_zip, &page) != 200)
+			printf("Status: 404 Not Found\r\n");
+		goto flush;
+	}
+
 	if (p.confirm_code != NULL) {
 		struct user user;
-		mysql = db_open(cfg.dbhost, cfg.dbname, cfg.dbuser, cfg.dbpassword);
+		open_db();
 		if (!get_user(p.confirm_code, &user)) {
 			buf_appendf(&page, "Invalid confirmation code. <a href=\"%s\">back</a>", base_url);
 			goto flush;
@@ -447,17 +582,19 @@ int main(int argc, char **argv, char **envp)
 
 	if (p.code != NULL) {
 		struct user user;
-		mysql = db_open(cfg.dbhost, cfg.dbname, cfg.dbuser, cfg.dbpassword);
+		open_db();
 		if (!get_user(p.code, &user)) {
 			buf_appendf(&page, "Invalid confirmation code. <a href=\"%s\">back</a>", base_url);
 			goto flush;
 		}
 
+		uint64_t render_start = metrics_now();
 		buf_append(&page, confirm_html, confirm_html_size);
 		buf_replace(&page, "\\{email\\}", user.email);
 		buf_replace(&page, "\\{zip\\}", user.zip);
 		buf_replace(&page, "\\{schedule\\}", user.schedule);
 		buf_replace(&page, "\\{code\\}", p.code);
+		metrics_record(STAGE_RENDER, render_start);
 		goto flush;
 	}
 
@@ -470,11 +607,16 @@ int main(int argc, char **argv, char **envp)
 	
 	if (p.email != NULL) {
 		buf_init(&confirm_email);
-		mysql = db_open(cfg.dbhost, cfg.dbname, cfg.dbuser, cfg.dbpassword);
+		open_db();
 		create_user(p.email, "10001", &confirm_email);
-		send_wetreps_email(p.email, confirm_email.s);
+		uint64_t queue_start = metrics_now();
+		spool_enqueue(p.email, "wetreps", confirm_email.s);
+		metrics_record(STAGE_EMAIL, queue_start);
 		printf("Status: 302 Moved\r\n");
 		printf("Location: ?emailsent=1\r\n\r\n");
+		metrics_record(STAGE_REQUEST, start);
+		if (cfg.debug)
+			metrics_dump(stderr);
 		return 0;
 	}
 
@@ -491,4 +633,8 @@ flush:
 	printf("Content-type: text/html\r\n");
 	printf("Content-length: %zu\r\n\r\n", page.len);
 	puts(page.s);
+	metrics_record(STAGE_REQUEST, start);
+
+	if (cfg.debug)
+		metrics_dump(stderr);
 }
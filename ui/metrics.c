@@ -0,0 +1,183 @@
+#include "metrics.h"
+#include <err.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+
+/*
+ * HDR-style log-linear buckets over microseconds: values below 4us get
+ * one bucket each, then every power of two is split into 4 sub-buckets,
+ * which keeps relative error under 25% up to ~2 minutes.
+ */
+#define SUB_BITS 2
+#define SUB_COUNT (1 << SUB_BITS)
+#define N_BUCKETS 112
+
+struct histogram
+{
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+	uint64_t buckets[N_BUCKETS];
+};
+
+static const char *stage_names[] = {
+	[STAGE_CONFIG] = "config",
+	[STAGE_DB_OPEN] = "db_open",
+	[STAGE_STMT_PREPARE] = "stmt_prepare",
+	[STAGE_STMT_EXECUTE] = "stmt_execute",
+	[STAGE_EMAIL] = "email",
+	[STAGE_RENDER] = "render",
+	[STAGE_REQUEST] = "request"
+};
+
+static struct histogram *histograms;
+
+void
+metrics_init(bool shared)
+{
+	size_t size = sizeof(struct histogram) * STAGE_ENUM_MAX;
+
+	if (shared) {
+		histograms = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (histograms == MAP_FAILED)
+			err(1, "cannot map metrics");
+	} else {
+		histograms = calloc(1, size);
+		if (histograms == NULL)
+			err(1, "cannot allocate metrics");
+	}
+}
+
+uint64_t
+metrics_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t
+bucket_index(uint64_t us)
+{
+	int e;
+	size_t idx;
+
+	if (us < SUB_COUNT)
+		return us;
+
+	e = 63 - __builtin_clzll(us);
+	idx = (e - SUB_BITS + 1) * SUB_COUNT + ((us >> (e - SUB_BITS)) & (SUB_COUNT - 1));
+
+	return idx < N_BUCKETS ? idx : N_BUCKETS - 1;
+}
+
+/* exclusive upper bound of bucket, microseconds */
+static uint64_t
+bucket_upper(size_t idx)
+{
+	size_t e, sub;
+
+	if (idx < SUB_COUNT)
+		return idx + 1;
+
+	e = idx / SUB_COUNT + SUB_BITS - 1;
+	sub = idx % SUB_COUNT;
+
+	return (uint64_t)(SUB_COUNT + sub + 1) << (e - SUB_BITS);
+}
+
+void
+metrics_record(enum stage stage, uint64_t start)
+{
+	struct histogram *h;
+	uint64_t ns = metrics_now() - start;
+	uint64_t max;
+
+	if (histograms == NULL)
+		return;
+
+	h = &histograms[stage];
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum_ns, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->buckets[bucket_index(ns / 1000)], 1, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+	while (ns > max && !__atomic_compare_exchange_n(&h->max_ns, &max, ns, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+void
+metrics_prometheus(struct buf *buf)
+{
+	size_t i, j;
+	uint64_t cumulative;
+	const struct histogram *h;
+
+	if (histograms == NULL)
+		return;
+
+	buf_appendf(buf, "# HELP weatherui_stage_duration_seconds Time spent in request stage.\n");
+	buf_appendf(buf, "# TYPE weatherui_stage_duration_seconds histogram\n");
+
+	for (i = 0; i < STAGE_ENUM_MAX; i++) {
+		h = &histograms[i];
+		cumulative = 0;
+
+		for (j = 0; j < N_BUCKETS - 1; j++) {
+			cumulative += h->buckets[j];
+			buf_appendf(buf, "weatherui_stage_duration_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+				    stage_names[i], bucket_upper(j) / 1e6, (unsigned long long)cumulative);
+		}
+
+		buf_appendf(buf, "weatherui_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+			    stage_names[i], (unsigned long long)h->count);
+		buf_appendf(buf, "weatherui_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n",
+			    stage_names[i], h->sum_ns / 1e9);
+		buf_appendf(buf, "weatherui_stage_duration_seconds_count{stage=\"%s\"} %llu\n",
+			    stage_names[i], (unsigned long long)h->count);
+	}
+}
+
+static uint64_t
+percentile(const struct histogram *h, double p)
+{
+	size_t i;
+	uint64_t seen = 0, rank = h->count * p;
+
+	for (i = 0; i < N_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > rank)
+			return bucket_upper(i);
+	}
+
+	return bucket_upper(N_BUCKETS - 1);
+}
+
+void
+metrics_dump(FILE *f)
+{
+	size_t i;
+	const struct histogram *h;
+
+	if (histograms == NULL)
+		return;
+
+	fprintf(f, "%-14s %6s %10s %10s %10s %10s\n", "stage", "count", "p50,us", "p90,us", "p99,us", "max,us");
+
+	for (i = 0; i < STAGE_ENUM_MAX; i++) {
+		h = &histograms[i];
+		if (h->count == 0)
+			continue;
+
+		fprintf(f, "%-14s %6llu %10llu %10llu %10llu %10llu\n", stage_names[i],
+			(unsigned long long)h->count,
+			(unsigned long long)percentile(h, 0.50),
+			(unsigned long long)percentile(h, 0.90),
+			(unsigned long long)percentile(h, 0.99),
+			(unsigned long long)(h->max_ns / 1000));
+	}
+}
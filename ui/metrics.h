@@ -0,0 +1,35 @@
+#include "common/struct.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* request stages with latency histograms */
+enum stage
+{
+	STAGE_CONFIG,
+	STAGE_DB_OPEN,
+	STAGE_STMT_PREPARE,
+	STAGE_STMT_EXECUTE,
+	STAGE_EMAIL,
+	STAGE_RENDER,
+	STAGE_REQUEST,
+	STAGE_ENUM_MAX
+};
+
+/*
+ * Allocate histograms. Shared histograms live in anonymous shared memory,
+ * so pre-forked workers aggregate into one set.
+ */
+void metrics_init(bool shared);
+
+/* monotonic clock, nanoseconds */
+uint64_t metrics_now();
+
+/* add time elapsed since start to stage histogram */
+void metrics_record(enum stage stage, uint64_t start);
+
+/* Prometheus text exposition format */
+void metrics_prometheus(struct buf *buf);
+
+/* human readable percentiles */
+void metrics_dump(FILE *f);
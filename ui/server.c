@@ -0,0 +1,230 @@
+#define _GNU_SOURCE
+#include "server.h"
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#define REQ_MAX 8192
+#define IO_TIMEOUT 5        /* seconds a client may stay silent or not read */
+#define REQ_TIMEOUT 10      /* seconds to receive whole request head, against slow clients */
+#define MAX_REQUESTS 100    /* per keep-alive connection, then it is closed */
+
+static const char *
+status_text(int status)
+{
+	switch (status) {
+	case 200: return "OK";
+	case 400: return "Bad Request";
+	case 404: return "Not Found";
+	case 405: return "Method Not Allowed";
+	default:  return "Internal Server Error";
+	}
+}
+
+static bool
+write_all(int fd, struct iovec *iov, int cnt)
+{
+	ssize_t n;
+
+	while (cnt > 0) {
+		n = writev(fd, iov, cnt);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		while (cnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return true;
+}
+
+/* handle requests on one connection until client closes it or asks to */
+static void
+handle_connection(int fd, http_handler handler, struct buf *page)
+{
+	char req[REQ_MAX + 1];
+	char head[256];
+	size_t len = 0;
+	ssize_t n;
+	char *end, *line_end, *headers, *method, *target, *version, *query;
+	bool keep_alive;
+	int status, head_len, requests;
+	time_t start;
+
+	req[0] = 0;
+
+	for (requests = 1; ; requests++) {
+		/* reads time out after IO_TIMEOUT, see worker */
+		start = time(NULL);
+		while ((end = strstr(req, "\r\n\r\n")) == NULL) {
+			if (len == REQ_MAX || time(NULL) - start > REQ_TIMEOUT)
+				return;
+			n = read(fd, req + len, REQ_MAX - len);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return;
+			len += n;
+			req[len] = 0;
+		}
+
+		line_end = strstr(req, "\r\n");
+		headers = line_end == end ? "" : line_end + 2;
+		*line_end = 0;
+		*end = 0;
+		end += 4;
+
+		method = strtok(req, " ");
+		target = strtok(NULL, " ");
+		version = strtok(NULL, " ");
+		if (method == NULL || target == NULL || version == NULL)
+			return;
+
+		keep_alive = strcmp(version, "HTTP/1.1") == 0;
+		if (strcasestr(headers, "connection: close") != NULL || requests == MAX_REQUESTS)
+			keep_alive = false;
+
+		query = strchr(target, '?');
+		if (query != NULL)
+			*query++ = 0;
+		else
+			query = "";
+
+		buf_clean(page);
+		status = 200;
+
+		if (strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0) {
+			status = 405;
+			keep_alive = false;
+		} else {
+			handler(target, query, page, &status);
+		}
+
+		head_len = snprintf(head, sizeof(head),
+			"HTTP/1.1 %d %s\r\n"
+			"Content-Type: %s\r\n"
+			"Content-Length: %zu\r\n"
+			"Connection: %s\r\n\r\n",
+			status, status_text(status),
+			strcmp(target, "/metrics") == 0 ? "text/plain; version=0.0.4" : "text/html",
+			page->len, keep_alive ? "keep-alive" : "close");
+
+		struct iovec iov[2] = {
+			{ head, head_len },
+			{ page->s, strcmp(method, "HEAD") == 0 ? 0 : page->len }
+		};
+
+		if (!write_all(fd, iov, 2) || !keep_alive)
+			return;
+
+		/* keep pipelined bytes for the next request */
+		len -= end - req;
+		memmove(req, end, len);
+		req[len] = 0;
+	}
+}
+
+static void
+worker(int sock, http_handler handler)
+{
+	int fd, one = 1;
+	struct timeval tv = { .tv_sec = IO_TIMEOUT };
+	struct buf page;
+
+	buf_init(&page);
+
+	for (;;) {
+		fd = accept(sock, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			err(1, "accept");
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		/* idle keep-alive clients must not hold a worker forever */
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		handle_connection(fd, handler, &page);
+		close(fd);
+	}
+}
+
+static pid_t
+spawn(int sock, http_handler handler)
+{
+	pid_t pid = fork();
+
+	if (pid < 0)
+		err(1, "fork");
+
+	if (pid == 0) {
+		worker(sock, handler);
+		_exit(0);
+	}
+
+	return pid;
+}
+
+void
+http_serve(int port, int workers, http_handler handler)
+{
+	int sock, i, one = 1;
+	struct sockaddr_in addr;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0)
+		err(1, "socket");
+
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+		err(1, "cannot bind port %d", port);
+
+	if (listen(sock, 1024) != 0)
+		err(1, "listen");
+
+	if (workers < 1)
+		workers = 1;
+
+	/* pre-forked workers share listening socket; respawn the ones that die */
+	for (i = 0; i < workers; i++)
+		spawn(sock, handler);
+
+	for (;;) {
+		if (wait(NULL) < 0) {
+			if (errno == EINTR)
+				continue;
+			err(1, "wait");
+		}
+		spawn(sock, handler);
+	}
+}
@@ -0,0 +1,9 @@
+#include "common/struct.h"
+
+/*
+ * Persistent mode: minimal HTTP/1.1 server for read-only endpoints.
+ * Handler gets request path and raw query string and fills page and status.
+ */
+typedef void (*http_handler)(const char *path, char *query, struct buf *page, int *status);
+
+void http_serve(int port, int workers, http_handler handler);
@@ -0,0 +1,229 @@
+#include "spool.h"
+#include "config.h"
+#include "token.h"
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static void
+make_dir(const char *path)
+{
+	if (mkdir(path, 0770) != 0 && access(path, W_OK) != 0)
+		err(1, "cannot create dir %s", path);
+}
+
+void
+spool_enqueue(const char *to, const char *subject, const char *body)
+{
+	char name[100], tmp[PATH_MAX], path[PATH_MAX], suffix[9];
+	FILE *f;
+
+	make_dir(cfg.spool_dir);
+	snprintf(tmp, PATH_MAX, "%s/tmp", cfg.spool_dir);
+	make_dir(tmp);
+	snprintf(path, PATH_MAX, "%s/new", cfg.spool_dir);
+	make_dir(path);
+	snprintf(path, PATH_MAX, "%s/cur", cfg.spool_dir);
+	make_dir(path);
+
+	/* names sort by queue time */
+	token_generate(suffix, 8);
+	snprintf(name, sizeof(name), "%010lld.%d.%s", (long long)time(NULL), getpid(), suffix);
+	snprintf(tmp, PATH_MAX, "%s/tmp/%s", cfg.spool_dir, name);
+	snprintf(path, PATH_MAX, "%s/new/%s", cfg.spool_dir, name);
+
+	f = fopen(tmp, "w");
+	if (f == NULL)
+		err(1, "cannot create %s", tmp);
+
+	fprintf(f, "To: %s\nSubject: %s\n\n%s", to, subject, body);
+
+	if (fclose(f) != 0)
+		err(1, "cannot write %s", tmp);
+
+	if (rename(tmp, path) != 0)
+		err(1, "cannot rename %s to %s", tmp, path);
+
+	if (cfg.debug)
+		fprintf(stderr, "queued mail to %s: %s\n", to, path);
+}
+
+static char *
+read_file(const char *path)
+{
+	FILE *f;
+	long size;
+	char *data;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		return NULL;
+
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	rewind(f);
+
+	data = malloc(size + 1);
+	if (data == NULL || fread(data, 1, size, f) != (size_t)size) {
+		free(data);
+		fclose(f);
+		return NULL;
+	}
+
+	data[size] = 0;
+	fclose(f);
+
+	return data;
+}
+
+/* returns false if message should stay queued for retry */
+static bool
+send_file(const char *path, spool_sender send)
+{
+	char *data, *to, *subject, *body;
+	int res;
+
+	data = read_file(path);
+	if (data == NULL)
+		return false;
+
+	to = data + 4;
+	subject = strchr(to, '\n');
+	body = subject != NULL ? strstr(subject, "\n\n") : NULL;
+
+	if (strncmp(data, "To: ", 4) != 0 || body == NULL || strncmp(subject, "\nSubject: ", 10) != 0) {
+		warnx("dropping invalid spool file %s", path);
+		free(data);
+		return true;
+	}
+
+	*subject = 0;
+	subject += 10;
+	*body = 0;
+	body += 2;
+
+	res = send(to, subject, body);
+	if (res != 0)
+		warnx("cannot send %s to %s, keeping it queued", path, to);
+	free(data);
+
+	return res == 0;
+}
+
+/* claims of a sender that died are old; rename updates ctime */
+#define CLAIM_TIMEOUT 600
+
+/* return messages claimed longer than CLAIM_TIMEOUT ago to new/ */
+static void
+recover_claims()
+{
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+	char cur[PATH_MAX], path[PATH_MAX], dst[PATH_MAX];
+	time_t now = time(NULL);
+
+	snprintf(cur, PATH_MAX, "%s/cur", cfg.spool_dir);
+
+	dir = opendir(cur);
+	if (dir == NULL)
+		return;
+
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.' ||
+		    snprintf(path, PATH_MAX, "%s/%s", cur, de->d_name) >= PATH_MAX ||
+		    snprintf(dst, PATH_MAX, "%s/new/%s", cfg.spool_dir, de->d_name) >= PATH_MAX)
+			continue;
+		if (stat(path, &st) == 0 && now - st.st_ctime > CLAIM_TIMEOUT && rename(path, dst) == 0)
+			warnx("requeued stale claimed message %s", de->d_name);
+	}
+
+	closedir(dir);
+}
+
+static int
+cmp_names(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+size_t
+spool_drain(size_t batch, spool_sender send)
+{
+	DIR *dir;
+	struct dirent *de;
+	char path[PATH_MAX], claimed[PATH_MAX];
+	char **names = NULL;
+	size_t i, n = 0, cap = 0, sent = 0;
+	bool failed = false;
+
+	recover_claims();
+
+	snprintf(path, PATH_MAX, "%s/new", cfg.spool_dir);
+
+	dir = opendir(path);
+	if (dir == NULL)
+		return 0;
+
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		if (n == cap) {
+			cap = cap == 0 ? 64 : cap * 2;
+			names = realloc(names, cap * sizeof(char *));
+			if (names == NULL)
+				err(1, "cannot allocate spool names");
+		}
+		names[n++] = strdup(de->d_name);
+	}
+
+	closedir(dir);
+
+	qsort(names, n, sizeof(char *), cmp_names);
+
+	for (i = 0; i < n; i++) {
+		/* after a failure smtp is likely down, retry on next pass */
+		if (sent < batch && !failed) {
+			snprintf(path, PATH_MAX, "%s/new/%s", cfg.spool_dir, names[i]);
+			snprintf(claimed, PATH_MAX, "%s/cur/%s", cfg.spool_dir, names[i]);
+			/* rename is atomic, only one sender gets the message */
+			if (rename(path, claimed) != 0) {
+				if (errno != ENOENT)
+					warn("cannot claim %s", path);
+			} else if (send_file(claimed, send)) {
+				unlink(claimed);
+				sent++;
+			} else {
+				failed = true;
+				if (rename(claimed, path) != 0)
+					warn("cannot requeue %s", claimed);
+			}
+		}
+		free(names[i]);
+	}
+
+	free(names);
+
+	return sent;
+}
+
+void
+spool_run(size_t batch, spool_sender send)
+{
+	size_t sent;
+
+	for (;;) {
+		sent = spool_drain(batch, send);
+		if (cfg.debug && sent > 0)
+			fprintf(stderr, "sent %zu queued messages\n", sent);
+		if (sent < batch)
+			sleep(1);
+	}
+}
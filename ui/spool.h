@@ -0,0 +1,24 @@
+#include <stddef.h>
+
+/*
+ * Outgoing mail queue in cfg.spool_dir. Messages are written to tmp/ and
+ * renamed into new/, so the sender never sees a partial message. A sender
+ * claims a message by renaming it into cur/, removes it once it is sent
+ * and moves it back to new/ if sending fails. Each message is sent in its
+ * own SMTP session.
+ */
+
+/* returns 0 if message was sent */
+typedef int (*spool_sender)(const char *to, const char *subject, const char *body);
+
+/* queue message for the sender process and return immediately */
+void spool_enqueue(const char *to, const char *subject, const char *body);
+
+/*
+ * Send up to batch oldest queued messages, stopping at first failure.
+ * Returns number of messages sent.
+ */
+size_t spool_drain(size_t batch, spool_sender send);
+
+/* sender process: drain queue forever, polling when it is empty */
+void spool_run(size_t batch, spool_sender send);
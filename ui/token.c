@@ -0,0 +1,53 @@
+#include "token.h"
+#include <err.h>
+#include <errno.h>
+#include <sys/random.h>
+
+static const char alphabet[64] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+static void
+fill_random(unsigned char *dst, size_t len)
+{
+#ifdef __APPLE__
+	/* getentropy is limited to 256 bytes per call */
+	size_t chunk;
+
+	for (; len > 0; dst += chunk, len -= chunk) {
+		chunk = len > 256 ? 256 : len;
+		if (getentropy(dst, chunk) != 0)
+			err(1, "cannot get random bytes");
+	}
+#else
+	ssize_t n;
+
+	while (len > 0) {
+		n = getrandom(dst, len, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			err(1, "cannot get random bytes");
+		}
+		dst += n;
+		len -= n;
+	}
+#endif
+}
+
+void
+token_generate(char *dst, size_t len)
+{
+	unsigned char bytes[64];
+	size_t i, n;
+
+	while (len > 0) {
+		n = len > sizeof(bytes) ? sizeof(bytes) : len;
+		fill_random(bytes, n);
+		/* 256 is a multiple of 64, so masking keeps characters uniform */
+		for (i = 0; i < n; i++)
+			*dst++ = alphabet[bytes[i] & 63];
+		len -= n;
+	}
+
+	*dst = 0;
+}
@@ -0,0 +1,9 @@
+#include <stddef.h>
+
+#define TOKEN_LEN 22 /* 132 random bits */
+
+/*
+ * Write len random URL-safe characters and terminating zero to dst.
+ * Random bytes come from getrandom(2) without opening any files.
+ */
+void token_generate(char *dst, size_t len);
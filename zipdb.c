@@ -0,0 +1,199 @@
+/**
+ * Serge Voilokov, 2015.
+ * Zip code to NDFD grid point table.
+ */
+
+#include "zipdb.h"
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* NDFD CONUS grid definition (GRIB2 template 3.30) */
+#define EARTH_RADIUS 6371200.0
+#define GRID_DX 2539.703
+#define GRID_LAT1 20.191999
+#define GRID_LON1 -121.554001
+#define GRID_LOV -95.0
+#define GRID_LATIN 25.0
+
+static void
+lambert(double lat, double lon, double *x, double *y)
+{
+	double phi1 = GRID_LATIN * M_PI / 180;
+	double n = sin(phi1);
+	double f = cos(phi1) * pow(tan(M_PI / 4 + phi1 / 2), n) / n;
+	double rho = EARTH_RADIUS * f / pow(tan(M_PI / 4 + lat * M_PI / 360), n);
+	double theta = n * (lon - GRID_LOV) * M_PI / 180;
+
+	*x = rho * sin(theta);
+	*y = -rho * cos(theta);
+}
+
+int
+ndfd_grid_point(double lat, double lon, int *gx, int *gy)
+{
+	double x, y, x1, y1;
+
+	lambert(GRID_LAT1, GRID_LON1, &x1, &y1);
+	lambert(lat, lon, &x, &y);
+
+	*gx = lround((x - x1) / GRID_DX);
+	*gy = lround((y - y1) / GRID_DX);
+
+	if (*gx < 0 || *gx >= NDFD_NX || *gy < 0 || *gy >= NDFD_NY)
+		return -1;
+
+	return 0;
+}
+
+static int
+cmp_records(const void *a, const void *b)
+{
+	const struct zipdb_record *ra = a, *rb = b;
+
+	return ra->zip < rb->zip ? -1 : ra->zip > rb->zip;
+}
+
+int
+zipdb_build(const char *csv_fname, const char *db_fname)
+{
+	FILE *in, *out;
+	char line[256], tmp[PATH_MAX];
+	struct zipdb_record *records = NULL;
+	size_t count = 0, cap = 0, skipped = 0;
+	int zip, gx, gy;
+	double lat, lon;
+	struct zipdb_header hdr = {
+		.magic = ZIPDB_MAGIC,
+		.version = ZIPDB_VERSION
+	};
+
+	in = fopen(csv_fname, "r");
+	if (in == NULL)
+		err(1, "cannot open %s", csv_fname);
+
+	while (fgets(line, sizeof(line), in) != NULL) {
+		if (sscanf(line, "%d,%lf,%lf", &zip, &lat, &lon) != 3)
+			continue; /* header or comment */
+
+		if (ndfd_grid_point(lat, lon, &gx, &gy) != 0) {
+			skipped++;
+			continue;
+		}
+
+		if (count == cap) {
+			cap = cap == 0 ? 1024 : cap * 2;
+			records = realloc(records, cap * sizeof(struct zipdb_record));
+			if (records == NULL)
+				err(1, "cannot allocate zipdb records");
+		}
+
+		records[count++] = (struct zipdb_record) {
+			.zip = zip,
+			.lat = lat,
+			.lon = lon,
+			.gx = gx,
+			.gy = gy
+		};
+	}
+
+	fclose(in);
+
+	qsort(records, count, sizeof(struct zipdb_record), cmp_records);
+	hdr.count = count;
+
+	snprintf(tmp, PATH_MAX, "%s.tmp", db_fname);
+	out = fopen(tmp, "w");
+	if (out == NULL)
+		err(1, "cannot create %s", tmp);
+
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1 ||
+	    fwrite(records, sizeof(struct zipdb_record), count, out) != count ||
+	    fclose(out) != 0)
+		err(1, "cannot write %s", tmp);
+
+	if (rename(tmp, db_fname) != 0)
+		err(1, "cannot rename %s to %s", tmp, db_fname);
+
+	fprintf(stderr, "%s: %zu zips, %zu outside of NDFD grid\n", db_fname, count, skipped);
+	free(records);
+
+	return 0;
+}
+
+int
+zipdb_open(struct zipdb *db, const char *fname)
+{
+	int fd;
+	struct stat st;
+	const struct zipdb_header *hdr;
+
+	memset(db, 0, sizeof(struct zipdb));
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct zipdb_header)) {
+		close(fd);
+		return -1;
+	}
+
+	db->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (db->map == MAP_FAILED) {
+		db->map = NULL;
+		return -1;
+	}
+
+	db->map_size = st.st_size;
+	hdr = db->map;
+
+	if (memcmp(hdr->magic, ZIPDB_MAGIC, sizeof(ZIPDB_MAGIC)) != 0 ||
+	    hdr->version != ZIPDB_VERSION ||
+	    sizeof(struct zipdb_header) + hdr->count * sizeof(struct zipdb_record) > db->map_size) {
+		zipdb_close(db);
+		return -1;
+	}
+
+	db->count = hdr->count;
+	db->records = (const struct zipdb_record *)(hdr + 1);
+
+	return 0;
+}
+
+void
+zipdb_close(struct zipdb *db)
+{
+	if (db->map != NULL)
+		munmap(db->map, db->map_size);
+
+	memset(db, 0, sizeof(struct zipdb));
+}
+
+const struct zipdb_record *
+zipdb_find(const struct zipdb *db, int zip)
+{
+	size_t lo = 0, hi = db->count, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (db->records[mid].zip < (uint32_t)zip)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < db->count && db->records[lo].zip == (uint32_t)zip)
+		return &db->records[lo];
+
+	return NULL;
+}
@@ -0,0 +1,57 @@
+/**
+ * Serge Voilokov, 2015.
+ * Zip code to NDFD grid point table.
+ */
+
+#ifndef ZIPDB_H
+#define ZIPDB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ZIPDB_MAGIC "WXZIPDB"
+#define ZIPDB_VERSION 1
+
+/* NDFD CONUS grid, 2.5 km Lambert conformal */
+#define NDFD_NX 2145
+#define NDFD_NY 1377
+
+struct zipdb_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+};
+
+/* fixed size record, file keeps records sorted by zip */
+struct zipdb_record
+{
+	uint32_t zip;
+	float lat;
+	float lon;
+	uint16_t gx;    /* NDFD grid column */
+	uint16_t gy;    /* NDFD grid row */
+};
+
+struct zipdb
+{
+	void *map;
+	size_t map_size;
+	size_t count;
+	const struct zipdb_record *records;
+};
+
+/* convert "zip,lat,lon" csv lines into binary table */
+int zipdb_build(const char *csv_fname, const char *db_fname);
+
+/* map table read-only; returns -1 if file is missing or invalid */
+int zipdb_open(struct zipdb *db, const char *fname);
+void zipdb_close(struct zipdb *db);
+
+/* binary search; NULL if zip is not in table */
+const struct zipdb_record *zipdb_find(const struct zipdb *db, int zip);
+
+/* NDFD grid cell for coordinates; returns -1 outside of CONUS grid */
+int ndfd_grid_point(double lat, double lon, int *gx, int *gy);
+
+#endif /* ZIPDB_H */